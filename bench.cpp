@@ -0,0 +1,275 @@
+#include "metabinary.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+/* Throughput and latency of the main paths over synthetic documents:
+ *     metabinary_bench [max entities]
+ * Entity counts scale by 100x from 1 up to the maximum (1M by default).
+ */
+
+// Every heap allocation, counted so each operation can report its own.
+// All the replaceable forms are replaced, so none escape the count and each
+// delete frees what its new allocated.
+static std::atomic<size_t> allocations(0);
+
+static void* counted_alloc(size_t size)
+{
+    allocations++;
+    if (void* p = malloc(size != 0 ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+static void* counted_alloc(size_t size, std::align_val_t align)
+{
+    allocations++;
+    size_t alignment = std::max(static_cast<size_t>(align), sizeof(void*));
+    // aligned_alloc wants a size that is a multiple of the alignment
+    if (void* p = aligned_alloc(alignment, (std::max<size_t>(size, 1) + alignment - 1) / alignment * alignment))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size) { return counted_alloc(size); }
+void* operator new[](size_t size) { return counted_alloc(size); }
+void* operator new(size_t size, std::align_val_t align) { return counted_alloc(size, align); }
+void* operator new[](size_t size, std::align_val_t align) { return counted_alloc(size, align); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { free(p); }
+
+namespace bench {
+    using namespace metabinary;
+    using clock = std::chrono::steady_clock;
+
+    // A generated tree, kept in an arena as nothing else frees tags
+    struct document {
+        std::string shape;
+        arena mem;
+        root_tag* root = nullptr;
+        // Compound looked up by the get benchmark, and names it holds
+        compound_tag* lookups = nullptr;
+        std::vector<std::string> names;
+        size_t tags = 0;
+        // Path of one field across the document, for the query benchmark
+        std::string query;
+    };
+
+    // Shaped like the demo's ENTITIES: a uuid and a pos compound per entity
+    static void make_entities(document& doc, size_t count)
+    {
+        arena* mem = &doc.mem;
+        doc.root = mem->make<root_tag>("DEMO METABINARY FILE");
+        doc.root->add(make_tag<string_tag>(mem, "MAP_NAME", "LEVEL1"));
+        doc.root->add(make_tag<uint64_tag>(mem, "MAP_EDIT_TIMESTAMP", 999999));
+        auto entities = make_tag<compound_tag>(mem, "ENTITIES");
+        for (size_t i = 0; i < count; i++) {
+            doc.names.push_back(std::to_string(i + 1));
+            auto entity = make_tag<compound_tag>(mem, doc.names.back());
+            entity->add(make_tag<uint64_tag>(mem, "uuid", 42069 + i));
+            auto pos = make_tag<compound_tag>(mem, "pos");
+            pos->add(make_tag<float_tag>(mem, "x", 0.25f * i));
+            pos->add(make_tag<float_tag>(mem, "y", 0.5f * i));
+            pos->add(make_tag<float_tag>(mem, "angle", 3.1415f));
+            entity->add(pos);
+            entities->add(entity);
+        }
+        doc.root->add(entities);
+        doc.lookups = entities;
+        doc.tags = 4 + count * 6;
+        doc.query = "ENTITIES/*/pos/x";
+    }
+    // One compound per level, each holding a counter and a short string
+    static void make_deep(document& doc, size_t depth)
+    {
+        arena* mem = &doc.mem;
+        doc.root = mem->make<root_tag>("DEEP");
+        compound_tag* level = doc.root;
+        for (size_t i = 0; i < depth; i++) {
+            level->add(make_tag<uint32_tag>(mem, "depth", i));
+            level->add(make_tag<string_tag>(mem, "label", "level"));
+            auto child = make_tag<compound_tag>(mem, "child");
+            level->add(child);
+            level = child;
+        }
+        doc.lookups = doc.root;
+        doc.names = {"depth", "label", "child"};
+        doc.tags = 1 + depth * 3;
+    }
+    // Scalars side by side in the root
+    static void make_wide(document& doc, size_t count)
+    {
+        arena* mem = &doc.mem;
+        doc.root = mem->make<root_tag>("WIDE");
+        for (size_t i = 0; i < count; i++) {
+            doc.names.push_back("field_" + std::to_string(i));
+            doc.root->add(make_tag<uint32_tag>(mem, doc.names.back(), i));
+        }
+        doc.lookups = doc.root;
+        doc.tags = 1 + count;
+    }
+    // A few big strings, where copying dominates
+    static void make_large_strings(document& doc, size_t count, size_t size)
+    {
+        arena* mem = &doc.mem;
+        doc.root = mem->make<root_tag>("STRINGS");
+        std::string text(size, 'x');
+        for (size_t i = 0; i < count; i++) {
+            doc.names.push_back("text_" + std::to_string(i));
+            doc.root->add(make_tag<string_tag>(mem, doc.names.back(), text));
+        }
+        doc.lookups = doc.root;
+        doc.tags = 1 + count;
+    }
+
+    // Timings of repeated runs of one operation
+    struct samples {
+        std::vector<double> seconds;
+        size_t allocations = 0;
+
+        double percentile(double p)
+        {
+            std::sort(seconds.begin(), seconds.end());
+            return seconds[std::min(seconds.size() - 1, (size_t)(p * seconds.size()))];
+        }
+    };
+    template<typename Op>
+    static samples measure(size_t runs, Op op)
+    {
+        samples result;
+        size_t before = allocations;
+        for (size_t i = 0; i < runs; i++) {
+            auto start = clock::now();
+            op();
+            result.seconds.push_back(std::chrono::duration<double>(clock::now() - start).count());
+        }
+        result.allocations = allocations - before;
+        return result;
+    }
+    static void report(const document& doc, const char* op, samples s, size_t runs, size_t bytes, size_t tags)
+    {
+        double p50 = s.percentile(0.5), p99 = s.percentile(0.99);
+        std::string rate = bytes != 0 ? std::to_string((int64_t)(bytes / p50 / 1e6)) : "-";
+        printf("%-24s %-12s %10s %12.3g %10.1f %12.3f %12.3f\n", doc.shape.c_str(), op, rate.c_str(),
+            tags / p50, (double) s.allocations / runs, p50 * 1e6, p99 * 1e6);
+    }
+    static void run(document& doc)
+    {
+        std::vector<uint8_t> bytes(doc.root->serialized_size());
+        // Roughly 256MB of work per operation, within sane bounds
+        size_t runs = std::clamp<size_t>((256 << 20) / bytes.size(), 5, 2000);
+
+        auto serialize = measure(runs, [&] {
+            span_sink out(bytes.data(), bytes.size());
+            doc.root->serialize_to(out);
+        });
+        report(doc, "serialize", serialize, runs, bytes.size(), doc.tags);
+
+        parallel_serializer writer;
+        auto parallel = measure(runs, [&] {
+            span_sink out(bytes.data(), bytes.size());
+            writer.serialize_to(out, *doc.root);
+        });
+        report(doc, "serialize mt", parallel, runs, bytes.size(), doc.tags);
+
+        // Arena released between runs, outside the timing
+        samples read;
+        arena mem;
+        for (size_t i = 0; i < runs; i++) {
+            auto run = measure(1, [&] { deserialize(bytes.data(), bytes.size(), mem); });
+            read.seconds.push_back(run.seconds[0]);
+            read.allocations += run.allocations;
+            mem.release();
+        }
+        report(doc, "deserialize", read, runs, bytes.size(), doc.tags);
+
+        // The same, from a document whose compounds carry their length
+        std::vector<uint8_t> sized;
+        vector_sink sized_out(sized);
+        document_writer(doc_sized_compounds).serialize_to(sized_out, *doc.root);
+        samples read_sized;
+        for (size_t i = 0; i < runs; i++) {
+            auto run = measure(1, [&] { deserialize(sized.data(), sized.size(), mem); });
+            read_sized.seconds.push_back(run.seconds[0]);
+            read_sized.allocations += run.allocations;
+            mem.release();
+        }
+        report(doc, "deser sized", read_sized, runs, sized.size(), doc.tags);
+
+        // Flat nodes in place of tag objects, loaded from and written back to the same bytes
+        compact_tree tree;
+        auto load = measure(runs, [&] { tree.load(document_view(bytes.data(), bytes.size()).root()); });
+        report(doc, "compact load", load, runs, bytes.size(), doc.tags);
+        auto compact = measure(runs, [&] {
+            span_sink out(bytes.data(), bytes.size());
+            tree.serialize_to(out);
+        });
+        report(doc, "compact ser", compact, runs, bytes.size(), doc.tags);
+
+        // One column pulled straight out of the serialized bytes
+        if (!doc.query.empty()) {
+            path_query query(doc.query);
+            std::vector<float> column;
+            auto extract = measure(runs, [&] {
+                column.clear();
+                query.extract(document_view(bytes.data(), bytes.size()).root(), column);
+            });
+            report(doc, "query", extract, runs, bytes.size(), column.size());
+        }
+
+        // Batches of lookups, as one get is close to the resolution of the clock
+        const size_t batch = 64;
+        std::mt19937 rng(42);
+        std::vector<const std::string*> keys;
+        for (size_t i = 0; i < 100000; i++)
+            keys.push_back(&doc.names[rng() % doc.names.size()]);
+        size_t next = 0;
+        tag* volatile found;
+        auto get = measure(keys.size() / batch, [&] {
+            for (size_t i = 0; i < batch; i++)
+                found = doc.lookups->get(*keys[next++]);
+        });
+        (void) found;
+        for (auto& seconds : get.seconds)
+            seconds /= batch;
+        report(doc, "get", get, keys.size(), 0, 1);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    size_t max_entities = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+    printf("%-24s %-12s %10s %12s %10s %12s %12s\n", "shape", "op", "MB/s", "tags/s", "allocs/op", "p50 us", "p99 us");
+    for (size_t count = 1; count <= max_entities; count *= 100) {
+        bench::document doc;
+        doc.shape = "entities " + std::to_string(count);
+        bench::make_entities(doc, count);
+        bench::run(doc);
+    }
+    struct shape {
+        const char* name;
+        void (*make)(bench::document&);
+    };
+    for (auto s : std::initializer_list<shape>{
+            {"deep 1000", [](bench::document& doc) { bench::make_deep(doc, 1000); }},
+            {"wide 100000", [](bench::document& doc) { bench::make_wide(doc, 100000); }},
+            {"strings 64 x 1MB", [](bench::document& doc) { bench::make_large_strings(doc, 64, 1 << 20); }},
+        }) {
+        bench::document doc;
+        doc.shape = s.name;
+        s.make(doc);
+        bench::run(doc);
+    }
+    return 0;
+}
@@ -1,571 +1,1704 @@
-#include <iostream>
-#include <map>
-#include <fstream>
-#include <vector>
-#include <netinet/in.h>
-#include <cstring>
-#include <cassert>
-
-
-/* Metabinary is envisioned as a standard protocol for;
- * high performance networking, as well as a versatile storage format for data;
- * encoding both large blocks and small metadata tokens in a single binary file.
- *
- */
-namespace metabinary {
-
-#pragma region Write Primitives
-    // Functions for byte array IO
-    // Handles endianness of integer types
-    // All integer types are written to NetworkByteOrder (big endian)
-    // and read back into HostByteOrder (lil endian for x86)
-
-    // Writes an 8-bit unsigned int (1-byte) to the buffer at the given index
-    static int write_uint8(uint8_t* buf, int index, uint8_t val)      {
-        int offset = index;
-        buf[offset] = htons(val);
-        offset++;
-        return offset-index;
-    }
-    // Writes a 16-bit unsigned int (2-bytes) to the buffer at the given index
-    static int write_uint16(uint8_t* buf, int index, uint16_t val)    {
-        int offset = index;
-        uint16_t data = htons(val);
-        memcpy(buf+offset, &data, sizeof(uint16_t));
-        offset += sizeof(uint16_t);
-        return offset - index;
-    }
-    // Writes a 32-bit unsigned int (4 bytes) to the buffer at the given index
-    static int write_uint32(uint8_t* buf, int index, uint32_t val)    {
-        int offset = index;
-        uint32_t data = htonl(val);
-        memcpy(buf+offset, &data, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
-        return offset - index;
-    }
-    // Writes a 64-bit unsigned int (8 bytes) to the buffer at the given index
-    static int write_uint64(uint8_t* buf, int index, uint64_t val)    {
-        int offset = index;
-        uint64_t data = htonl(val);
-        memcpy(buf+offset, &data, sizeof(uint64_t));
-        offset += sizeof(uint64_t);
-        return offset - index;
-    }
-    // Writes an 8-bit signed int (1-byte) to the buffer at the index
-    static int write_int8(uint8_t* buf, int index, int8_t val)         {
-        int offset = index;
-        int8_t data = htons(val);
-        memcpy(buf+offset, &data, sizeof(int8_t));
-        offset += sizeof(int8_t);
-        return offset - index;
-    }
-    // Writes a 16-bit signed int (2-bytes) to the buffer at the index
-    static int write_int16(uint8_t* buf, int index, int16_t val)       {
-        int offset = index;
-        int16_t data = htons(val);
-        memcpy(buf+offset, &data, sizeof(int16_t));
-        offset += sizeof(int16_t);
-        return offset - index;
-    }
-    // Writes a 32-bit signed int (4-bytes) to the buffer at the index
-    static int write_int32(uint8_t* buf, int index, int32_t val)       {
-        int offset = index;
-        int32_t data = htonl(val);
-        memcpy(buf+offset, &data, sizeof(int32_t));
-        offset += sizeof(int32_t);
-        return offset - index;
-    }
-    // Writes a 64-bit signed int (8-bytes) to the buffer at the index
-    static int write_int64(uint8_t* buf, int index, int64_t val)       {
-        int offset = index;
-        int64_t data = htonl(val);
-        memcpy(buf+offset, &data, sizeof(int64_t));
-        offset += sizeof(int64_t);
-        return offset - index;
-    }
-    // Writes a 32-bit IEEE 754 float
-    static int write_float(uint8_t* buf, int index, float val)        {
-        int offset = index;
-        memcpy(buf+offset, &val, sizeof(val));
-        offset += sizeof(float);
-        return offset - index;
+#include "metabinary.hpp"
+#include <csignal>
+#include <set>
+#include <sys/resource.h>
+
+namespace tests {
+    struct schema_pos { float x, y, angle; };
+    struct schema_entity {
+        uint64_t uuid;
+        schema_pos pos;
+        std::string label;
+        int16_t team;
+    };
+}
+template<> struct metabinary::schema<tests::schema_pos> {
+    static constexpr auto fields = std::make_tuple(
+        metabinary::field("x", &tests::schema_pos::x),
+        metabinary::field("y", &tests::schema_pos::y),
+        metabinary::field("angle", &tests::schema_pos::angle));
+};
+template<> struct metabinary::schema<tests::schema_entity> {
+    static constexpr auto fields = std::make_tuple(
+        metabinary::field("uuid", &tests::schema_entity::uuid),
+        metabinary::field("pos", &tests::schema_entity::pos),
+        metabinary::field("label", &tests::schema_entity::label),
+        metabinary::field("team", &tests::schema_entity::team));
+};
+
+namespace tests {
+    void uint64_roundtrip_test() {
+        uint64_t begin = 40269;
+        uint8_t buf[sizeof(uint64_t)];
+        metabinary::write_uint64(buf, 0, begin);
+        uint64_t result = metabinary::read_uint64(buf, 0);
+        assert(begin == result && "YE NOTHIN");
     }
-    // Writes a 64-bit IEEE 754 float
-    static int write_double(uint8_t* buf, int index, double val)      {
-        int offset = index;
-        memcpy(buf+offset, &val, sizeof(val));
-        offset += sizeof(double);
-        return offset - index;
+    void uint32_roundtrip_test() {
+        uint32_t begin = 42069;
+        uint8_t buf[sizeof(uint32_t)];
+        metabinary::write_uint32(buf, 0, begin);
+        uint32_t result = metabinary::read_uint32(buf, 0);
+        assert(begin == result && "DAWSH");
     }
-    // Writes a UTF8 String with it's length prefixed as a 16-bit unsigned int
-    static int write_string(uint8_t* buf, int index, std::string val) {
-        int offset = index;
-        // Add Payload Length
-        offset += write_uint32(buf, offset, htonl(val.length()));
-        // Add Payload (As UTF8-Encoded String)
-        memcpy(buf+offset, &val, val.length());
-        offset += val.length();
-        return offset - index;
+    void uint16_roundtrip_test() {
+        uint16_t begin = 42069;
+        uint8_t buf[sizeof(uint16_t)];
+        metabinary::write_uint16(buf, 0, begin);
+        uint16_t result = metabinary::read_uint16(buf, 0);
+        assert(begin == result && "DAWSH");
     }
-#pragma endregion
-#pragma region Read Primitives
-    static uint8_t read_uint8(uint8_t* buf, int index)   {
-        uint8_t outpt = 0;
-        memcpy(&outpt, buf+index, sizeof(uint8_t));
-        return outpt;
+    void uint8_roundtrip_test() {
+        // lol
+        uint8_t begin = 255;
+        uint8_t buf[sizeof(uint8_t)];
+        metabinary::write_uint8(buf, 0, begin);
+        uint8_t result = metabinary::read_uint8(buf, 0);
+        assert(begin == result);
     }
-    static uint16_t read_uint16(uint8_t* buf, int index) {
-        uint16_t outpt = 0;
-        memcpy(&outpt, buf+index, sizeof(uint16_t));
-        return ntohs(outpt);
+    void int64_roundtrip_test() { }
+    void int32_roundtrip_test() { }
+    void int16_roundtrip_test() { }
+    void int8_roundtrip_test() {
+
     }
-    static uint32_t read_uint32(uint8_t* buf, int index) {
-        uint32_t outpt = 0;
-        memcpy(&outpt, buf+index, sizeof(uint32_t));
-        return ntohl(outpt);
+    void string_roundtrip_test() {
+        std::string begin = "AYYO WHATS UP BABY";
+        uint8_t buf[metabinary::string_size(begin)];
+        metabinary::write_string(buf, 0, begin);
+        std::string result = metabinary::read_string(buf, 0);
+        std::cout << begin << std::endl;
+        std::cout << result << std::endl;
+        assert(begin == result);
     }
-    static uint64_t read_uint64(uint8_t* buf, int index) {
-        uint64_t outpt = 0;
-        memcpy(&outpt, buf+index, sizeof(uint64_t));
-        return ntohl(outpt);
+    // Reports a size near the int limit without holding the bytes, to measure trees past it
+    struct oversized_tag : metabinary::tag {
+        int serialized_size() const override { return INT_MAX / 4 * 3; }
+    };
+    void serialized_size_test() {
+        using namespace metabinary;
+        compound_tag doc {"doc", {
+            new uint16_tag{"id", 64},
+            new string_tag{"custom_name", "a name longer than the std::string object itself"},
+            new compound_tag{"pos", {
+                new float_tag{"x", 0.25f},
+                new double_tag{"y", 0.5},
+            }},
+        }};
+        std::vector<uint8_t> out;
+        vector_sink vec(out);
+        int written = doc.serialize_to(vec);
+        assert(written == doc.serialized_size());
+        assert(out.size() == (size_t)written);
+
+        // Exact fit succeeds, one byte short is refused without touching the buffer
+        std::vector<uint8_t> fixed(written);
+        span_sink exact(fixed.data(), written);
+        assert(doc.serialize_to(exact) == written);
+        assert(fixed == out);
+        span_sink tight(fixed.data(), written - 1);
+        assert(doc.serialize_to(tight) == -1);
+
+        // Trees past what an int addresses measure as -1 and are refused, not wrapped
+        compound_tag huge {"huge", {new oversized_tag, new oversized_tag}};
+        compressed_compound_tag packed {"packed", {new oversized_tag, new oversized_tag}};
+        compound_tag one {"one", {new oversized_tag}};
+        assert(one.serialized_size() > 0);
+        for (compound_tag* t : {&huge, static_cast<compound_tag*>(&packed)}) {
+            assert(t->serialized_size() == -1);
+            std::vector<uint8_t> none;
+            vector_sink sink(none);
+            assert(t->serialize_to(sink) == -1 && none.empty());
+            assert(parallel_serializer(2, 0).serialize_to(sink, *t) == -1 && none.empty());
+            assert(document_writer().serialize_to(sink, *t) == -1 && none.empty());
+        }
     }
-    static int8_t read_int8(uint8_t* buf, int index)      {
-        int8_t outpt = 0;
-        memcpy(&outpt, buf+index, sizeof(int8_t));
-        return ntohs(outpt);
+    void mapped_view_test() {
+        using namespace metabinary;
+        root_tag doc {"DEMO", {
+            new string_tag{"MAP_NAME", "LEVEL1"},
+            new uint64_tag{"MAP_EDIT_TIMESTAMP", 66642044469},
+            new compound_tag{"SHADERCACHE"},
+            new compound_tag{"ENTITIES", {
+                new compound_tag{"1", {
+                    new uint8_tag{"flags", 200},
+                    new sint8_tag{"team", -3},
+                    new compound_tag{"pos", {
+                        new float_tag{"x", 0.25f},
+                        new double_tag{"y", -1.5},
+                    }},
+                }},
+            }},
+        }};
+        char path[] = "/tmp/metabinary_view_XXXXXX";
+        int fd = mkstemp(path);
+        fd_sink out(fd);
+        int written = doc.serialize_to(out);
+        close(fd);
+
+        {
+            mapped_file file(path);
+            assert(file.is_open() && file.size() == (size_t)written);
+            tag_view root = file.root();
+            assert(root.name() == "DEMO");
+            assert(root.size() == file.size());
+            assert(root.find("MAP_NAME").as_string() == "LEVEL1");
+            assert(root.find("MAP_EDIT_TIMESTAMP").as_uint64() == 66642044469);
+            assert(root.find("SHADERCACHE").valid() && root.find("SHADERCACHE").begin() == root.end());
+            tag_view entity = root.find("ENTITIES").find("1");
+            assert(entity.find("flags").as_uint8() == 200);
+            assert(entity.find("team").as_sint8() == -3);
+            assert(entity.find("pos").find("x").as_float() == 0.25f);
+            assert(entity.find("pos").find("y").as_double() == -1.5);
+            // Misses and type mismatches don't throw or read garbage
+            assert(!root.find("SHORTY").valid());
+            assert(root.find("MAP_NAME").as_uint32() == 0);
+
+            // Eager read back produces the same bytes
+            root_tag copy = deserialize(file.data(), file.size());
+            std::vector<uint8_t> original, again;
+            vector_sink a(original), b(again);
+            doc.serialize_to(a);
+            copy.serialize_to(b);
+            assert(original == again);
+
+            // A truncated file yields no tags past the cut
+            tag_view cut(file.data(), file.data() + file.size() / 2);
+            assert(cut.size() == 0);
+            assert(!cut.find("ENTITIES").valid());
+        }
+        unlink(path);
     }
-    static int16_t read_int16(uint8_t* buf, int index)    {
-        int16_t outpt = 0;
-        memcpy(&outpt, buf+index, sizeof(int16_t));
-        return ntohs(outpt);
+    void compound_index_test() {
+        using namespace metabinary;
+        compound_tag small {"small", {
+            new uint16_tag{"a", 1},
+            new uint16_tag{"b", 2},
+        }};
+        assert(small.find("b") != nullptr && small.find("b")->name == "b");
+        assert(small.find("c") == nullptr);
+
+        compound_tag entities {"ENTITIES"};
+        for (int i = 1; i <= 1000; i++)
+            entities.add(new uint32_tag{std::to_string(i), (uint32_t)i});
+        std::vector<uint8_t> before;
+        vector_sink out(before);
+        entities.serialize_to(out);
+
+        assert(entities.find("500")->name == "500");
+        assert(entities.find("1000") != nullptr);
+        assert(entities.find("0") == nullptr);
+        assert(entities.get(std::string("1")) == entities.find("1"));
+
+        // Children added after the index exists are found, duplicates resolve to the first
+        tag* first_dup = entities.find("7");
+        entities.add(new uint32_tag{"7", 7});
+        entities.add(new uint32_tag{"late", 1});
+        assert(entities.find("7") == first_dup);
+        assert(entities.find("late") != nullptr);
+        for (int i = 0; i < 2000; i++)
+            entities.add(new uint32_tag{"grow" + std::to_string(i), 0});
+        assert(entities.find("grow1999") != nullptr && entities.find("500")->name == "500");
+
+        // Indexing doesn't change the serialized order
+        std::vector<uint8_t> after;
+        vector_sink again(after);
+        entities.serialize_to(again);
+        assert(std::equal(before.begin(), before.end() - 1, after.begin()));
     }
-    static int32_t read_int32(uint8_t* buf, int index)    {
-        int32_t outpt = 0;
-        memcpy(&outpt, buf+index, sizeof(int32_t));
-        return ntohl(outpt);
+    void arena_test() {
+        using namespace metabinary;
+        std::string long_name(100, 'n');
+        root_tag heap {"DEMO", {
+            new string_tag{"MAP_NAME", "a payload string far too long for small string storage"},
+            new compound_tag{"ENTITIES", {
+                new compound_tag{long_name, {
+                    new uint64_tag{"uuid", 42069},
+                    new float_tag{"x", 0.25f},
+                }},
+            }},
+        }};
+        arena mem(256);
+        auto built = mem.make<root_tag>("DEMO", {
+            mem.make<string_tag>("MAP_NAME", "a payload string far too long for small string storage"),
+            mem.make<compound_tag>("ENTITIES", {
+                mem.make<compound_tag>(long_name, {
+                    mem.make<uint64_tag>("uuid", 42069),
+                    mem.make<float_tag>("x", 0.25f),
+                }),
+            }),
+        });
+        std::vector<uint8_t> expected, actual;
+        vector_sink a(expected), b(actual);
+        heap.serialize_to(a);
+        built->serialize_to(b);
+        assert(expected == actual);
+
+        // Names, strings and child arrays all come out of the arena
+        auto entities = static_cast<compound_tag*>(built->find("ENTITIES"));
+        assert(entities->find(long_name)->name.get_allocator().resource() == mem.memory());
+        assert(built->name.get_allocator().resource() == mem.memory());
+        assert(heap.name.get_allocator().resource() == std::pmr::get_default_resource());
+
+        // Reading back into an arena, then dropping everything at once
+        arena parsed;
+        root_tag* copy = deserialize(expected.data(), expected.size(), parsed);
+        std::vector<uint8_t> again;
+        vector_sink c(again);
+        copy->serialize_to(c);
+        assert(again == expected);
+        parsed.release();
+        mem.release();
+
+        // Heap compounds delete their heap children, through tag* too, and leave arena ones
+        struct counted : uint8_tag {
+            int& alive;
+            counted(std::string_view name, int& alive) : uint8_tag(name, 0), alive(alive) { alive++; }
+            ~counted() override { alive--; }
+        };
+        int alive = 0;
+        arena kept;
+        counted* in_arena = kept.make<counted>("arena", alive);
+        tag* owner = new compound_tag("OWNER", {
+            new counted("a", alive),
+            new compound_tag("inner", {new counted("b", alive), in_arena}),
+        });
+        assert(alive == 3 && in_arena->in_arena);
+        delete owner;
+        assert(alive == 1);
+        compound_tag moved_from("M", {new counted("c", alive)});
+        compound_tag moved(std::move(moved_from));
+        assert(moved_from.children().empty() && moved.children().size() == 1);
+        dispose(moved.remove("c"));
+        dispose(in_arena);
+        assert(alive == 1 && moved.children().empty());
     }
-    static int64_t read_int64(uint8_t* buf, int index)    {
-        int64_t outpt = 0;
-        memcpy(&outpt, buf+index, sizeof(int64_t));
-        return ntohl(outpt);
+    void packed_list_test() {
+        using namespace metabinary;
+        // Vector swaps agree with the scalar loop on either side of every block boundary
+        uint8_t src[8 * 70], simd[8 * 70], scalar[8 * 70];
+        for (size_t i = 0; i < sizeof(src); i++)
+            src[i] = (uint8_t)(i * 7 + 3);
+        for (int width : {2, 4, 8}) {
+            for (size_t count = 0; count <= 70; count++) {
+                bswap_copy(simd, src, count, width);
+                bswap_scalar(scalar, src, count, width);
+                assert(memcmp(simd, scalar, count * width) == 0);
+            }
+            memcpy(simd, src, sizeof(src));
+            bswap_copy(simd, simd, sizeof(src) / width, width);
+            bswap_scalar(scalar, src, sizeof(src) / width, width);
+            assert(memcmp(simd, scalar, sizeof(src)) == 0);
+        }
+
+        // Each element is encoded as its scalar tag would encode it
+        std::vector<uint32_t> ids;
+        for (uint32_t i = 0; i < 37; i++)
+            ids.push_back(i * 0x01020304u);
+        list_tag<uint32_t> id_list("ids", ids.data(), ids.size());
+        std::vector<uint8_t> encoded(id_list.serialized_size());
+        id_list.serialize(encoded.data(), 0);
+        int elements = id_list.serialized_size() - ids.size() * sizeof(uint32_t);
+        for (size_t i = 0; i < ids.size(); i++)
+            assert(read_uint32(encoded.data(), elements + i * sizeof(uint32_t)) == ids[i]);
+
+        uint8_t texture[] = {0, 1, 2, 254, 255};
+        root_tag doc {"terrain", {
+            new list_tag<int16_t>{"heights", {-1, 0, 1, 32767, -32768}},
+            new list_tag<float>{"xs", {0.25f, 0.5f, 3.1415f}},
+            new list_tag<uint64_t>{"empty"},
+            new byte_array_tag{"texture", texture, sizeof(texture)},
+            new list_tag<uint32_t>("ids", ids.data(), ids.size()),
+        }};
+        std::vector<uint8_t> bytes;
+        vector_sink out(bytes);
+        doc.serialize_to(out);
+
+        tag_view root(bytes.data(), bytes.data() + bytes.size());
+        assert(root.size() == bytes.size());
+        int16_t heights[8];
+        assert(root.find("heights").list_type() == tag_sint16);
+        assert(root.find("heights").copy_list(heights, 8) == 5);
+        assert(heights[0] == -1 && heights[3] == 32767 && heights[4] == -32768);
+        float xs[3];
+        assert(root.find("xs").copy_list(xs, 3) == 3 && xs[2] == 3.1415f);
+        assert(root.find("xs").copy_list(heights, 8) == 0);
+        assert(root.find("empty").list_size() == 0 && root.find("empty").list_type() == tag_uint64);
+        assert(root.find("texture").as_bytes().size == sizeof(texture));
+        assert(memcmp(root.find("texture").as_bytes().data, texture, sizeof(texture)) == 0);
+
+        root_tag copy = deserialize(bytes.data(), bytes.size());
+        auto copied_ids = static_cast<list_tag<uint32_t>*>(copy.find("ids"));
+        assert(std::equal(ids.begin(), ids.end(), copied_ids->values().begin()));
+        std::vector<uint8_t> again;
+        vector_sink b(again);
+        copy.serialize_to(b);
+        assert(again == bytes);
+
+        // Streamed a byte at a time, the pieces reassemble to the encoded elements
+        struct array_collector : stream_handler {
+            std::vector<uint8_t> data;
+            uint32_t count = 0;
+            void begin_array(std::string_view name, tag_type_t element_type, uint32_t n) override {
+                if (name == "ids")
+                    count = n;
+            }
+            void array_data(const uint8_t* piece, size_t len) override {
+                if (count != 0)
+                    data.insert(data.end(), piece, piece + len);
+            }
+            void end_array() override { count = 0; }
+        } collector;
+        stream_reader reader(collector);
+        for (size_t i = 0; i < bytes.size(); i++)
+            assert(reader.feed(bytes.data() + i, 1));
+        assert(reader.finished());
+        std::vector<uint32_t> streamed(collector.data.size() / sizeof(uint32_t));
+        read_array(collector.data.data(), 0, streamed.data(), streamed.size());
+        assert(streamed == ids);
     }
-    static float read_float(uint8_t* buf, int index)      {
-        float outpt = 0;
-        memcpy(&outpt, buf+index, sizeof(float));
-        return outpt;
+    void schema_test() {
+        using namespace metabinary;
+        schema_entity entity {66642044469, {0.25f, -0.5f, 3.1415f}, "grunt", -2};
+        compound_tag tree {"1", {
+            new uint64_tag{"uuid", 66642044469},
+            new compound_tag{"pos", {
+                new float_tag{"x", 0.25f},
+                new float_tag{"y", -0.5f},
+                new float_tag{"angle", 3.1415f},
+            }},
+            new string_tag{"label", "grunt"},
+            new sint16_tag{"team", -2},
+        }};
+        std::vector<uint8_t> expected, actual;
+        vector_sink a(expected), b(actual);
+        tree.serialize_to(a);
+        assert(serialize_record(b, "1", entity) == tree.serialized_size());
+        assert(actual == expected);
+        assert(std::get<2>(schema<schema_pos>::fields).name() == "angle");
+
+        // Exact layout takes the memcmp path
+        schema_entity back {};
+        assert(read_record(tag_view(actual.data(), actual.data() + actual.size()), back));
+        assert(back.uuid == entity.uuid && back.pos.angle == 3.1415f && back.label == "grunt" && back.team == -2);
+
+        // Reordered and missing fields are found by name instead
+        compound_tag shuffled {"1", {
+            new sint16_tag{"team", 7},
+            new compound_tag{"pos", {
+                new float_tag{"angle", 1.0f},
+                new float_tag{"x", 2.0f},
+            }},
+            new string_tag{"extra", "ignored"},
+            new uint64_tag{"uuid", 5},
+        }};
+        std::vector<uint8_t> other;
+        vector_sink c(other);
+        shuffled.serialize_to(c);
+        schema_entity patched = entity;
+        assert(read_record(tag_view(other.data(), other.data() + other.size()), patched));
+        assert(patched.uuid == 5 && patched.team == 7 && patched.label == "grunt");
+        assert(patched.pos.x == 2.0f && patched.pos.y == -0.5f && patched.pos.angle == 1.0f);
     }
-    static double read_double(uint8_t* buf, int index)    {
-        double outpt = 0;
-        memcpy(&outpt, buf+index, sizeof(double));
-        return outpt;
+    void interned_names_test() {
+        using namespace metabinary;
+        root_tag doc {"DEMO", {
+            new string_tag{"MAP_NAME", "LEVEL1"},
+            new compound_tag{"ENTITIES"},
+        }};
+        auto entities = static_cast<compound_tag*>(doc.find("ENTITIES"));
+        for (int i = 1; i <= 50; i++)
+            entities->add(new compound_tag{std::to_string(i), {
+                new uint64_tag{"uuid", (uint64_t)i},
+                new compound_tag{"pos", {
+                    new float_tag{"x", 0.25f},
+                    new float_tag{"y", 0.5f},
+                    new float_tag{"angle", 3.1415f},
+                }},
+            }});
+        std::vector<uint8_t> plain, interned;
+        vector_sink a(plain), b(interned);
+        doc.serialize_to(a);
+        name_table names;
+        document_writer writer(doc_interned_names, &names);
+        assert(writer.serialize_to(b, doc) == writer.serialized_size(doc));
+        assert(interned.size() * 3 < plain.size() * 2);
+
+        document_view view(interned.data(), interned.size());
+        assert(view.valid() && view.flags() == doc_interned_names);
+        tag_view root = view.root();
+        assert(root.name() == "DEMO" && root.size() != 0);
+        assert(root.find("MAP_NAME").as_string() == "LEVEL1");
+        assert(root.find("ENTITIES").find("42").find("pos").find("angle").as_float() == 3.1415f);
+
+        // Reading back gives the same tree as the plain encoding
+        root_tag copy = deserialize(interned.data(), interned.size());
+        std::vector<uint8_t> again;
+        vector_sink c(again);
+        copy.serialize_to(c);
+        assert(again == plain);
+
+        // Headerless data reads as a plain document, unknown flags are refused
+        document_view legacy(plain.data(), plain.size());
+        assert(legacy.valid() && legacy.flags() == 0 && legacy.root().find("MAP_NAME").valid());
+        interned[5] |= 0x80;
+        assert(!document_view(interned.data(), interned.size()).valid());
+
+        // Lookups by interned key compare ids, in small and indexed compounds alike
+        name_key uuid = names.find("uuid"), forty_two = names.find("42");
+        assert(uuid.id != 0 && forty_two.id != 0 && names.find("nope").id == 0);
+        auto entity = static_cast<compound_tag*>(entities->find(forty_two));
+        assert(entity != nullptr && entity->name == "42");
+        assert(entity->find(uuid) == entity->find("uuid"));
+        assert(entities->find(names.find("nope")) == nullptr);
+
+        // Keys from another table are matched by name, whatever their ids
+        name_table other;
+        for (const char* name : {"a", "b", "c", "d"})
+            other.intern(name);
+        name_key unrelated = other.intern("unrelated"), other_uuid = other.intern("uuid");
+        assert(unrelated.id == uuid.id && other_uuid.id != uuid.id);
+        assert(entity->find(unrelated) == nullptr);
+        assert(entity->find(other_uuid) == entity->find("uuid"));
+
+        // A writer's own table holds only the tree it is writing
+        compound_tag second("SECOND", {new uint8_tag("only", 1)});
+        document_writer reused(doc_interned_names);
+        std::vector<uint8_t> first_out, second_out, fresh_out;
+        vector_sink first_sink(first_out), second_sink(second_out), fresh_sink(fresh_out);
+        reused.serialize_to(first_sink, doc);
+        reused.serialize_to(second_sink, second);
+        document_writer(doc_interned_names).serialize_to(fresh_sink, second);
+        assert(second_out == fresh_out);
     }
-    static std::string read_string(uint8_t* buf, int index) {
-        uint32_t str_len = read_uint32(buf, index);
-        char val[str_len];
-        memcpy(&val, buf+index, str_len);
-        std::string out(val, str_len);
-        return out;
+    void compact_ints_test() {
+        using namespace metabinary;
+        // The one-load decoder agrees with the byte loop at every length
+        uint8_t buf[16];
+        for (int bits = 0; bits <= 64; bits++) {
+            for (uint64_t val : {bits == 64 ? ~0ull : (1ull << bits) - 1, bits == 64 ? 0ull : 1ull << bits}) {
+                int len = write_varint(buf, 0, val);
+                assert(len == varint_size(val));
+                memset(buf + len, 0xff, sizeof(buf) - len);
+                uint64_t fast, slow;
+                assert(read_varint(buf, buf + sizeof(buf), fast) == len && fast == val);
+                assert(read_varint(buf, buf + len, slow) == len && slow == val);
+                assert(read_varint(buf, buf + len - 1, slow) == 0);
+            }
+        }
+        // Ten byte varints carrying more than 64 bits are refused, not truncated
+        uint8_t overlong[16];
+        memset(overlong, 0x80, 9);
+        memset(overlong + 10, 0, sizeof(overlong) - 10);
+        uint64_t wide;
+        overlong[9] = 0x01;
+        assert(read_varint(overlong, overlong + sizeof(overlong), wide) == 10 && wide == 1ull << 63);
+        overlong[9] = 0x02;
+        assert(read_varint(overlong, overlong + sizeof(overlong), wide) == 0);
+        overlong[9] = 0x7f;
+        assert(read_varint(overlong, overlong + 10, wide) == 0);
+        for (int64_t val : std::initializer_list<int64_t>{0, -1, 1, -64, 63, INT64_MIN, INT64_MAX})
+            assert(zigzag_decode(zigzag_encode(val)) == val);
+        assert(zigzag_encode(-1) == 1 && zigzag_encode(1) == 2);
+
+        root_tag doc {"DEMO", {
+            new uint16_tag{"small", 5},
+            new uint32_tag{"medium", 300},
+            new uint64_tag{"big", ~0ull},
+            new sint16_tag{"neg", -2},
+            new sint32_tag{"min", INT32_MIN},
+            new sint64_tag{"pos", 1234567},
+            new uint8_tag{"byte", 255},
+            new double_tag{"pi", 3.14159},
+            new string_tag{"label", "grunt"},
+            new list_tag<uint32_t>{"ids", {1, 2, 3}},
+            new compound_tag{"where", {
+                new float_tag{"x", 0.25f},
+            }},
+        }};
+        std::vector<uint8_t> plain;
+        vector_sink a(plain);
+        doc.serialize_to(a);
+        for (uint8_t flags : {(uint8_t) doc_compact_ints, (uint8_t)(doc_compact_ints | doc_interned_names)}) {
+            std::vector<uint8_t> compact;
+            vector_sink b(compact);
+            document_writer writer(flags);
+            assert(writer.serialize_to(b, doc) == writer.serialized_size(doc));
+            assert(compact.size() < plain.size());
+
+            document_view view(compact.data(), compact.size());
+            tag_view root = view.root();
+            assert(root.find("small").as_uint16() == 5 && root.find("medium").as_uint32() == 300);
+            assert(root.find("big").as_uint64() == ~0ull && root.find("neg").as_sint16() == -2);
+            assert(root.find("min").as_sint32() == INT32_MIN && root.find("pos").as_sint64() == 1234567);
+            assert(root.find("byte").as_uint8() == 255 && root.find("pi").as_double() == 3.14159);
+            assert(root.find("label").as_string() == "grunt");
+            uint32_t ids[3];
+            assert(root.find("ids").copy_list(ids, 3) == 3 && ids[2] == 3);
+            assert(root.find("where").find("x").as_float() == 0.25f);
+
+            root_tag copy = deserialize(compact.data(), compact.size());
+            std::vector<uint8_t> again;
+            vector_sink c(again);
+            copy.serialize_to(c);
+            assert(again == plain);
+        }
     }
-#pragma endregion
-    typedef enum {
-        tag_end = 0,
-        tag_uint8, tag_uint16, tag_uint32, tag_uint64,
-        tag_sint8, tag_sint16, tag_sint32, tag_sint64,
-        tag_float, tag_double,
-        tag_byte_array,
-        tag_string,
-        tag_list,
-        tag_compound,
-        tag_identifier = -1,
-        tag_primitive = -2,
-    } tag_type_t;
-    class tag {
+    // Flattens stream events into a string so differently chunked parses can be compared
+    class event_log : public metabinary::stream_handler {
     public:
-        std::string name;
+        std::string log;
+        void begin_compound(std::string_view name) override { log += "{" + std::string(name); }
+        void end_compound() override { log += "}"; }
+        void value(const metabinary::tag_view& tag) override {
+            log += " " + std::string(tag.name()) + "=";
+            if (tag.type() == metabinary::tag_float)
+                log += std::to_string(tag.as_float());
+            else if (tag.type() == metabinary::tag_uint64)
+                log += std::to_string(tag.as_uint64());
+            else
+                log += "?";
+        }
+        void begin_string(std::string_view name, uint32_t length) override { log += " " + std::string(name) + "=\""; }
+        void string_data(std::string_view piece) override { log += piece; }
+        void end_string() override { log += "\""; }
+    };
+    void stream_reader_test() {
+        using namespace metabinary;
+        root_tag doc {"DEMO", {
+            new string_tag{"MAP_NAME", "LEVEL1"},
+            new string_tag{"EMPTY", ""},
+            new compound_tag{"ENTITIES", {
+                new compound_tag{"1", {
+                    new uint64_tag{"uuid", 66642044469},
+                    new compound_tag{"pos", {
+                        new float_tag{"x", 0.25f},
+                    }},
+                }},
+            }},
+        }};
+        std::vector<uint8_t> bytes;
+        vector_sink out(bytes);
+        doc.serialize_to(out);
+
+        event_log whole;
+        stream_reader whole_reader(whole);
+        assert(whole_reader.feed(bytes.data(), bytes.size()));
+        assert(whole_reader.finished());
+        assert(whole.log == "{DEMO MAP_NAME=\"LEVEL1\" EMPTY=\"\"{ENTITIES{1 uuid=66642044469{pos x=0.250000}}}}");
 
-        tag() {}
-        tag(std::string name) {
-            this->name = name;
+        // Every chunk size splits names, lengths and payloads somewhere
+        for (size_t chunk = 1; chunk < 16; chunk++) {
+            event_log split;
+            stream_reader reader(split);
+            for (size_t i = 0; i < bytes.size(); i += chunk)
+                assert(reader.feed(bytes.data() + i, std::min(chunk, bytes.size() - i)));
+            assert(reader.finished());
+            assert(split.log == whole.log);
         }
 
-        virtual int serialize(uint8_t* buf, int startidx)
-        {
-            return 0;
+        // Pulled from a pipe, then cut off halfway
+        int fds[2];
+        assert(pipe(fds) == 0);
+        assert(write(fds[1], bytes.data(), bytes.size()) == (ssize_t)bytes.size());
+        close(fds[1]);
+        event_log piped;
+        assert(read_stream(fds[0], piped, 3));
+        close(fds[0]);
+        assert(piped.log == whole.log);
+
+        event_log partial;
+        stream_reader truncated(partial);
+        assert(truncated.feed(bytes.data(), bytes.size() / 2));
+        assert(!truncated.finished());
+        uint8_t stray_end = tag_end;
+        stream_reader bad(partial);
+        assert(!bad.feed(&stray_end, 1));
+    }
+    void compression_test() {
+        using namespace metabinary;
+        // Codec roundtrips, including inputs too short to hold a match
+        std::vector<std::vector<uint8_t>> inputs = {{}, {7}, {1, 2, 3, 4, 5}};
+        std::vector<uint8_t> noise(5000), runs(5000);
+        uint32_t seed = 12345;
+        for (size_t i = 0; i < noise.size(); i++) {
+            seed = seed * 1103515245 + 12345;
+            noise[i] = seed >> 24;
+            runs[i] = "grunt_"[i % 6];
+        }
+        inputs.push_back(noise);
+        inputs.push_back(runs);
+        for (auto& in : inputs) {
+            std::vector<uint8_t> packed(lz_bound(in.size()));
+            size_t len = lz_compress(in.data(), in.size(), packed.data());
+            assert(len > 0 && len <= lz_bound(in.size()));
+            std::vector<uint8_t> out(in.size());
+            assert(lz_decompress(packed.data(), len, out.data(), out.size()));
+            assert(out == in);
+            if (!in.empty())
+                assert(!lz_decompress(packed.data(), len, out.data(), out.size() - 1));
         }
 
-        //static tag deserialize(byte* data);
-        // Encodes name length + utf8 string
-        int write_name(uint8_t* buf, int startidx)
-        {
-            return write_string(buf, startidx, this->name);
+        root_tag doc {"DEMO", {
+            new compressed_compound_tag{"ENTITIES", {
+                new string_tag{"a", "grunt grunt grunt grunt grunt"},
+                new byte_array_tag{"blob", runs.data(), runs.size()},
+                new compressed_compound_tag{"inner", {
+                    new uint64_tag{"uuid", 66642044469},
+                }},
+            }},
+            new string_tag{"MAP_NAME", "LEVEL1"},
+        }};
+        for (uint8_t flags : {(uint8_t) 0, (uint8_t) doc_compact_ints, (uint8_t)(doc_compact_ints | doc_interned_names)}) {
+            std::vector<uint8_t> bytes;
+            vector_sink out(bytes);
+            document_writer writer(flags);
+            assert(writer.serialize_to(out, doc) == writer.serialized_size(doc));
+            assert(bytes.size() < runs.size() / 2);
+
+            // Siblings after a block are found without decompressing it
+            document_view view(bytes.data(), bytes.size());
+            tag_view root = view.root();
+            assert(root.find("MAP_NAME").as_string() == "LEVEL1");
+            tag_view block = root.find("ENTITIES");
+            assert(block.type() == tag_compressed && !block.find("a").valid());
+
+            std::vector<uint8_t> storage, inner_storage;
+            tag_view entities = block.expand(storage);
+            assert(entities.type() == tag_compound && entities.name() == "ENTITIES");
+            assert(entities.find("a").as_string() == "grunt grunt grunt grunt grunt");
+            assert(entities.find("blob").as_bytes().size == runs.size());
+            assert(entities.find("inner").expand(inner_storage).find("uuid").as_uint64() == 66642044469);
+
+            // Materialized trees keep their blocks compressed
+            root_tag copy = deserialize(bytes.data(), bytes.size());
+            assert(copy.get("ENTITIES")->type() == tag_compressed);
+            std::vector<uint8_t> again;
+            vector_sink c(again);
+            document_writer(flags).serialize_to(c, copy);
+            assert(again == bytes);
         }
 
-        static int write_type(uint8_t* buf, int startidx, tag_type_t tag_type)
-        {
-            int index = startidx;
-            buf[index] = tag_type;
-            index++;
-            return index-startidx;
+        // Plain serialization, and the stream reader passing blocks through
+        std::vector<uint8_t> plain;
+        vector_sink out(plain);
+        assert(doc.serialize_to(out) == doc.serialized_size());
+        assert(tag_view(plain.data(), plain.data() + plain.size()).find("MAP_NAME").as_string() == "LEVEL1");
+        class block_log : public event_log {
+        public:
+            std::vector<uint8_t> block;
+            uint32_t raw_size = 0;
+            void begin_compressed(std::string_view name, uint32_t raw, uint32_t compressed) override {
+                log += " " + std::string(name) + "=<>";
+                raw_size = raw;
+            }
+            void array_data(const uint8_t* piece, size_t len) override { block.insert(block.end(), piece, piece + len); }
+        } blocks;
+        stream_reader reader(blocks);
+        for (size_t i = 0; i < plain.size(); i += 7)
+            assert(reader.feed(plain.data() + i, std::min<size_t>(7, plain.size() - i)));
+        assert(reader.finished());
+        assert(blocks.log == "{DEMO ENTITIES=<> MAP_NAME=\"LEVEL1\"}");
+        std::vector<uint8_t> children(blocks.raw_size);
+        assert(lz_decompress(blocks.block.data(), blocks.block.size(), children.data(), children.size()));
+
+        // Children added after the block was measured are still written
+        compressed_compound_tag changing("C", {new uint8_tag("a", 1)});
+        int measured = changing.serialized_size();
+        changing.add(new uint8_tag("b", 2));
+        std::vector<uint8_t> fresh(measured + 64);
+        int written = changing.serialize(fresh.data(), 0);
+        assert(written == changing.serialized_size() && written > measured);
+        std::vector<uint8_t> fresh_storage;
+        assert(tag_view(fresh.data(), fresh.data() + written).expand(fresh_storage).find("b").as_uint8() == 2);
+    }
+    void framing_test() {
+        using namespace metabinary;
+        int fds[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        std::string text(100000, 'x');
+        std::vector<uint8_t> texture(5000, 7);
+        root_tag doc {"DEMO", {
+            new string_tag{"MAP_NAME", "LEVEL1"},
+            new string_tag{"DESCRIPTION", text},
+            new compound_tag{"ASSETS", {
+                new byte_array_tag{"texture", texture.data(), texture.size()},
+                new uint32_tag{"id", 9},
+            }},
+        }};
+        std::vector<uint8_t> plain;
+        vector_sink out(plain);
+        doc.serialize_to(out);
+
+        // The reader drains the other end while the large frame is still going out
+        std::thread sender([&] {
+            frame_writer writer;
+            writer.add(doc, 3);
+            for (int i = 0; i < 10; i++) {
+                root_tag small {"TICK", {new uint32_tag{"n", (uint32_t) i}}};
+                writer.add(small);
+                assert(writer.pending() > 0);
+                // Small frames are sent before their trees go out of scope
+                assert(writer.flush(fds[0]) && writer.pending() == 0);
+            }
+            close(fds[0]);
+        });
+        frame_reader reader(1 << 20, 4096);
+        assert(reader.receive(fds[1]));
+        assert(reader.flags() == 3);
+        byte_span body = reader.body();
+        assert(body.size == plain.size() && memcmp(body.data, plain.data(), plain.size()) == 0);
+        assert(reader.root().find("DESCRIPTION").as_string() == text);
+        assert(reader.root().find("ASSETS").find("id").as_uint32() == 9);
+        for (uint32_t i = 0; i < 10; i++) {
+            assert(reader.receive(fds[1]));
+            assert(reader.root().name() == "TICK" && reader.root().find("n").as_uint32() == i);
         }
-        virtual int write_payload(uint8_t* buf, int startidx) {}
-    private:
+        assert(!reader.receive(fds[1]));
+        sender.join();
+        close(fds[1]);
 
-    protected:
-    };
-    class end_tag : public tag {
-    public:
-        int serialize(uint8_t *buf, int startidx) override {}
-    };
-    class uint8_tag : public tag {
-    private:
-        uint8_t payload;
+        // Bad version and oversized bodies are refused
+        uint8_t header[frame_header_size];
+        write_frame_header(header, 0, 10, 0);
+        assert(frame_size(header, sizeof(header), 100) == 0);
+        assert(frame_size(header, sizeof(header), 5) == -1);
+        header[4] = frame_version + 1;
+        assert(frame_size(header, sizeof(header), 100) == -1);
+    }
+    // Answers every TICK with its number doubled
+    class echo_server : public metabinary::endpoint_handler {
     public:
-        uint8_tag() {}
-        uint8_tag(std::string name) {}
-        uint8_tag(std::string name, uint8_t data)
-        {
-            this->name = name;
-            payload = data;
-        }
-        int serialize(uint8_t *buf, int startidx) override {
-            int offset = startidx;
-            offset += write_type(buf, offset, metabinary::tag_uint8);
-            offset += write_name(buf, offset);
-            offset += write_payload(buf, offset);
-            return offset-startidx;
-        }
-        int write_payload(uint8_t *buf, int startidx) override
-        {
-            return write_uint8(buf, startidx, payload);
+        int opened = 0, closed = 0;
+        void on_open(metabinary::endpoint& ep, int conn) override { opened++; }
+        void on_frame(metabinary::endpoint& ep, int conn, const metabinary::tag_view& root, uint8_t flags) override {
+            metabinary::root_tag reply {"TOCK", {new metabinary::uint32_tag{"n", root.find("n").as_uint32() * 2}}};
+            assert(ep.send(conn, reply, flags));
         }
+        void on_close(metabinary::endpoint& ep, int conn) override { closed++; }
     };
-    class uint16_tag : public tag {
-    private:
-        uint16_t payload;
+    class counting_client : public metabinary::endpoint_handler {
     public:
-        uint16_tag(std::string name, uint16_t data)
-        {
-            this->name = name;
-            payload = data;
-        }
-        int serialize(uint8_t *buf, int startidx) override {
-            int offset = startidx;
-            offset += write_type(buf, offset, metabinary::tag_uint16);
-            offset += write_name(buf, offset);
-            offset += write_payload(buf, offset);
-            return offset-startidx;
-        }
-        int write_payload(uint8_t *buf, int startidx) override
-        {
-            return write_uint16(buf, startidx, payload);
+        std::unordered_map<int, uint32_t> replies;
+        size_t total = 0;
+        void on_frame(metabinary::endpoint& ep, int conn, const metabinary::tag_view& root, uint8_t flags) override {
+            // Replies come back in request order on each connection
+            assert(root.name() == "TOCK" && root.find("n").as_uint32() == replies[conn]++ * 2);
+            total++;
         }
     };
-    class uint32_tag : public tag {
-    private:
-        uint32_t payload;
-    public:
-        uint32_tag() {}
-        uint32_tag(std::string name) {}
-        uint32_tag(std::string name, uint32_t data)
-        {
-            this->name = name;
-            payload = data;
-        }
-        int serialize(uint8_t *buf, int startidx) override
-        {
-            int offset = startidx;
-            offset += write_type(buf, offset, metabinary::tag_uint32);
-            offset += write_name(buf, offset);
-            offset += write_payload(buf, offset);
-            return offset-startidx;
+    void endpoint_test() {
+        using namespace metabinary;
+        echo_server server_handler;
+        counting_client client_handler;
+        endpoint server(server_handler), client(client_handler);
+        int port = server.listen("127.0.0.1", 0);
+        assert(port > 0);
+
+        // Every request is queued up front, none waiting for a reply
+        const int conns = 64, requests = 200;
+        std::vector<int> ids;
+        for (int i = 0; i < conns; i++) {
+            int conn = client.connect("127.0.0.1", port);
+            assert(conn >= 0);
+            ids.push_back(conn);
+            for (uint32_t n = 0; n < requests; n++) {
+                root_tag tick {"TICK", {new uint32_tag{"n", n}}};
+                assert(client.send(conn, tick));
+            }
         }
-        int write_payload(uint8_t *buf, int startidx) override
-        {
-            return write_uint32(buf, startidx, payload);
+        while (client_handler.total < (size_t) conns * requests) {
+            assert(client.poll(0) >= 0);
+            assert(server.poll(10) >= 0);
         }
-    };
-    class uint64_tag : public tag {
-    public:
-        uint64_tag() {}
-        uint64_tag(std::string name) {}
-        uint64_tag(std::string name, uint64_t data)
-        {
-            this->name = name;
-            payload = data;
+        assert(server_handler.opened == conns && server.connections() == conns);
+        for (int conn : ids)
+            assert(client_handler.replies[conn] == requests);
+
+        // Closing is seen on the other side, and closed connections refuse sends
+        client.close(ids[0]);
+        root_tag tick {"TICK", {new uint32_tag{"n", 0}}};
+        assert(!client.send(ids[0], tick));
+        client.poll(0);
+        assert(client.connections() == conns - 1);
+        while (server_handler.closed == 0)
+            assert(server.poll(10) >= 0);
+        assert(server.connections() == conns - 1);
+    }
+    void parallel_serialize_test() {
+        using namespace metabinary;
+        arena mem;
+        auto root = mem.make<root_tag>("WORLD");
+        root->add(make_tag<string_tag>(&mem, "MAP_NAME", "LEVEL1"));
+        auto entities = make_tag<compound_tag>(&mem, "ENTITIES");
+        for (int i = 0; i < 20000; i++) {
+            auto entity = make_tag<compound_tag>(&mem, std::to_string(i));
+            entity->add(make_tag<uint64_tag>(&mem, "uuid", i));
+            entity->add(make_tag<string_tag>(&mem, "name", std::string(i % 50, 'e')));
+            auto pos = make_tag<compound_tag>(&mem, "pos");
+            pos->add(make_tag<float_tag>(&mem, "x", i * 0.5f));
+            entity->add(pos);
+            entities->add(entity);
         }
-        int serialize(uint8_t *buf, int startidx) override
-        {
-            int offset = startidx;
-            offset += write_type(buf, offset, metabinary::tag_uint64);
-            offset += write_name(buf, offset);
-            offset += write_payload(buf, offset);
-            return offset-startidx;
+        root->add(entities);
+        auto packed = make_tag<compressed_compound_tag>(&mem, "PACKED");
+        packed->add(make_tag<string_tag>(&mem, "text", std::string(200000, 'p')));
+        root->add(packed);
+        root->add(make_tag<uint32_tag>(&mem, "LAST", 7));
+
+        std::vector<uint8_t> expected(root->serialized_size());
+        root->serialize(expected.data(), 0);
+        for (size_t workers : {1, 2, 7}) {
+            for (int min_parallel : {0, 1 << 30}) {
+                parallel_serializer writer(workers, min_parallel);
+                std::vector<uint8_t> bytes;
+                vector_sink out(bytes);
+                assert(writer.serialize_to(out, *root) == (int) expected.size());
+                assert(bytes == expected);
+            }
         }
-        int write_payload(uint8_t *buf, int startidx) override {
-            return write_uint64(buf, startidx, payload);
+        // Subtrees and lone scalars go through the same paths
+        uint32_tag scalar {"n", 5};
+        std::vector<uint8_t> one(scalar.serialized_size());
+        assert(parallel_serializer(4, 0).serialize(one.data(), 0, scalar) == (int) one.size());
+        assert(tag_view(one.data(), one.data() + one.size()).as_uint32() == 5);
+
+        // Every index runs once, even when the first share is all slow jobs and gets stolen
+        std::vector<std::atomic<int>> runs(1000);
+        parallel_for(runs.size(), [&](size_t i) {
+            if (i < 250)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            runs[i]++;
+        }, 4);
+        for (auto& n : runs)
+            assert(n == 1);
+
+        // A pool keeps its threads from one batch to the next
+        worker_pool pool(4);
+        std::mutex seen_lock;
+        std::set<std::thread::id> seen;
+        for (int batch = 0; batch < 20; batch++) {
+            for (auto& n : runs)
+                n = 0;
+            pool.run(runs.size(), [&](size_t i) {
+                if (i % 100 == 0) {
+                    std::lock_guard<std::mutex> hold(seen_lock);
+                    seen.insert(std::this_thread::get_id());
+                }
+                runs[i]++;
+            });
+            for (auto& n : runs)
+                assert(n == 1);
         }
-    private:
-        uint64_t payload;
-    };
-    class sint8_tag : public tag {
-        int8_t payload;
-    public:
-        sint8_tag() {}
-        sint8_tag(std::string name) {}
-        sint8_tag(std::string name, int8_t data)
+        assert(seen.size() <= pool.size());
+    }
+    void patch_test() {
+        using namespace metabinary;
+        root_tag doc {"DEMO", {
+            new string_tag{"MAP_NAME", "LEVEL1"},
+            new uint64_tag{"MAP_EDIT_TIMESTAMP", 999999},
+            new compound_tag{"ENTITIES", {
+                new compound_tag{"1", {
+                    new uint64_tag{"uuid", 42069},
+                    new compound_tag{"pos", {
+                        new float_tag{"x", 0.25f},
+                        new float_tag{"y", 0.25f},
+                    }},
+                }},
+            }},
+        }};
+        char path[] = "/tmp/metabinary_patch_XXXXXX";
+        int fd = mkstemp(path);
+        fd_sink out(fd);
+        int written = doc.serialize_to(out);
+        close(fd);
+        std::vector<uint8_t> before;
         {
-            this->name = name;
-            this->payload = data;
+            mapped_file file(path);
+            before.assign(file.data(), file.data() + file.size());
+            // Read-only mappings can't be patched
+            assert(!patch(file, "MAP_EDIT_TIMESTAMP", (uint64_t) 1));
         }
-        int serialize(uint8_t *buf, int startidx) {
-            int offset = startidx;
-            offset += write_type(buf, offset, metabinary::tag_sint8);
-            offset += write_name(buf, offset);
-            offset += write_payload(buf, offset);
-            return offset - startidx;
-        }
-        int write_payload(uint8_t *buf, int startidx) override {
-            return write_int8(buf, startidx, payload);
-        }
-    };
-    class sint16_tag : public tag {
-        int16_t payload;
-    public:
-        sint16_tag() { }
-        sint16_tag(std::string name) { }
-        sint16_tag(std::string name, int16_t data) {
-            this->name;
-            payload = data;
-        }
-        int serialize(uint8_t *buf, int startidx)
         {
-            int offset = startidx;
-            offset += write_type(buf, offset, metabinary::tag_sint16);
-            offset += write_name(buf, offset);
-            offset += write_payload(buf, offset);
-            return offset-startidx;
+            mapped_file file(path, true);
+            assert(patch(file, "MAP_EDIT_TIMESTAMP", (uint64_t) 1234567890123, true));
+            assert(patch(file, "ENTITIES/1/pos/x", 0.75f, true));
+            // Wrong type, missing tags and variable width tags are refused
+            assert(!patch(file, "ENTITIES/1/pos/x", 0.75));
+            assert(!patch(file, "ENTITIES/2/pos/x", 0.75f));
+            assert(!patch(file, "ENTITIES/1/pos", 0.75f));
+            assert(!patch(file, "MAP_NAME", (uint64_t) 1));
         }
-        int write_payload(uint8_t *buf, int startidx) override {
-            return write_int16(buf, startidx, payload);
+        // Only the patched payloads differ
+        mapped_file file(path);
+        assert(file.size() == (size_t) written);
+        assert(file.root().find("MAP_EDIT_TIMESTAMP").as_uint64() == 1234567890123);
+        assert(file.root().find_path("ENTITIES/1/pos/x").as_float() == 0.75f);
+        assert(file.root().find_path("ENTITIES/1/pos/y").as_float() == 0.25f);
+        size_t changed = 0;
+        for (size_t i = 0; i < before.size(); i++)
+            changed += file.data()[i] != before[i];
+        assert(changed > 0 && changed <= sizeof(uint64_t) + sizeof(float));
+        unlink(path);
+
+        // Documents: compact integers are varints, floats stay patchable
+        for (uint8_t flags : {(uint8_t) doc_interned_names, (uint8_t) doc_compact_ints}) {
+            std::vector<uint8_t> bytes;
+            vector_sink sink(bytes);
+            document_writer(flags).serialize_to(sink, doc);
+            assert(patch(bytes.data(), bytes.size(), "ENTITIES/1/pos/y", -2.0f));
+            bool fixed = !(flags & doc_compact_ints);
+            assert(patch(bytes.data(), bytes.size(), "ENTITIES/1/uuid", (uint64_t) 7) == fixed);
+            document_view view(bytes.data(), bytes.size());
+            assert(view.root().find_path("ENTITIES/1/pos/y").as_float() == -2.0f);
+            assert(view.root().find_path("ENTITIES/1/uuid").as_uint64() == (fixed ? 7 : 42069));
         }
-    };
-    class sint32_tag : public tag {
-        int32_t payload;
-    public:
-        sint32_tag() {}
-        sint32_tag(std::string name) {}
-        sint32_tag(std::string name, int32_t data)
-        {
-            this->name = name;
-            payload = data;
+
+        // Checksums of every compound holding the value are brought up to date
+        for (uint8_t flags : {(uint8_t) doc_checksums, (uint8_t)(doc_checksums | doc_sized_compounds | doc_child_offsets)}) {
+            char sum_path[] = "/tmp/metabinary_patch_XXXXXX";
+            int sum_fd = mkstemp(sum_path);
+            fd_sink sum_out(sum_fd);
+            document_writer(flags).serialize_to(sum_out, doc);
+            close(sum_fd);
+            {
+                mapped_file sums(sum_path, true);
+                assert(patch(sums, "ENTITIES/1/pos/x", 4.0f, true));
+                assert(patch(sums, "MAP_EDIT_TIMESTAMP", (uint64_t) 5));
+            }
+            mapped_file sums(sum_path);
+            document_view view(sums.data(), sums.size());
+            tag_view root = view.root();
+            assert(root.find_path("ENTITIES/1/pos/x").as_float() == 4.0f);
+            assert(root.verify() && root.find("ENTITIES").verify());
+            assert(root.find_path("ENTITIES/1").verify() && root.find_path("ENTITIES/1/pos").verify());
+            unlink(sum_path);
         }
-        int serialize(uint8_t *buf, int startidx)
+    }
+    void journal_test() {
+        using namespace metabinary;
+        char dir[] = "/tmp/metabinary_journal_XXXXXX";
+        assert(mkdtemp(dir) != nullptr);
+        std::string path = std::string(dir) + "/world.mbj";
+        auto bytes_of = [](tag& t) {
+            std::vector<uint8_t> bytes;
+            vector_sink out(bytes);
+            t.serialize_to(out);
+            return bytes;
+        };
+        std::vector<uint8_t> expected;
         {
-            int offset = startidx;
-            offset += write_type(buf, offset, metabinary::tag_sint32);
-            offset += write_name(buf, offset);
-            offset += write_payload(buf, offset);
-            return offset - startidx;
-        }
-        int write_payload(uint8_t *buf, int startidx) override {
-            return write_int32(buf, startidx, payload);
+            journal log(path.c_str(), "WORLD");
+            assert(log.is_open() && log.root().name == "WORLD");
+            arena& mem = log.memory();
+            assert(log.add("", make_tag<uint64_tag>(&mem, "MAP_EDIT_TIMESTAMP", 1)));
+            assert(log.add("", make_tag<compound_tag>(&mem, "ENTITIES")));
+            for (int i = 0; i < 3; i++) {
+                auto entity = make_tag<compound_tag>(&mem, std::to_string(i));
+                entity->add(make_tag<float_tag>(&mem, "x", i * 0.5f));
+                assert(log.add("ENTITIES", entity));
+            }
+            assert(log.set("", make_tag<uint64_tag>(&mem, "MAP_EDIT_TIMESTAMP", 2)));
+            assert(log.set("ENTITIES/1", make_tag<float_tag>(&mem, "x", 9.0f)));
+            assert(log.remove("ENTITIES", "0"));
+            // Failed changes are neither applied nor logged
+            assert(!log.remove("ENTITIES", "0"));
+            assert(!log.add("MISSING", make_tag<uint8_tag>(&mem, "y", 1)));
+            assert(log.records() == 8);
+            assert(log.sync());
+            expected = bytes_of(log.root());
         }
-    };
-    class sint64_tag : public tag {
-        int64_t payload;
-    public:
-        sint64_tag() {}
-        sint64_tag(std::string name) {}
-        sint64_tag(std::string name, int64_t data)
         {
-            this->name = name;
-            payload = data;
+            // The order of children survives replay, replaced ones keeping their place
+            journal log(path.c_str());
+            assert(log.is_open() && log.records() == 8);
+            assert(bytes_of(log.root()) == expected);
+            auto timestamp = static_cast<uint64_tag*>(log.root().get("MAP_EDIT_TIMESTAMP"));
+            assert(timestamp->value() == 2 && log.root().children()[0] == timestamp);
+            auto entities = static_cast<compound_tag*>(log.root().get("ENTITIES"));
+            assert(entities->children().size() == 2 && entities->get("0") == nullptr);
         }
-        int serialize(uint8_t *buf, int startidx) {
-            int offset = startidx;
-            offset += write_type(buf, offset, metabinary::tag_sint64);
-            offset += write_name(buf, offset);
-            offset += write_payload(buf, offset);
-            return offset - startidx;
-        }
-        int write_payload(uint8_t *buf, int index) override {
-            return write_int64(buf, index, payload);
-        }
-    };
-    class float_tag : public tag {
-        float payload;
-    public:
-        float_tag() {}
-        float_tag(std::string name) {}
-        float_tag(std::string name, float data)
+        // A record torn by a crash is dropped, and appends carry on after the last good one
+        struct stat st;
+        assert(stat(path.c_str(), &st) == 0);
+        assert(truncate(path.c_str(), st.st_size - 3) == 0);
         {
-            this->name = name;
-            payload = data;
+            journal log(path.c_str());
+            assert(log.is_open() && log.records() == 7);
+            assert(static_cast<compound_tag*>(log.root().get("ENTITIES"))->get("0") != nullptr);
+            assert(log.remove("ENTITIES", "0"));
+            assert(bytes_of(log.root()) == expected);
         }
-        int serialize(uint8_t *buf, int startidx) override {
-            int offset = startidx;
-            offset+=write_type(buf, offset, metabinary::tag_float);
-            offset+=write_name(buf, offset);
-            offset+=write_payload(buf, offset);
-            return offset-startidx;
-        }
-        int write_payload(uint8_t *buf, int startidx) override {
-            return write_float(buf, startidx, payload);
-        }
-    };
-    class double_tag : public tag {
-        double payload;
-    public:
-        double_tag() {}
-        double_tag(std::string name) {}
-        double_tag(std::string name, double data)
         {
-            this->name = name;
-            payload = data;
+            journal log(path.c_str());
+            assert(log.records() == 8 && bytes_of(log.root()) == expected);
+            // Compaction keeps the tree and drops the records
+            assert(stat(path.c_str(), &st) == 0);
+            off_t before = st.st_size;
+            assert(log.compact() && log.records() == 0 && log.log_size() == 0);
+            assert(stat(path.c_str(), &st) == 0 && st.st_size < before);
+            assert(log.add("", make_tag<uint8_tag>(&log.memory(), "after", 1)));
+            expected = bytes_of(log.root());
         }
-        int serialize(uint8_t *buf, int startidx) override {
-            int offset = startidx;
-            offset += write_type(buf, offset, metabinary::tag_double);
-            offset += write_name(buf, offset);
-            offset += write_payload(buf, offset);
-            return offset-startidx;
-        }
-        int write_payload(uint8_t *buf, int startidx) override {
-            return write_double(buf, startidx, payload);
-        }
-    };
-    class string_tag : public tag {
-        std::string payload;
-    public:
-        string_tag() {}
-        string_tag(std::string name) { this->name = name;}
-        string_tag(std::string name, std::string value)
         {
-            this->name = name;
-            this->payload = value;
+            // Records outgrowing the snapshot are compacted along the way
+            journal log(path.c_str());
+            assert(log.records() == 1 && bytes_of(log.root()) == expected);
+            std::string big(10000, 'b');
+            for (int i = 0; i < 20; i++)
+                assert(log.set("", make_tag<string_tag>(&log.memory(), "blob", big)));
+            assert(log.records() < 20);
+            expected = bytes_of(log.root());
         }
-        int serialize(uint8_t *buf, int startidx) override
         {
-            int offset = startidx;
-            offset += write_type(buf, offset, metabinary::tag_string);
-            offset += write_name(buf, offset);
-            offset += write_payload(buf, offset);
-            return offset-startidx;
+            // A change whose record can't be written isn't applied either
+            journal log(path.c_str());
+            assert(stat(path.c_str(), &st) == 0);
+            rlimit limit, full;
+            assert(getrlimit(RLIMIT_FSIZE, &full) == 0);
+            auto old_handler = signal(SIGXFSZ, SIG_IGN);
+            limit = full;
+            limit.rlim_cur = st.st_size;
+            assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+            assert(!log.add("", make_tag<uint8_tag>(&log.memory(), "lost", 1)));
+            assert(!log.remove("", "after"));
+            assert(setrlimit(RLIMIT_FSIZE, &full) == 0);
+            signal(SIGXFSZ, old_handler);
+            assert(log.is_open() && bytes_of(log.root()) == expected);
+            assert(log.root().get("lost") == nullptr && log.root().get("after") != nullptr);
         }
-        int write_payload(uint8_t *buf, int startidx) override {
-            return write_string(buf, startidx, payload);
+        {
+            // A compaction that fails keeps the old file, and the change that set it off stands
+            std::string temp = path + ".compact";
+            assert(mkdir(temp.c_str(), 0755) == 0);
+            journal log(path.c_str());
+            assert(!log.compact() && log.compaction_failed() && log.is_open());
+            size_t records = log.records();
+            std::string big(100000, 'c');
+            assert(log.set("", make_tag<string_tag>(&log.memory(), "blob", big)));
+            assert(log.compaction_failed() && log.records() == records + 1);
+            expected = bytes_of(log.root());
+            rmdir(temp.c_str());
         }
+        journal reopened(path.c_str());
+        assert(bytes_of(reopened.root()) == expected);
+        unlink(path.c_str());
+        rmdir(dir);
+    }
+    void blob_section_test() {
+        using namespace metabinary;
+        std::vector<uint8_t> texture(300000);
+        for (size_t i = 0; i < texture.size(); i++)
+            texture[i] = i * 7;
+        std::string script(100000, 's');
+        root_tag doc {"ASSETS", {
+            new string_tag{"name", "crate"},
+            new byte_array_tag{"texture", texture.data(), texture.size()},
+            new compound_tag{"meta", {
+                new string_tag{"script", script},
+                new uint32_tag{"version", 3},
+            }},
+            new compressed_compound_tag{"packed", {
+                new string_tag{"inline", script},
+            }},
+            new uint64_tag{"LAST", 42},
+        }};
+        for (uint8_t flags : {(uint8_t) doc_blob_section, (uint8_t)(doc_blob_section | doc_compact_ints | doc_interned_names)}) {
+            char path[] = "/tmp/metabinary_blob_XXXXXX";
+            int fd = mkstemp(path);
+            fd_sink out(fd);
+            document_writer writer(flags);
+            int written = writer.serialize_to(out, doc);
+            assert(written == writer.serialized_size(doc));
+            close(fd);
 
-    };
-    class list_tag : public tag {
-    public:
-    private:
-    };
-    class compound_tag : public tag {
-    private:
-        std::vector<tag*> payload;
-    public:
-        compound_tag() {}
-        compound_tag(std::string name) {}
-        compound_tag(std::string name, std::vector<tag*> tags)
-        {
-            this->name = name;
-            payload = tags;
+            mapped_file file(path);
+            document_view view(file.data(), file.size());
+            tag_view root = view.root();
+            // Walking the metadata never touches the blobs, and tags after them are found
+            assert(root.size() < 1000);
+            assert(root.find("LAST").as_uint64() == 42 && root.find("name").as_string() == "crate");
+            assert(root.find_path("meta/version").as_uint32() == 3);
+
+            // Blobs are page aligned in the file, and read like any other payload
+            uint64_t offset, len;
+            assert(root.find("texture").blob_range(offset, len) && len == texture.size());
+            assert(offset % blob_alignment == 0);
+            assert(((uintptr_t) root.find("texture").as_bytes().data) % blob_alignment == 0);
+            assert(memcmp(root.find("texture").as_bytes().data, texture.data(), texture.size()) == 0);
+            assert(root.find_path("meta/script").as_string() == script);
+            assert(!root.find("name").blob_range(offset, len));
+            std::vector<uint8_t> storage;
+            tag_view packed = root.find("packed").expand(storage);
+            assert(packed.find("inline").as_string() == script && !packed.find("inline").blob_range(offset, len));
+
+            // Handed to a pipe without passing through user space
+            int fds[2];
+            assert(pipe(fds) == 0);
+            int in = open(path, O_RDONLY);
+            std::thread sender([&] {
+                assert(send_blob(fds[1], in, root.find_path("meta/script")));
+                close(fds[1]);
+            });
+            std::string received;
+            char chunk[4096];
+            for (ssize_t n; (n = read(fds[0], chunk, sizeof(chunk))) > 0; )
+                received.append(chunk, n);
+            sender.join();
+            close(fds[0]);
+            close(in);
+            assert(received == script);
+
+            // Materialized and written again, byte for byte
+            root_tag copy = deserialize(file.data(), file.size());
+            std::vector<uint8_t> again;
+            vector_sink sink(again);
+            document_writer(flags).serialize_to(sink, copy);
+            assert(again.size() == file.size() && memcmp(again.data(), file.data(), file.size()) == 0);
+
+            // A blob section ending past what an int addresses is refused rather than wrapped
+            uint8_t untouched = 0;
+            assert(writer.serialize(&untouched, INT_MAX - 4096, doc) == -1 && untouched == 0);
+            unlink(path);
         }
-        tag* get(std::string name) const {
+    }
+    void checksum_test() {
+        using namespace metabinary;
+        // Standard check value, and agreement between the hardware and table paths
+        const char* digits = "123456789";
+        assert(crc32c(reinterpret_cast<const uint8_t*>(digits), 9) == 0xE3069283);
+        std::vector<uint8_t> data(1000);
+        for (size_t i = 0; i < data.size(); i++)
+            data[i] = i * 131 + 7;
+        for (size_t offset : {0, 1, 3, 7})
+            for (size_t len : {0, 1, 7, 8, 9, 63, 500}) {
+                uint32_t expected = ~crc32c_slice8(~0u, data.data() + offset, len);
+                assert(crc32c(data.data() + offset, len) == expected);
+                // Pieces chain into the CRC of the whole
+                assert(crc32c(data.data() + offset + len / 2, len - len / 2, crc32c(data.data() + offset, len / 2)) == expected);
+            }
 
-            for (auto& child : payload)
+        root_tag doc {"DEMO", {
+            new string_tag{"MAP_NAME", "LEVEL1"},
+            new compound_tag{"ENTITIES", {
+                new compound_tag{"1", {new uint64_tag{"uuid", 42069}}},
+                new compound_tag{"2", {new uint64_tag{"uuid", 696969}}},
+            }},
+            new compressed_compound_tag{"PACKED", {
+                new compound_tag{"inner", {new string_tag{"text", "grunt grunt grunt"}}},
+            }},
+        }};
+        for (uint8_t flags : {(uint8_t) doc_checksums, (uint8_t)(doc_checksums | doc_compact_ints | doc_interned_names)}) {
+            std::vector<uint8_t> bytes;
+            vector_sink out(bytes);
+            document_writer writer(flags);
+            assert(writer.serialize_to(out, doc) == writer.serialized_size(doc));
             {
-                if (child->name == name)
-                    return child;
+                document_view view(bytes.data(), bytes.size());
+                tag_view root = view.root();
+                assert(root.verify() && root.find("ENTITIES").verify() && root.find_path("ENTITIES/2").verify());
+                assert(root.find_path("ENTITIES/1/uuid").as_uint64() == 42069 && !root.find("MAP_NAME").verify());
+                std::vector<uint8_t> storage;
+                tag_view packed = root.find("PACKED");
+                assert(packed.verify() && packed.expand(storage).verify());
+                assert(packed.expand(storage).find("inner").verify());
+                assert(packed.expand(storage).find_path("inner/text").as_string() == "grunt grunt grunt");
+                root_tag copy = deserialize(bytes.data(), bytes.size());
+                std::vector<uint8_t> again;
+                vector_sink c(again);
+                document_writer(flags).serialize_to(c, copy);
+                assert(again == bytes);
             }
+            // Damage inside one entity shows in it and everything around it, not its sibling
+            document_view clean(bytes.data(), bytes.size());
+            bytes[clean.root().find_path("ENTITIES/1/uuid").raw_payload().data - bytes.data()] ^= 0x10;
+            document_view damaged(bytes.data(), bytes.size());
+            assert(!damaged.root().find_path("ENTITIES/1").verify());
+            assert(damaged.root().find_path("ENTITIES/2").verify());
+            assert(!damaged.root().find("ENTITIES").verify() && !damaged.root().verify());
+            // Plain streams have nothing to check
+            assert(!tag_view(bytes.data() + document_header_size, bytes.data() + bytes.size()).verify());
         }
-        int serialize(uint8_t* buffer, int startidx)
-        {
-            int offset = startidx;
 
-            offset += write_type(buffer, offset, metabinary::tag_compound);
-            offset += write_name(buffer, offset);
+        // Frames: checked on receipt, a damaged one stops the reader
+        int fds[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        std::string text(5000, 't');
+        root_tag frame {"MSG", {new string_tag{"text", text}, new uint32_tag{"n", 1}}};
+        frame_writer writer(1024, true);
+        assert(writer.send(fds[0], frame, 9));
+        frame_reader reader;
+        assert(reader.receive(fds[1]) && reader.flags() == 9);
+        assert(reader.root().find("text").as_string() == text && reader.root().find("n").as_uint32() == 1);
+        uint8_t header[frame_header_size];
+        std::vector<uint8_t> body(frame.serialized_size());
+        frame.serialize(body.data(), 0);
+        write_frame_header(header, 0, body.size(), 0, frame_checksum);
+        uint8_t crc[4];
+        write_uint32(crc, 0, crc32c(body.data(), body.size()) ^ 1);
+        assert(write(fds[0], header, sizeof(header)) == sizeof(header));
+        assert(write(fds[0], body.data(), body.size()) == (ssize_t) body.size());
+        assert(write(fds[0], crc, sizeof(crc)) == sizeof(crc));
+        assert(!reader.receive(fds[1]) && reader.failed());
+        close(fds[0]);
+        close(fds[1]);
+    }
+    void delta_test() {
+        using namespace metabinary;
+        arena mem;
+        auto world = mem.make<root_tag>("WORLD");
+        world->add(make_tag<uint64_tag>(&mem, "TICK", 1));
+        world->add(make_tag<uint32_tag>(&mem, "MODE", 2));
+        auto entities = make_tag<compound_tag>(&mem, "ENTITIES");
+        for (int i = 0; i < 1000; i++) {
+            auto entity = make_tag<compound_tag>(&mem, std::to_string(i));
+            entity->add(make_tag<uint64_tag>(&mem, "uuid", i));
+            auto pos = make_tag<compound_tag>(&mem, "pos");
+            pos->add(make_tag<float_tag>(&mem, "x", i * 0.5f));
+            pos->add(make_tag<float_tag>(&mem, "y", 1.0f));
+            entity->add(pos);
+            entities->add(entity);
+        }
+        world->add(entities);
+        auto baseline = static_cast<compound_tag*>(clone(*world, &mem));
 
-            // Add Serialized Child Tags
-            for (auto& tag : payload)
-                offset += tag->serialize(buffer, offset);
+        // Nothing changed, nothing to send
+        root_tag none = diff(*baseline, *world, &mem);
+        assert(none.children().empty());
 
-            // Add END Tag
-            buffer[offset] = tag_end;
-            offset++;
+        // One tick's worth of changes
+        auto target = static_cast<compound_tag*>(clone(*world, &mem));
+        auto target_entities = static_cast<compound_tag*>(target->get("ENTITIES"));
+        target->replace(make_tag<uint64_tag>(&mem, "TICK", 2));
+        target->replace(make_tag<string_tag>(&mem, "MODE", "deathmatch"));
+        static_cast<compound_tag*>(find_compound(*target, "ENTITIES/5/pos"))->replace(make_tag<float_tag>(&mem, "x", 9.5f));
+        static_cast<compound_tag*>(target_entities->get("7"))->add(make_tag<uint8_tag>(&mem, "hp", 90));
+        target_entities->remove("3");
+        auto spawned = make_tag<compound_tag>(&mem, "1000");
+        spawned->add(make_tag<uint64_tag>(&mem, "uuid", 1000));
+        target_entities->add(spawned);
 
-            // Return used space
-            return offset-startidx;
-        }
-        void add_byte() {}
-        void add_short() {}
-        void add_int() {}
-        void add_long() {}
-        void add_float() {}
-        void add_double() {}
-        void add_string(std::string name, std::string value)
-        {
-            this->payload.push_back(new string_tag(name, value));
-        }
-    };
-    class custom_data_tag : public tag { };
-    class root_tag : public compound_tag {
-    public:
-        root_tag() : compound_tag() {};
-        root_tag(std::string name) : compound_tag(name) {}
-        root_tag(std::string name, std::vector<tag*> tags) : compound_tag(name,  tags) {}
-    };
-    struct file { root_tag tag; };
-    static root_tag deserialize(uint8_t* buf)
-    {
+        root_tag delta = diff(*baseline, *target, &mem);
+        auto sets = static_cast<compound_tag*>(delta.get("set"));
+        auto removes = static_cast<compound_tag*>(delta.get("remove"));
+        assert(sets->children().size() == 5 && removes->children().size() == 1);
+        assert(sets->get("ENTITIES/5/pos/x") != nullptr && removes->get("ENTITIES/3") != nullptr);
+        assert(delta.serialized_size() * 100 < target->serialized_size());
+
+        // The receiver's copy of the baseline ends up byte for byte like the target
+        auto receiver = static_cast<compound_tag*>(clone(*baseline, &mem));
+        std::vector<uint8_t> wire(delta.serialized_size());
+        delta.serialize(wire.data(), 0);
+        assert(apply_delta(*receiver, tag_view(wire.data(), wire.data() + wire.size()), mem));
+        assert(same_tag(*receiver, *target));
+        auto other = static_cast<compound_tag*>(clone(*baseline, &mem));
+        assert(apply_delta(*other, delta, mem) && same_tag(*other, *target));
 
+        // Changes to a tree the receiver doesn't have are reported
+        root_tag empty("WORLD");
+        assert(!apply_delta(empty, delta, mem));
     }
-}
+    void query_test() {
+        using namespace metabinary;
+        root_tag doc("WORLD");
+        auto entities = new compound_tag("ENTITIES");
+        for (int i = 0; i < 100; i++) {
+            auto entity = new compound_tag(std::to_string(i));
+            entity->add(new uint64_tag("uuid", 1000 + i));
+            entity->add(new compound_tag("pos", {
+                new float_tag("x", i * 0.5f),
+                new float_tag("y", -i * 1.0f),
+                new float_tag("angle", 3.0f),
+            }));
+            entities->add(entity);
+        }
+        // An entity without a position, and one whose x has the wrong type
+        entities->add(new compound_tag("ghost", {new uint64_tag("uuid", 7)}));
+        entities->add(new compound_tag("odd", {new compound_tag("pos", {new string_tag("x", "left")})}));
+        doc.add(entities);
+        doc.add(new compressed_compound_tag("ARCHIVE", {
+            new compound_tag("a", {new compound_tag("pos", {new float_tag("x", 42.0f)})}),
+        }));
 
-namespace tests {
-    void uint64_roundtrip_test() {
-        uint64_t begin = 40269;
-        uint8_t buf[sizeof(uint64_t)];
-        metabinary::write_uint64(buf, 0, begin);
-        uint64_t result = metabinary::read_uint64(buf, 0);
-        assert(begin == result && "YE NOTHIN");
+        path_query xs("ENTITIES/*/pos/x");
+        std::vector<float> from_tree;
+        assert(xs.extract(doc, from_tree) == 100);
+        assert(from_tree[0] == 0.0f && from_tree[99] == 49.5f);
+        std::vector<std::string> labels;
+        assert(xs.extract(doc, labels) == 1 && labels[0] == "left");
+        std::vector<schema_pos> positions;
+        assert(path_query("ENTITIES/*/pos").extract(doc, positions) == 101);
+        assert(positions[3].y == -3.0f && positions[3].angle == 3.0f);
+
+        for (uint8_t flags : {(uint8_t) 0, (uint8_t)(doc_compact_ints | doc_interned_names | doc_checksums)}) {
+            std::vector<uint8_t> bytes;
+            vector_sink out(bytes);
+            document_writer(flags).serialize_to(out, doc);
+            document_view view(bytes.data(), bytes.size());
+
+            std::vector<float> from_bytes;
+            assert(xs.extract(view.root(), from_bytes) == 100 && from_bytes == from_tree);
+            std::vector<uint64_t> uuids;
+            assert(path_query("ENTITIES/*/uuid").extract(view.root(), uuids) == 101 && uuids[100] == 7);
+            std::vector<schema_pos> decoded;
+            assert(path_query("ENTITIES/*/pos").extract(view.root(), decoded) == 101);
+            assert(decoded[3].y == -3.0f && decoded[100].x == 0.0f);
+
+            // Compressed compounds on the path are expanded
+            std::vector<float> archived;
+            assert(path_query("ARCHIVE/*/pos/x").extract(view.root(), archived) == 1 && archived[0] == 42.0f);
+            std::vector<float> none;
+            assert(path_query("MISSING/*/x").extract(view.root(), none) == 0);
+            assert(path_query("ENTITIES/1/pos/x/deeper").extract(view.root(), none) == 0);
+
+            size_t visited = 0;
+            path_query("").for_each(view.root(), [&](const tag_view& match) {
+                assert(match.name() == "WORLD");
+                visited++;
+            });
+            assert(visited == 1);
+        }
     }
-    void uint32_roundtrip_test() {
-        uint32_t begin = 42069;
-        uint8_t buf[sizeof(uint32_t)];
-        metabinary::write_uint32(buf, 0, begin);
-        uint32_t result = metabinary::read_uint32(buf, 0);
-        assert(begin == result && "DAWSH");
+    void table_test() {
+        using namespace metabinary;
+        arena mem;
+        auto entities = make_tag<compound_tag>(&mem, "ENTITIES");
+        for (int i = 0; i < 1000; i++) {
+            auto entity = make_tag<compound_tag>(&mem, std::to_string(i + 1));
+            entity->add(make_tag<uint64_tag>(&mem, "uuid", 42069 + i));
+            auto pos = make_tag<compound_tag>(&mem, "pos");
+            pos->add(make_tag<float_tag>(&mem, "x", 0.25f * i));
+            pos->add(make_tag<float_tag>(&mem, "y", 0.5f * i));
+            pos->add(make_tag<float_tag>(&mem, "angle", 3.1415f));
+            entity->add(pos);
+            entity->add(make_tag<sint8_tag>(&mem, "team", i % 2 ? -1 : 1));
+            entities->add(entity);
+        }
+
+        table_tag* table = to_table(*entities, &mem);
+        assert(table != nullptr && table->row_names().size() == 1000 && table->columns().size() == 5);
+        assert(table->columns()[1]->name == "pos/x" && table->column<float>("pos/y")->values()[10] == 5.0f);
+        assert(table->column<float>("uuid") == nullptr);
+        assert(same_tag(*from_table(*table, &mem), *entities));
+        assert(table->serialized_size() * 2 < entities->serialized_size());
+
+        root_tag doc("DUMP", {table, new string_tag("after", "x")});
+        for (uint8_t flags : {(uint8_t) 0, (uint8_t)(doc_compact_ints | doc_interned_names | doc_checksums)}) {
+            std::vector<uint8_t> bytes;
+            vector_sink out(bytes);
+            document_writer(flags).serialize_to(out, doc);
+            document_view view(bytes.data(), bytes.size());
+
+            // Columns are plain packed lists, and the table is stepped over whole
+            tag_view dump = view.root().find("ENTITIES");
+            assert(dump.type() == tag_table && dump.table_rows() == 1000);
+            assert(dump.row_names()[999] == "1000");
+            std::vector<float> xs(1000);
+            assert(dump.find("pos/x").copy_list(xs.data(), xs.size()) == 1000 && xs[4] == 1.0f);
+            assert(view.root().find("after").as_string() == "x");
+
+            root_tag copy = deserialize(bytes.data(), bytes.size());
+            auto back = static_cast<table_tag*>(copy.get("ENTITIES"));
+            assert(back->type() == tag_table && same_tag(*back, *table));
+            std::unique_ptr<compound_tag> rebuilt(from_table(*back));
+            assert(same_tag(*rebuilt, *entities));
+        }
+
+        // Records that differ in shape, or hold what a column can't, stay compounds
+        compound_tag mixed("M", {
+            new compound_tag("a", {new uint32_tag("v", 1)}),
+            new compound_tag("b", {new uint64_tag("v", 1)}),
+        });
+        compound_tag strings("S", {new compound_tag("a", {new string_tag("v", "s")})});
+        compound_tag empty("E", {new compound_tag("a", {new compound_tag("v")})});
+        compound_tag repeated("R", {new compound_tag("a", {new uint8_tag("v", 1), new uint8_tag("v", 2)})});
+        compound_tag scalars("X", {new uint8_tag("v", 1)});
+        for (compound_tag* records : {&mixed, &strings, &empty, &repeated, &scalars})
+            assert(to_table(*records) == nullptr);
+        assert(to_table(compound_tag("none")) == nullptr);
     }
-    void uint16_roundtrip_test() {
-        uint16_t begin = 42069;
-        uint8_t buf[sizeof(uint16_t)];
-        metabinary::write_uint16(buf, 0, begin);
-        uint16_t result = metabinary::read_uint16(buf, 0);
-        assert(begin == result && "DAWSH");
+    void instrument_test() {
+        using namespace metabinary;
+        profile& stats = profile::global();
+        stats.reset();
+        root_tag doc("DOC", {
+            new uint32_tag("a", 1),
+            new compound_tag("inner", {new string_tag("s", "hello")}),
+        });
+        std::vector<uint8_t> bytes(doc.serialized_size());
+        doc.serialize(bytes.data(), 0);
+        arena mem;
+        deserialize(bytes.data(), bytes.size(), mem);
+        if (!instrumented) {
+            // Hooks compiled out
+            assert(stats.counts(tag_uint32).written == 0 && stats.allocations() == 0 && stats.spans().empty());
+            return;
+        }
+        assert(stats.counts(tag_uint32).written == 1 && stats.counts(tag_uint32).read == 1);
+        assert(stats.counts(tag_uint32).name_bytes == 5 && stats.counts(tag_uint32).payload_bytes == 4);
+        assert(stats.counts(tag_compound).written == 2 && stats.counts(tag_compound).read == 2);
+        assert(stats.counts(tag_string).payload_bytes == 9);
+        assert(stats.allocations() == 4);
+
+        // Every byte is accounted for, as a type byte, name or payload
+        auto accounted = [&] {
+            uint64_t total = 0;
+            for (int type = 0; type <= tag_table; type++) {
+                profile::type_counts c = stats.counts((tag_type_t) type);
+                total += c.written + c.name_bytes + c.payload_bytes;
+            }
+            return total;
+        };
+        assert(accounted() == bytes.size());
+        assert(stats.spans().size() == 4);
+        std::string trace = stats.chrome_trace();
+        assert(trace.find("\"name\":\"inner\",\"cat\":\"materialize\"") != std::string::npos);
+        assert(stats.summary().find("uint32") != std::string::npos);
+
+        // Documents are counted in their own encoding, tables with their columns
+        stats.reset();
+        compound_tag records("R", {
+            new compound_tag("1", {new uint16_tag("v", 300)}),
+            new compound_tag("2", {new uint16_tag("v", 7)}),
+        });
+        doc.add(to_table(records));
+        uint8_t flags = doc_compact_ints | doc_checksums;
+        std::vector<uint8_t> encoded;
+        vector_sink out(encoded);
+        document_writer(flags).serialize_to(out, doc);
+        assert(stats.counts(tag_table).written == 1 && stats.counts(tag_list).written == 1);
+        assert(accounted() == encoded.size() - document_header_size);
+
+        stats.reset();
+        stats.span_depth = 1;
+        std::vector<uint8_t> plain(doc.serialized_size());
+        doc.serialize(plain.data(), 0);
+        assert(stats.spans().size() == 1);
+        stats.span_depth = 2;
+
+        // Nested compressed blocks are each packed once per write
+        compressed_compound_tag nested("outer", {
+            new compressed_compound_tag("middle", {
+                new compressed_compound_tag("inner", {new uint32_tag("v", 1)}),
+            }),
+        });
+        stats.reset();
+        std::vector<uint8_t> once;
+        vector_sink once_out(once);
+        nested.serialize_to(once_out);
+        assert(stats.counts(tag_uint32).written == 1);
+        stats.reset();
+        std::vector<uint8_t> parallel;
+        vector_sink parallel_out(parallel);
+        parallel_serializer(2, 0).serialize_to(parallel_out, nested);
+        assert(stats.counts(tag_uint32).written == 1 && parallel == once);
     }
-    void uint8_roundtrip_test() {
-        // lol
-        uint8_t begin = 255;
-        uint8_t buf[sizeof(uint8_t)];
-        metabinary::write_uint8(buf, 0, begin);
-        uint8_t result = metabinary::read_uint8(buf, 0);
+    void cursor_test() {
+        using namespace metabinary;
+        const int32_t samples[5] = {1, -2, 300, -40000, 5000000};
+        std::vector<uint8_t> buf(64);
+        writer out(buf.data(), buf.size());
+        out.write_uint8(7).write_uint16(513).write_int32(-9).write_double(0.5).write_varint(300);
+        out.write_string("pos").write_many(samples, 5).write_bytes("xy", 2);
+        assert(out.ok() && out.position() == 1 + 2 + 4 + 8 + 2 + 7 + 20 + 2);
+
+        // Byte for byte what the index based primitives write
+        std::vector<uint8_t> expected(buf.size());
+        int offset = 0;
+        offset += write_uint8(expected.data(), offset, 7);
+        offset += write_uint16(expected.data(), offset, 513);
+        offset += write_int32(expected.data(), offset, -9);
+        offset += write_double(expected.data(), offset, 0.5);
+        offset += write_varint(expected.data(), offset, 300);
+        offset += write_string(expected.data(), offset, "pos");
+        offset += write_array(expected.data(), offset, samples, 5);
+        memcpy(expected.data() + offset, "xy", 2);
+        assert(expected == buf);
+
+        reader in(buf.data(), out.position());
+        assert(in.read_uint8() == 7 && in.read_uint16() == 513 && in.read_int32() == -9);
+        assert(in.read_double() == 0.5 && in.read_varint() == 300);
+        std::string_view name = in.read_string();
+        assert(name == "pos" && (const uint8_t*) name.data() == buf.data() + 21);
+        int32_t back[5];
+        assert(in.read_many(back, 5) && back[3] == -40000);
+        assert(memcmp(in.read_bytes(2), "xy", 2) == 0 && in.remaining() == 0 && in.ok());
+
+        // Running past the end fails for good, without touching anything past it
+        assert(in.read_uint8() == 0 && !in.ok() && in.read_string().empty());
+        reader short_read(buf.data(), 10);
+        short_read.read_uint8();
+        assert(!short_read.read_many(back, (size_t) -1 / 2) && !short_read.ok());
+        uint8_t small[6] = {0, 0, 0, 0, 0, 0xee};
+        writer tight(small, 5);
+        tight.write_uint32(1).write_uint16(2);
+        assert(!tight.ok() && tight.position() == 4 && small[4] == 0);
+        assert(!tight.write_uint8(3).ok() && tight.position() == 4);
+        assert(!writer(small, 5).write_many(samples, (size_t) -1 / 2).ok());
+        // Too long for the 32-bit length prefix, checked or not; the bytes are never read
+        std::string_view endless(reinterpret_cast<const char*>(small), (size_t) UINT32_MAX + 1);
+        assert(!writer(buf.data(), buf.size()).write_string(endless).ok());
+        assert(!unchecked_writer(buf.data(), buf.size()).write_string(endless).ok());
+
+        unchecked_writer fast(buf.data(), buf.size());
+        fast.write_uint64(42).write_string("unchecked");
+        unchecked_reader fast_in(buf.data(), fast.position());
+        assert(fast_in.read_uint64() == 42 && fast_in.read_string() == "unchecked");
+
+        // Tags take over moved buffers rather than copying them
+        std::pmr::string text(1000, 'x');
+        const char* text_data = text.data();
+        string_tag moved("text", std::move(text));
+        assert(moved.value().data() == text_data && moved.value().size() == 1000);
+        std::pmr::string kept = "copied, not moved";
+        string_tag copy("text", kept);
+        assert(kept == "copied, not moved" && copy.value() == kept);
+        std::pmr::vector<uint8_t> bytes(4096, 1);
+        const uint8_t* bytes_data = bytes.data();
+        byte_array_tag blob("blob", std::move(bytes));
+        assert(blob.data() == bytes_data && blob.size() == 4096);
+        std::pmr::vector<float> floats(100, 2.0f);
+        const float* floats_data = floats.data();
+        list_tag<float> list("f", std::move(floats));
+        assert(list.values().data() == floats_data);
     }
-    void int64_roundtrip_test() { }
-    void int32_roundtrip_test() { }
-    void int16_roundtrip_test() { }
-    void int8_roundtrip_test() {
+    void sized_compounds_test() {
+        using namespace metabinary;
+        root_tag doc("MAP");
+        auto entities = new compound_tag("ENTITIES");
+        for (int i = 0; i < 2000; i++)
+            entities->add(new compound_tag(std::to_string(i), {
+                new uint64_tag("uuid", i),
+                new compound_tag("pos", {new float_tag("x", i * 0.5f)}),
+            }));
+        doc.add(entities);
+        doc.add(new compressed_compound_tag("PACKED", {
+            new compound_tag("inner", {new uint32_tag("a", 1), new uint32_tag("b", 2)}),
+            new string_tag("s", "packed packed packed"),
+        }));
+        doc.add(new compound_tag("EMPTY"));
+        doc.add(new string_tag("MAP_NAME", "LEVEL1"));
+
+        for (uint8_t flags : {(uint8_t) doc_sized_compounds, (uint8_t) doc_child_offsets,
+                (uint8_t)(doc_sized_compounds | doc_child_offsets),
+                (uint8_t)(doc_sized_compounds | doc_child_offsets | doc_checksums | doc_compact_ints | doc_interned_names)}) {
+            std::vector<uint8_t> bytes;
+            vector_sink out(bytes);
+            document_writer writer(flags);
+            assert(writer.serialize_to(out, doc) == writer.serialized_size(doc));
+            document_view view(bytes.data(), bytes.size());
+            tag_view root = view.root();
+            assert(view.valid() && root.find("MAP_NAME").as_string() == "LEVEL1");
+
+            // Children by index
+            tag_view list = root.find("ENTITIES");
+            assert(root.child_count() == 4 && list.child_count() == 2000);
+            assert(list.child(1234).name() == "1234" && list.child(1234).find("pos").find("x").as_float() == 617.0f);
+            assert(!list.child(2000).valid() && root.find("EMPTY").child_count() == 0);
+            assert(!root.find("EMPTY").child(0).valid() && !root.find("MAP_NAME").child(0).valid());
 
+            // Expanded blocks are laid out like any other compound of the document
+            std::vector<uint8_t> storage;
+            tag_view packed = root.find("PACKED").expand(storage);
+            assert(packed.child_count() == 2 && packed.child(1).as_string() == "packed packed packed");
+            assert(packed.find("inner").child(1).as_uint32() == 2);
+            if (flags & doc_checksums)
+                assert(root.verify() && packed.verify() && list.child(7).verify());
+
+            root_tag copy = deserialize(bytes.data(), bytes.size());
+            assert(same_tag(copy, doc));
+            std::vector<float> xs;
+            assert(path_query("ENTITIES/*/pos/x").extract(root, xs) == 2000);
+
+            // With lengths, siblings are found without reading the subtree before them,
+            // so a damaged type byte deep inside it goes unnoticed
+            if (!(flags & doc_interned_names)) {
+                tag_view x = list.child(1000).find("pos").find("x");
+                uint8_t* type_byte = bytes.data() + (x.name().data() - sizeof(uint32_t) - 1 - (const char*) bytes.data());
+                assert(*type_byte == tag_float);
+                *type_byte = 0xff;
+                assert(view.root().find("MAP_NAME").valid() == ((flags & doc_sized_compounds) != 0));
+                *type_byte = tag_float;
+            }
+        }
+
+        // Documents using flags from a newer writer are refused
+        std::vector<uint8_t> newer = {'M', 'B', 'I', 'N', document_version, 1 << 6, tag_compound, 0, 0, 0, 0, tag_end};
+        assert(!document_view(newer.data(), newer.size()).valid());
     }
-    void string_roundtrip_test() {
-        std::string begin = "AYYO WHATS UP BABY";
-        uint8_t buf[begin.length()];
-        metabinary::write_string(buf, 0, begin);
-        std::string result = metabinary::read_string(buf, 0);
-        std::cout << begin << std::endl;
-        std::cout << result << std::endl;
-        assert(begin == result);
+    void compact_tree_test() {
+        using namespace metabinary;
+        root_tag doc("MAP");
+        auto entities = new compound_tag("ENTITIES");
+        for (int i = 0; i < 500; i++)
+            entities->add(new compound_tag(std::to_string(i), {
+                new uint64_tag("uuid", 42069 + i),
+                new compound_tag("pos", {new float_tag("x", i * 0.5f), new sint16_tag("y", -i)}),
+            }));
+        doc.add(entities);
+        doc.add(new compressed_compound_tag("PACKED", {
+            new double_tag("d", 2.5),
+            new string_tag("s", "packed packed packed"),
+        }));
+        doc.add(new list_tag<uint32_t>("IDS", {1, 2, 3}));
+        doc.add(new byte_array_tag("RAW", (const uint8_t*) "\x01\x02\x03", 3));
+        doc.add(new compound_tag("EMPTY"));
+        doc.add(new string_tag("MAP_NAME", "LEVEL1"));
+
+        std::vector<uint8_t> bytes(doc.serialized_size());
+        doc.serialize(bytes.data(), 0);
+
+        // Loaded from tags or from bytes, the nodes serialize to the same bytes as the tags
+        compact_tree tree;
+        assert(tree.load(doc) && tree.size() == 1 + 6 + 500 * 5 + 2);
+        assert(tree.serialized_size() == (int) bytes.size());
+        std::vector<uint8_t> written(bytes.size());
+        assert(tree.serialize(written.data(), 0) == (int) bytes.size() && written == bytes);
+        compact_tree viewed;
+        assert(viewed.load(tag_view(bytes.data(), bytes.data() + bytes.size())) && viewed.size() == tree.size());
+        std::fill(written.begin(), written.end(), 0);
+        vector_sink out(written);
+        written.clear();
+        assert(viewed.serialize_to(out) == (int) bytes.size() && written == bytes);
+
+        // The children of a compound are next to each other
+        uint32_t list = tree.find(0, "ENTITIES");
+        assert(tree.node(list).count() == 500 && tree.find(list, "123") == tree.node(list).first() + 123);
+        uint32_t x = tree.find_path("ENTITIES/123/pos/x");
+        assert(tree.value<float>(x) == 61.5f && tree.value<int16_t>(tree.find_path("ENTITIES/123/pos/y")) == -123);
+        assert(tree.value<uint32_t>(x) == 0 && tree.find_path("ENTITIES/123/rot") == compact_tree::npos);
+        assert(tree.string(tree.find_path("PACKED/s")) == "packed packed packed");
+        assert(tree.bytes(tree.find(0, "RAW")).size == 3 && tree.name(tree.find(0, "IDS")) == "IDS");
+        assert(sizeof(compact_node) == 16 && tree.memory() < tree.size() * 24);
+
+        // Changes in place, compressed blocks included
+        assert(tree.set(x, 7.0f) && !tree.set(x, 7.0) && tree.set(tree.find_path("PACKED/d"), 4.0));
+        written.clear();
+        assert(tree.serialize_to(out) == (int) bytes.size() && written != bytes);
+        tag_view changed_root = tag_view(written.data(), written.data() + written.size());
+        std::vector<uint8_t> storage;
+        assert(changed_root.find("ENTITIES").find("123").find("pos").find("x").as_float() == 7.0f);
+        assert(changed_root.find("PACKED").expand(storage).find("d").as_double() == 4.0);
+        root_tag copy = deserialize(written.data(), written.size());
+        arena mem;
+        tag* back = tree.to_tag(&mem);
+        assert(same_tag(*back, copy));
+
+        // Tables have no nodes
+        root_tag with_table("T");
+        with_table.add(to_table(*entities));
+        assert(!tree.load(with_table) && tree.size() == 0 && tree.serialized_size() == 0);
+
+        // A reused tree keeps only the names of what it holds now
+        assert(tree.load(doc));
+        size_t loaded = tree.memory();
+        for (int round = 0; round < 3; round++) {
+            root_tag other("OTHER");
+            for (int i = 0; i < 100; i++)
+                other.add(new uint8_tag("name_" + std::to_string(round * 100 + i), i));
+            assert(tree.load(other));
+        }
+        assert(tree.load(doc) && tree.memory() == loaded && tree.serialized_size() == (int) bytes.size());
     }
 }
 
@@ -577,6 +1710,30 @@ int main() {
     tests::uint16_roundtrip_test();
     tests::uint8_roundtrip_test();
     tests::string_roundtrip_test();
+    tests::serialized_size_test();
+    tests::mapped_view_test();
+    tests::stream_reader_test();
+    tests::compound_index_test();
+    tests::arena_test();
+    tests::packed_list_test();
+    tests::schema_test();
+    tests::interned_names_test();
+    tests::compact_ints_test();
+    tests::compression_test();
+    tests::framing_test();
+    tests::endpoint_test();
+    tests::parallel_serialize_test();
+    tests::patch_test();
+    tests::journal_test();
+    tests::blob_section_test();
+    tests::checksum_test();
+    tests::delta_test();
+    tests::query_test();
+    tests::table_test();
+    tests::instrument_test();
+    tests::cursor_test();
+    tests::sized_compounds_test();
+    tests::compact_tree_test();
 
     using namespace metabinary;
 
@@ -637,17 +1794,14 @@ int main() {
         }},
     }};
 
-    tag *t = demo_file.get("SHORTY");
+    tag *t = demo_file.get("MAP_NAME");
     std::cout << t->name << std::endl;
-    uint8_t  byte_buff[9999];
-    demo_file.serialize(byte_buff, 0);
-    // copy byte to char buff for writing
-    std::cout << byte_buff << std::endl;
-    char output[sizeof(byte_buff)];
-
-    memcpy(output, &byte_buff, sizeof(byte_buff));
-    std::ofstream output_buff("test.bin", std::ios::out|std::ios::binary);
-    output_buff.write(output, sizeof(output));
-    output_buff.close();
+
+    // Serialized straight to disk, sized exactly to the tree
+    int fd = open("test.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    fd_sink output_buff(fd);
+    int written = demo_file.serialize_to(output_buff);
+    close(fd);
+    std::cout << written << " bytes written to test.bin" << std::endl;
     return 0;
 }
\ No newline at end of file
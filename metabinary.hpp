@@ -0,0 +1,5726 @@
+#pragma once
+#include <iostream>
+#include <map>
+#include <fstream>
+#include <vector>
+#include <netinet/in.h>
+#include <cstring>
+#include <climits>
+#include <cassert>
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <string_view>
+#include <memory_resource>
+#include <type_traits>
+#include <array>
+#include <tuple>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+
+/* Metabinary is envisioned as a standard protocol for;
+ * high performance networking, as well as a versatile storage format for data;
+ * encoding both large blocks and small metadata tokens in a single binary file.
+ *
+ */
+namespace metabinary {
+
+#pragma region Write Primitives
+    // Functions for byte array IO
+    // Handles endianness of integer types
+    // All integer types are written to NetworkByteOrder (big endian)
+    // and read back into HostByteOrder (lil endian for x86)
+
+    // Writes an 8-bit unsigned int (1-byte) to the buffer at the given index
+    inline int write_uint8(uint8_t* buf, int index, uint8_t val)      {
+        int offset = index;
+        buf[offset] = val;
+        offset++;
+        return offset-index;
+    }
+    // Writes a 16-bit unsigned int (2-bytes) to the buffer at the given index
+    inline int write_uint16(uint8_t* buf, int index, uint16_t val)    {
+        int offset = index;
+        uint16_t data = htons(val);
+        memcpy(buf+offset, &data, sizeof(uint16_t));
+        offset += sizeof(uint16_t);
+        return offset - index;
+    }
+    // Writes a 32-bit unsigned int (4 bytes) to the buffer at the given index
+    inline int write_uint32(uint8_t* buf, int index, uint32_t val)    {
+        int offset = index;
+        uint32_t data = htonl(val);
+        memcpy(buf+offset, &data, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        return offset - index;
+    }
+    // Writes a 64-bit unsigned int (8 bytes) to the buffer at the given index
+    inline int write_uint64(uint8_t* buf, int index, uint64_t val)    {
+        int offset = index;
+        uint64_t data = htobe64(val);
+        memcpy(buf+offset, &data, sizeof(uint64_t));
+        offset += sizeof(uint64_t);
+        return offset - index;
+    }
+    // Writes an 8-bit signed int (1-byte) to the buffer at the index
+    inline int write_int8(uint8_t* buf, int index, int8_t val)         {
+        int offset = index;
+        int8_t data = val;
+        memcpy(buf+offset, &data, sizeof(int8_t));
+        offset += sizeof(int8_t);
+        return offset - index;
+    }
+    // Writes a 16-bit signed int (2-bytes) to the buffer at the index
+    inline int write_int16(uint8_t* buf, int index, int16_t val)       {
+        int offset = index;
+        int16_t data = htons(val);
+        memcpy(buf+offset, &data, sizeof(int16_t));
+        offset += sizeof(int16_t);
+        return offset - index;
+    }
+    // Writes a 32-bit signed int (4-bytes) to the buffer at the index
+    inline int write_int32(uint8_t* buf, int index, int32_t val)       {
+        int offset = index;
+        int32_t data = htonl(val);
+        memcpy(buf+offset, &data, sizeof(int32_t));
+        offset += sizeof(int32_t);
+        return offset - index;
+    }
+    // Writes a 64-bit signed int (8-bytes) to the buffer at the index
+    inline int write_int64(uint8_t* buf, int index, int64_t val)       {
+        int offset = index;
+        int64_t data = htobe64(val);
+        memcpy(buf+offset, &data, sizeof(int64_t));
+        offset += sizeof(int64_t);
+        return offset - index;
+    }
+    // Writes a 32-bit IEEE 754 float
+    inline int write_float(uint8_t* buf, int index, float val)        {
+        int offset = index;
+        memcpy(buf+offset, &val, sizeof(val));
+        offset += sizeof(float);
+        return offset - index;
+    }
+    // Writes a 64-bit IEEE 754 float
+    inline int write_double(uint8_t* buf, int index, double val)      {
+        int offset = index;
+        memcpy(buf+offset, &val, sizeof(val));
+        offset += sizeof(double);
+        return offset - index;
+    }
+    // Writes a UTF8 String with it's length prefixed as a 32-bit unsigned int
+    inline int write_string(uint8_t* buf, int index, std::string_view val) {
+        int offset = index;
+        // Add Payload Length
+        offset += write_uint32(buf, offset, val.length());
+        // Add Payload (As UTF8-Encoded String)
+        memcpy(buf+offset, val.data(), val.length());
+        offset += val.length();
+        return offset - index;
+    }
+    // Writes an unsigned LEB128 varint, 7 bits per byte with the high bit marking continuation
+    inline int write_varint(uint8_t* buf, int index, uint64_t val)    {
+        int offset = index;
+        while (val >= 0x80) {
+            buf[offset++] = (uint8_t)(val | 0x80);
+            val >>= 7;
+        }
+        buf[offset++] = (uint8_t) val;
+        return offset - index;
+    }
+    // Maps signed values to unsigned ones with small magnitudes staying small: 0, -1, 1, -2 -> 0, 1, 2, 3
+    inline uint64_t zigzag_encode(int64_t val) {
+        return ((uint64_t) val << 1) ^ (uint64_t)(val >> 63);
+    }
+    inline int64_t zigzag_decode(uint64_t val) {
+        return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+    }
+    // Number of bytes write_varint will use for the given value
+    inline int varint_size(uint64_t val) {
+        int size = 1;
+        while (val >= 0x80) {
+            val >>= 7;
+            size++;
+        }
+        return size;
+    }
+    // Number of bytes write_string will use for the given string
+    inline int string_size(std::string_view val) {
+        return sizeof(uint32_t) + val.length();
+    }
+#pragma endregion
+#pragma region Read Primitives
+    inline uint8_t read_uint8(const uint8_t* buf, int index)   {
+        uint8_t outpt = 0;
+        memcpy(&outpt, buf+index, sizeof(uint8_t));
+        return outpt;
+    }
+    inline uint16_t read_uint16(const uint8_t* buf, int index) {
+        uint16_t outpt = 0;
+        memcpy(&outpt, buf+index, sizeof(uint16_t));
+        return ntohs(outpt);
+    }
+    inline uint32_t read_uint32(const uint8_t* buf, int index) {
+        uint32_t outpt = 0;
+        memcpy(&outpt, buf+index, sizeof(uint32_t));
+        return ntohl(outpt);
+    }
+    inline uint64_t read_uint64(const uint8_t* buf, int index) {
+        uint64_t outpt = 0;
+        memcpy(&outpt, buf+index, sizeof(uint64_t));
+        return be64toh(outpt);
+    }
+    inline int8_t read_int8(const uint8_t* buf, int index)      {
+        int8_t outpt = 0;
+        memcpy(&outpt, buf+index, sizeof(int8_t));
+        return outpt;
+    }
+    inline int16_t read_int16(const uint8_t* buf, int index)    {
+        int16_t outpt = 0;
+        memcpy(&outpt, buf+index, sizeof(int16_t));
+        return ntohs(outpt);
+    }
+    inline int32_t read_int32(const uint8_t* buf, int index)    {
+        int32_t outpt = 0;
+        memcpy(&outpt, buf+index, sizeof(int32_t));
+        return ntohl(outpt);
+    }
+    inline int64_t read_int64(const uint8_t* buf, int index)    {
+        int64_t outpt = 0;
+        memcpy(&outpt, buf+index, sizeof(int64_t));
+        return be64toh(outpt);
+    }
+    inline float read_float(const uint8_t* buf, int index)      {
+        float outpt = 0;
+        memcpy(&outpt, buf+index, sizeof(float));
+        return outpt;
+    }
+    inline double read_double(const uint8_t* buf, int index)    {
+        double outpt = 0;
+        memcpy(&outpt, buf+index, sizeof(double));
+        return outpt;
+    }
+    // Reads a varint from the buffer, stopping at end
+    // Returns the number of bytes used, 0 if it is truncated or longer than 64 bits.
+    inline int read_varint(const uint8_t* buf, const uint8_t* end, uint64_t& val) {
+        // Varints of up to 8 bytes are decoded from one 64-bit load, without a loop
+        if (end - buf >= 8) {
+            uint64_t word;
+            memcpy(&word, buf, sizeof(word));
+            word = le64toh(word);
+            uint64_t stops = ~word & 0x8080808080808080ull;
+            if (stops != 0) {
+                int len = (__builtin_ctzll(stops) >> 3) + 1;
+                uint64_t x = word & 0x7f7f7f7f7f7f7f7full;
+                if (len < 8)
+                    x &= (1ull << (len * 8)) - 1;
+                // Squeeze the 7-bit groups together: 8 bits -> 7, 16 -> 14, 32 -> 28
+                x = ((x & 0x7f007f007f007f00ull) >> 1) | (x & 0x007f007f007f007full);
+                x = ((x & 0x3fff00003fff0000ull) >> 2) | (x & 0x00003fff00003fffull);
+                x = ((x & 0x0fffffff00000000ull) >> 4) | (x & 0x000000000fffffffull);
+                val = x;
+                return len;
+            }
+        }
+        val = 0;
+        for (int i = 0; i < 10 && buf + i < end; i++) {
+            // The tenth byte holds bit 63 alone
+            if (i == 9 && buf[i] > 1)
+                return 0;
+            val |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+            if ((buf[i] & 0x80) == 0)
+                return i + 1;
+        }
+        return 0;
+    }
+    inline std::string read_string(const uint8_t* buf, int index) {
+        uint32_t str_len = read_uint32(buf, index);
+        std::string out(reinterpret_cast<const char*>(buf+index+sizeof(uint32_t)), str_len);
+        return out;
+    }
+#pragma endregion
+#pragma region Bulk Primitives
+    // Array versions of the primitives above, for packed lists.
+    // Each element is encoded exactly as its scalar write_* would encode it,
+    // so multi-byte integers are byte swapped in bulk on little endian hosts.
+
+    // Reverses the bytes of count elements of the given width, one at a time
+    inline void bswap_scalar(uint8_t* dst, const uint8_t* src, size_t count, int width)
+    {
+        for (size_t i = 0; i < count; i++, src += width, dst += width) {
+            if (width == 2) {
+                uint16_t v;
+                memcpy(&v, src, 2);
+                v = __builtin_bswap16(v);
+                memcpy(dst, &v, 2);
+            } else if (width == 4) {
+                uint32_t v;
+                memcpy(&v, src, 4);
+                v = __builtin_bswap32(v);
+                memcpy(dst, &v, 4);
+            } else {
+                uint64_t v;
+                memcpy(&v, src, 8);
+                v = __builtin_bswap64(v);
+                memcpy(dst, &v, 8);
+            }
+        }
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    // pshufb control reversing each 2, 4 or 8 byte element within a 16 byte lane
+    __attribute__((target("ssse3")))
+    inline __m128i bswap_mask(int width)
+    {
+        if (width == 2)
+            return _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+        if (width == 4)
+            return _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        return _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    }
+    // Swaps whole 16 byte blocks, returns the number of bytes done
+    __attribute__((target("ssse3")))
+    inline size_t bswap_ssse3(uint8_t* dst, const uint8_t* src, size_t bytes, int width)
+    {
+        __m128i mask = bswap_mask(width);
+        size_t i = 0;
+        for (; i + 16 <= bytes; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_shuffle_epi8(v, mask));
+        }
+        return i;
+    }
+    // Swaps whole 32 byte blocks, returns the number of bytes done
+    __attribute__((target("avx2")))
+    inline size_t bswap_avx2(uint8_t* dst, const uint8_t* src, size_t bytes, int width)
+    {
+        __m256i mask = _mm256_broadcastsi128_si256(bswap_mask(width));
+        size_t i = 0;
+        for (; i + 32 <= bytes; i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_shuffle_epi8(v, mask));
+        }
+        return i;
+    }
+#endif
+    // Reverses the bytes of count elements of width 2, 4 or 8; dst may equal src
+    // Uses AVX2 or SSSE3 shuffles when the CPU has them, the rest is done a scalar at a time.
+    inline void bswap_copy(uint8_t* dst, const uint8_t* src, size_t count, int width)
+    {
+        size_t bytes = count * width;
+        size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+        static const int level = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("ssse3") ? 1 : 0;
+        if (level == 2)
+            done = bswap_avx2(dst, src, bytes, width);
+        else if (level == 1)
+            done = bswap_ssse3(dst, src, bytes, width);
+#endif
+        bswap_scalar(dst + done, src + done, (bytes - done) / width, width);
+    }
+    // Integers wider than a byte go out in network order, like write_uint16..write_int64
+    template<typename T>
+    constexpr bool swapped_on_wire()
+    {
+        return std::is_integral<T>::value && sizeof(T) > 1 && __BYTE_ORDER == __LITTLE_ENDIAN;
+    }
+    // Writes count elements to the buffer at the given index
+    template<typename T>
+    inline int write_array(uint8_t* buf, int index, const T* data, size_t count)
+    {
+        if (swapped_on_wire<T>())
+            bswap_copy(buf + index, reinterpret_cast<const uint8_t*>(data), count, sizeof(T));
+        else
+            memcpy(buf + index, data, count * sizeof(T));
+        return count * sizeof(T);
+    }
+    // Reads count elements from the buffer at the given index into out
+    template<typename T>
+    inline void read_array(const uint8_t* buf, int index, T* out, size_t count)
+    {
+        if (swapped_on_wire<T>())
+            bswap_copy(reinterpret_cast<uint8_t*>(out), buf + index, count, sizeof(T));
+        else
+            memcpy(out, buf + index, count * sizeof(T));
+    }
+#pragma endregion
+#pragma region Cursors
+    // Sequential writer over a caller's buffer, keeping its own position so values are
+    // written one after another without offset arithmetic, and documents past 2GB don't
+    // overflow it:
+    //     writer out(buf, len);
+    //     out.write_uint32(7).write_string("name");
+    // A checked writer refuses any value that would run past the end, and stays failed
+    // from then on; an unchecked one trusts the caller to have sized the buffer (as
+    // serialized_size() does), and costs no more than the bare primitives.
+    template<bool Checked = true>
+    class writer {
+    public:
+        writer(uint8_t* buf, size_t len) : buf(buf), len(len) {}
+
+        writer& write_uint8(uint8_t val)   { return put(sizeof(val), metabinary::write_uint8, val); }
+        writer& write_uint16(uint16_t val) { return put(sizeof(val), metabinary::write_uint16, val); }
+        writer& write_uint32(uint32_t val) { return put(sizeof(val), metabinary::write_uint32, val); }
+        writer& write_uint64(uint64_t val) { return put(sizeof(val), metabinary::write_uint64, val); }
+        writer& write_int8(int8_t val)     { return put(sizeof(val), metabinary::write_int8, val); }
+        writer& write_int16(int16_t val)   { return put(sizeof(val), metabinary::write_int16, val); }
+        writer& write_int32(int32_t val)   { return put(sizeof(val), metabinary::write_int32, val); }
+        writer& write_int64(int64_t val)   { return put(sizeof(val), metabinary::write_int64, val); }
+        writer& write_float(float val)     { return put(sizeof(val), metabinary::write_float, val); }
+        writer& write_double(double val)   { return put(sizeof(val), metabinary::write_double, val); }
+        writer& write_varint(uint64_t val) { return put(varint_size(val), metabinary::write_varint, val); }
+        // Refuses, even unchecked, a string too long for its 32-bit length prefix
+        writer& write_string(std::string_view val)
+        {
+            if (val.length() > UINT32_MAX) {
+                failed = true;
+                return *this;
+            }
+            if (reserve(sizeof(uint32_t) + val.length())) {
+                metabinary::write_uint32(buf + pos, 0, val.length());
+                memcpy(buf + pos + sizeof(uint32_t), val.data(), val.length());
+                pos += sizeof(uint32_t) + val.length();
+            }
+            return *this;
+        }
+        writer& write_bytes(const void* data, size_t size)
+        {
+            if (reserve(size)) {
+                memcpy(buf + pos, data, size);
+                pos += size;
+            }
+            return *this;
+        }
+        // Writes count scalars at once, each encoded as its write_* would encode it
+        template<typename T>
+        writer& write_many(const T* data, size_t count)
+        {
+            if (reserve(count, sizeof(T))) {
+                write_array(buf + pos, 0, data, count);
+                pos += count * sizeof(T);
+            }
+            return *this;
+        }
+
+        // Bytes written so far, and the next byte to write
+        size_t position() const { return pos; }
+        size_t remaining() const { return len - pos; }
+        uint8_t* data() const { return buf + pos; }
+        // False once a checked writer has refused a value
+        bool ok() const { return !failed; }
+    private:
+        // Whether count values of width bytes fit, failing for good if they don't
+        bool reserve(size_t count, size_t width = 1)
+        {
+            if (!Checked)
+                return true;
+            if (failed || (len - pos) / width < count)
+                failed = true;
+            return !failed;
+        }
+        template<typename Write, typename T>
+        writer& put(size_t size, Write write, T val)
+        {
+            if (reserve(size))
+                pos += write(buf + pos, 0, val);
+            return *this;
+        }
+        uint8_t* buf;
+        size_t len;
+        size_t pos = 0;
+        bool failed = false;
+    };
+    // Sequential reader over encoded bytes, the counterpart of writer.
+    // A checked reader returns zero (or an empty string) for any value that would run
+    // past the end and stays failed from then on; an unchecked one reads blindly.
+    template<bool Checked = true>
+    class reader {
+    public:
+        reader(const uint8_t* buf, size_t len) : buf(buf), len(len) {}
+
+        uint8_t  read_uint8()  { return get<uint8_t>(metabinary::read_uint8); }
+        uint16_t read_uint16() { return get<uint16_t>(metabinary::read_uint16); }
+        uint32_t read_uint32() { return get<uint32_t>(metabinary::read_uint32); }
+        uint64_t read_uint64() { return get<uint64_t>(metabinary::read_uint64); }
+        int8_t   read_int8()   { return get<int8_t>(metabinary::read_int8); }
+        int16_t  read_int16()  { return get<int16_t>(metabinary::read_int16); }
+        int32_t  read_int32()  { return get<int32_t>(metabinary::read_int32); }
+        int64_t  read_int64()  { return get<int64_t>(metabinary::read_int64); }
+        float    read_float()  { return get<float>(metabinary::read_float); }
+        double   read_double() { return get<double>(metabinary::read_double); }
+        uint64_t read_varint()
+        {
+            uint64_t val = 0;
+            int used = failed ? 0 : metabinary::read_varint(buf + pos, buf + len, val);
+            if (used == 0) {
+                failed = true;
+                return 0;
+            }
+            pos += used;
+            return val;
+        }
+        // A string written by write_string, pointing into the buffer rather than copied
+        std::string_view read_string()
+        {
+            uint32_t size = read_uint32();
+            const uint8_t* at = read_bytes(size);
+            return at != nullptr ? std::string_view(reinterpret_cast<const char*>(at), size) : std::string_view();
+        }
+        // Steps over size bytes, returning where they start (nullptr if they run past the end)
+        const uint8_t* read_bytes(size_t size)
+        {
+            if (!reserve(size))
+                return nullptr;
+            const uint8_t* at = buf + pos;
+            pos += size;
+            return at;
+        }
+        // Reads count scalars written by write_many into out
+        template<typename T>
+        bool read_many(T* out, size_t count)
+        {
+            if (!reserve(count, sizeof(T)))
+                return false;
+            read_array(buf + pos, 0, out, count);
+            pos += count * sizeof(T);
+            return true;
+        }
+
+        size_t position() const { return pos; }
+        size_t remaining() const { return len - pos; }
+        const uint8_t* data() const { return buf + pos; }
+        // False once a checked reader has run out of bytes
+        bool ok() const { return !failed; }
+    private:
+        // Whether count values of width bytes fit, failing for good if they don't
+        bool reserve(size_t count, size_t width = 1)
+        {
+            if (!Checked)
+                return true;
+            if (failed || (len - pos) / width < count)
+                failed = true;
+            return !failed;
+        }
+        template<typename T>
+        T get(T (*read)(const uint8_t*, int))
+        {
+            if (!reserve(sizeof(T)))
+                return 0;
+            T val = read(buf + pos, 0);
+            pos += sizeof(T);
+            return val;
+        }
+        const uint8_t* buf;
+        size_t len;
+        size_t pos = 0;
+        bool failed = false;
+    };
+    typedef writer<false> unchecked_writer;
+    typedef reader<false> unchecked_reader;
+#pragma endregion
+#pragma region Block Compression
+    // Byte oriented LZ77 codec in the style of LZ4's block format, used for compressed compounds.
+    // A block is a run of sequences: a token byte (literal count << 4 | match length - 4),
+    // extra count bytes when either nibble is 15, the literals, then a 16-bit little endian
+    // match offset and extra match length bytes. The last sequence has literals only.
+    static const int lz_min_match = 4;
+    static const int lz_hash_bits = 14;
+
+    // Worst case compressed size for len input bytes
+    inline size_t lz_bound(size_t len)
+    {
+        return len + len / 255 + 16;
+    }
+    inline uint32_t lz_load32(const uint8_t* p)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    inline uint8_t* lz_write_count(uint8_t* op, size_t count)
+    {
+        for (; count >= 255; count -= 255)
+            *op++ = 255;
+        *op++ = (uint8_t) count;
+        return op;
+    }
+    inline uint8_t* lz_write_sequence(uint8_t* op, const uint8_t* literals, size_t literal_len, size_t offset, size_t match_len)
+    {
+        uint8_t* token = op++;
+        *token = (uint8_t)(std::min<size_t>(literal_len, 15) << 4);
+        if (literal_len >= 15)
+            op = lz_write_count(op, literal_len - 15);
+        if (literal_len != 0)
+            memcpy(op, literals, literal_len);
+        op += literal_len;
+        if (match_len == 0)
+            return op;
+        *op++ = (uint8_t) offset;
+        *op++ = (uint8_t)(offset >> 8);
+        match_len -= lz_min_match;
+        *token |= (uint8_t) std::min<size_t>(match_len, 15);
+        if (match_len >= 15)
+            op = lz_write_count(op, match_len - 15);
+        return op;
+    }
+    // Compresses len bytes of src into dst, which must hold lz_bound(len) bytes
+    // Returns the compressed size.
+    inline size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst)
+    {
+        std::vector<uint32_t> table(1 << lz_hash_bits);
+        uint8_t* op = dst;
+        size_t anchor = 0;
+        size_t i = 0;
+        // The last 12 bytes never start a match and the last 5 are always literals
+        size_t match_limit = len > 12 ? len - 12 : 0;
+        while (i < match_limit) {
+            uint32_t seq = lz_load32(src + i);
+            uint32_t hash = (seq * 2654435761u) >> (32 - lz_hash_bits);
+            size_t ref = table[hash];
+            table[hash] = i;
+            if (ref >= i || i - ref > 65535 || lz_load32(src + ref) != seq) {
+                i++;
+                continue;
+            }
+            size_t match_len = lz_min_match;
+            while (i + match_len < len - 5 && src[ref + match_len] == src[i + match_len])
+                match_len++;
+            op = lz_write_sequence(op, src + anchor, i - anchor, i - ref, match_len);
+            i += match_len;
+            anchor = i;
+        }
+        op = lz_write_sequence(op, src + anchor, len - anchor, 0, 0);
+        return op - dst;
+    }
+    inline bool lz_read_count(const uint8_t*& ip, const uint8_t* end, size_t& count)
+    {
+        uint8_t b;
+        do {
+            if (ip >= end)
+                return false;
+            b = *ip++;
+            count += b;
+        } while (b == 255);
+        return true;
+    }
+    // Decompresses a block into exactly dst_len bytes of dst
+    // Returns false if the block is malformed or doesn't decode to dst_len bytes.
+    inline bool lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_len)
+    {
+        const uint8_t* ip = src;
+        const uint8_t* end = src + len;
+        uint8_t* op = dst;
+        uint8_t* op_end = dst + dst_len;
+        while (ip < end) {
+            uint8_t token = *ip++;
+            size_t literal_len = token >> 4;
+            if (literal_len == 15 && !lz_read_count(ip, end, literal_len))
+                return false;
+            if ((size_t)(end - ip) < literal_len || (size_t)(op_end - op) < literal_len)
+                return false;
+            if (literal_len != 0)
+                memcpy(op, ip, literal_len);
+            ip += literal_len;
+            op += literal_len;
+            if (ip == end)
+                break;
+            if (end - ip < 2)
+                return false;
+            size_t offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            size_t match_len = token & 15;
+            if (match_len == 15 && !lz_read_count(ip, end, match_len))
+                return false;
+            match_len += lz_min_match;
+            if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(op_end - op) < match_len)
+                return false;
+            const uint8_t* match = op - offset;
+            if (offset >= match_len) {
+                memcpy(op, match, match_len);
+                op += match_len;
+            } else {
+                // Overlapping copy repeats the last offset bytes
+                for (size_t k = 0; k < match_len; k++)
+                    *op++ = match[k];
+            }
+        }
+        return op == op_end;
+    }
+#pragma endregion
+#pragma region Checksums
+    // CRC32C (Castagnoli polynomial, reflected), the one SSE4.2's crc32 instruction computes
+    // Slice-by-8 tables: table[k][b] is the CRC of byte b followed by k zero bytes.
+    struct crc32c_tables {
+        uint32_t table[8][256];
+        crc32c_tables()
+        {
+            for (uint32_t b = 0; b < 256; b++) {
+                uint32_t crc = b;
+                for (int i = 0; i < 8; i++)
+                    crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+                table[0][b] = crc;
+            }
+            for (int k = 1; k < 8; k++)
+                for (uint32_t b = 0; b < 256; b++)
+                    table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+        }
+    };
+    // Eight bytes per step through eight table lookups
+    inline uint32_t crc32c_slice8(uint32_t crc, const uint8_t* data, size_t len)
+    {
+        static const crc32c_tables tables;
+        auto& t = tables.table;
+        for (; len >= 8; data += 8, len -= 8) {
+            uint64_t word;
+            memcpy(&word, data, 8);
+            word = le64toh(word) ^ crc;
+            crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^ t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff]
+                ^ t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^ t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+        }
+        for (; len > 0; len--)
+            crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
+        return crc;
+    }
+#if defined(__x86_64__)
+    __attribute__((target("sse4.2")))
+    inline uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data, size_t len)
+    {
+        uint64_t crc64 = crc;
+        for (; len >= 8; data += 8, len -= 8) {
+            uint64_t word;
+            memcpy(&word, data, 8);
+            crc64 = _mm_crc32_u64(crc64, word);
+        }
+        crc = (uint32_t) crc64;
+        for (; len > 0; len--)
+            crc = _mm_crc32_u8(crc, *data++);
+        return crc;
+    }
+#endif
+    // CRC32C of len bytes; pass the previous result as crc to continue over another piece
+    // Uses the SSE4.2 crc32 instruction when the CPU has it.
+    inline uint32_t crc32c(const uint8_t* data, size_t len, uint32_t crc = 0)
+    {
+#if defined(__x86_64__)
+        static const bool sse42 = __builtin_cpu_supports("sse4.2");
+        if (sse42)
+            return ~crc32c_sse42(~crc, data, len);
+#endif
+        return ~crc32c_slice8(~crc, data, len);
+    }
+#pragma endregion
+#pragma region Output Sinks
+    // Largest tree or document the serializers write, as sinks take int lengths
+    static const size_t max_serialized_size = INT_MAX;
+    // size as an int length, or -1, which every sink refuses, past max_serialized_size
+    inline int checked_size(uint64_t size)
+    {
+        return size > max_serialized_size ? -1 : (int) size;
+    }
+    // Destination for a serialized tag tree.
+    // The tree is measured with serialized_size() before anything is written,
+    // so a sink is asked for the exact number of bytes it will receive, once.
+    class sink {
+    public:
+        virtual ~sink() {}
+        // Returns len writable bytes, or nullptr if the sink cannot hold them
+        virtual uint8_t* acquire(int len) = 0;
+        // Called once the acquired bytes are filled in, returns false on failure
+        virtual bool commit(int len) { return true; }
+    };
+    // Writes into a caller-owned buffer of fixed capacity, refusing anything that would overrun it
+    class span_sink : public sink {
+    public:
+        span_sink(uint8_t* buf, int capacity) : buf(buf), capacity(capacity) {}
+        uint8_t* acquire(int len) override {
+            if (len < 0 || len > capacity - used)
+                return nullptr;
+            return buf + used;
+        }
+        bool commit(int len) override {
+            used += len;
+            return true;
+        }
+        int size() const { return used; }
+    private:
+        uint8_t* buf;
+        int capacity;
+        int used = 0;
+    };
+    // Appends to a std::vector, growing it once by the exact serialized size
+    class vector_sink : public sink {
+    public:
+        vector_sink(std::vector<uint8_t>& out) : out(out) {}
+        uint8_t* acquire(int len) override {
+            if (len < 0)
+                return nullptr;
+            size_t offset = out.size();
+            out.resize(offset + len);
+            return out.data() + offset;
+        }
+    private:
+        std::vector<uint8_t>& out;
+    };
+    // Writes to a file descriptor (file, pipe or socket) without any trailing padding
+    // The staging buffer is kept between calls so repeated writes don't reallocate
+    class fd_sink : public sink {
+    public:
+        fd_sink(int fd) : fd(fd) {}
+        uint8_t* acquire(int len) override {
+            if (len < 0)
+                return nullptr;
+            staging.resize(len);
+            return staging.data();
+        }
+        bool commit(int len) override {
+            int offset = 0;
+            while (offset < len) {
+                ssize_t n = ::write(fd, staging.data() + offset, len - offset);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                offset += n;
+            }
+            return true;
+        }
+    private:
+        int fd;
+        std::vector<uint8_t> staging;
+    };
+#pragma endregion
+    typedef enum {
+        tag_end = 0,
+        tag_uint8, tag_uint16, tag_uint32, tag_uint64,
+        tag_sint8, tag_sint16, tag_sint32, tag_sint64,
+        tag_float, tag_double,
+        tag_byte_array,
+        tag_string,
+        tag_list,
+        tag_compound,
+        // Compound whose children are stored as one compressed block
+        tag_compressed,
+        // Records of one shape, stored a column at a time
+        tag_table,
+        tag_identifier = -1,
+        tag_primitive = -2,
+    } tag_type_t;
+    // Compounds and compressed compounds both hold child tags
+    inline bool is_compound(tag_type_t type)
+    {
+        return type == tag_compound || type == tag_compressed;
+    }
+    // Tag type of a scalar C++ type, used for list elements
+    template<typename T> struct tag_type_of;
+    template<> struct tag_type_of<uint8_t>  { static const tag_type_t value = tag_uint8; };
+    template<> struct tag_type_of<uint16_t> { static const tag_type_t value = tag_uint16; };
+    template<> struct tag_type_of<uint32_t> { static const tag_type_t value = tag_uint32; };
+    template<> struct tag_type_of<uint64_t> { static const tag_type_t value = tag_uint64; };
+    template<> struct tag_type_of<int8_t>   { static const tag_type_t value = tag_sint8; };
+    template<> struct tag_type_of<int16_t>  { static const tag_type_t value = tag_sint16; };
+    template<> struct tag_type_of<int32_t>  { static const tag_type_t value = tag_sint32; };
+    template<> struct tag_type_of<int64_t>  { static const tag_type_t value = tag_sint64; };
+    template<> struct tag_type_of<float>    { static const tag_type_t value = tag_float; };
+    template<> struct tag_type_of<double>   { static const tag_type_t value = tag_double; };
+#pragma region Instrumentation
+    // Tag counts, name and payload bytes per tag type, tag allocations and subtree
+    // timings of the serialize and read paths. Compiled in by defining
+    // METABINARY_INSTRUMENT before including this header; without it the hooks are
+    // empty and cost nothing, and profile reports only zeros.
+#ifdef METABINARY_INSTRUMENT
+    static const bool instrumented = true;
+#else
+    static const bool instrumented = false;
+#endif
+    inline const char* tag_type_name(tag_type_t type)
+    {
+        static const char* const names[] = {
+            "end", "uint8", "uint16", "uint32", "uint64", "sint8", "sint16", "sint32", "sint64",
+            "float", "double", "byte_array", "string", "list", "compound", "compressed", "table",
+        };
+        return type >= 0 && type <= tag_table ? names[type] : "unknown";
+    }
+    class profile {
+    public:
+        struct type_counts {
+            uint64_t written = 0;
+            uint64_t read = 0;
+            // Bytes written for the names and payloads of tags of this type. A compound's
+            // or table's payload is its own framing; the tags inside count for themselves.
+            // The children of a compressed compound are counted as they are packed, at
+            // their uncompressed size, on top of the block written for them.
+            uint64_t name_bytes = 0;
+            uint64_t payload_bytes = 0;
+        };
+        // A timed subtree, in nanoseconds since the profile started
+        struct span {
+            const char* op;
+            std::string name;
+            uint64_t start;
+            uint64_t duration;
+            uint32_t thread;
+        };
+
+        // The profile every hook reports to
+        static profile& global()
+        {
+            static profile instance;
+            return instance;
+        }
+        // Compounds this many levels deep or less are timed, the outermost being 1
+        std::atomic<int> span_depth{2};
+
+        void reset()
+        {
+            for (auto& c : types)
+                c.written = c.read = c.name_bytes = c.payload_bytes = 0;
+            allocs = 0;
+            alloc_bytes = 0;
+            std::lock_guard<std::mutex> hold(lock);
+            spans_.clear();
+        }
+        type_counts counts(tag_type_t type) const
+        {
+            const counters& c = types[type];
+            return {c.written, c.read, c.name_bytes, c.payload_bytes};
+        }
+        uint64_t allocations() const { return allocs; }
+        uint64_t allocated_bytes() const { return alloc_bytes; }
+        std::vector<span> spans() const
+        {
+            std::lock_guard<std::mutex> hold(lock);
+            return spans_;
+        }
+        // One line per tag type seen, then the allocation totals
+        std::string summary() const
+        {
+            std::string out = "type           written       read   name bytes  payload bytes\n";
+            char line[128];
+            for (int type = 0; type <= tag_table; type++) {
+                type_counts c = counts((tag_type_t) type);
+                if (c.written == 0 && c.read == 0)
+                    continue;
+                snprintf(line, sizeof(line), "%-12s %9llu %10llu %12llu %14llu\n", tag_type_name((tag_type_t) type),
+                    (unsigned long long) c.written, (unsigned long long) c.read,
+                    (unsigned long long) c.name_bytes, (unsigned long long) c.payload_bytes);
+                out += line;
+            }
+            snprintf(line, sizeof(line), "tag allocations %llu, %llu bytes\n",
+                (unsigned long long) allocations(), (unsigned long long) allocated_bytes());
+            return out + line;
+        }
+        // Spans in the Chrome trace event format, for chrome://tracing or Perfetto
+        std::string chrome_trace() const
+        {
+            std::string out = "{\"traceEvents\":[";
+            char event[96];
+            bool first = true;
+            for (const span& s : spans()) {
+                out += first ? "\n" : ",\n";
+                first = false;
+                out += "{\"name\":\"";
+                for (char c : s.name) {
+                    if (c == '"' || c == '\\')
+                        out += '\\';
+                    if ((uint8_t) c >= 0x20)
+                        out += c;
+                }
+                snprintf(event, sizeof(event), "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+                    s.op, s.start / 1e3, s.duration / 1e3, s.thread);
+                out += event;
+            }
+            return out + "\n]}\n";
+        }
+
+        // Hooks, called through the profile_ functions below
+        void wrote(tag_type_t type, size_t name_bytes, size_t payload_bytes)
+        {
+            counters& c = types[type];
+            c.written.fetch_add(1, std::memory_order_relaxed);
+            c.name_bytes.fetch_add(name_bytes, std::memory_order_relaxed);
+            c.payload_bytes.fetch_add(payload_bytes, std::memory_order_relaxed);
+        }
+        void read(tag_type_t type) { types[type].read.fetch_add(1, std::memory_order_relaxed); }
+        void allocated(size_t bytes)
+        {
+            allocs.fetch_add(1, std::memory_order_relaxed);
+            alloc_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+        void add_span(span s)
+        {
+            std::lock_guard<std::mutex> hold(lock);
+            spans_.push_back(std::move(s));
+        }
+        uint64_t now() const
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+    private:
+        struct counters {
+            std::atomic<uint64_t> written{0}, read{0}, name_bytes{0}, payload_bytes{0};
+        };
+        std::array<counters, tag_table + 1> types;
+        std::atomic<uint64_t> allocs{0}, alloc_bytes{0};
+        mutable std::mutex lock;
+        std::vector<span> spans_;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    };
+    inline void profile_write(tag_type_t type, size_t name_bytes, size_t payload_bytes)
+    {
+#ifdef METABINARY_INSTRUMENT
+        profile::global().wrote(type, name_bytes, payload_bytes);
+#endif
+    }
+    inline void profile_read(tag_type_t type)
+    {
+#ifdef METABINARY_INSTRUMENT
+        profile::global().read(type);
+#endif
+    }
+    inline void profile_alloc(size_t bytes)
+    {
+#ifdef METABINARY_INSTRUMENT
+        profile::global().allocated(bytes);
+#endif
+    }
+    // Times the enclosing scope as a span of the subtree named name, if it is within
+    // profile::span_depth of the outermost scope on this thread
+    class profile_scope {
+    public:
+#ifdef METABINARY_INSTRUMENT
+        profile_scope(const char* op, std::string_view name)
+        {
+            if (++depth() > profile::global().span_depth)
+                return;
+            static std::atomic<uint32_t> threads{0};
+            thread_local uint32_t thread = ++threads;
+            current = {op, std::string(name), profile::global().now(), 0, thread};
+            timed = true;
+        }
+        ~profile_scope()
+        {
+            depth()--;
+            if (!timed)
+                return;
+            current.duration = profile::global().now() - current.start;
+            profile::global().add_span(std::move(current));
+        }
+        profile_scope(const profile_scope&) = delete;
+        profile_scope& operator=(const profile_scope&) = delete;
+    private:
+        static int& depth()
+        {
+            thread_local int level = 0;
+            return level;
+        }
+        profile::span current;
+        bool timed = false;
+#else
+        profile_scope(const char*, std::string_view) {}
+#endif
+    };
+#pragma endregion
+    // Memory resource that tag names, strings and child arrays are allocated from
+    // Normally the heap; arena::make points it at the arena while a tag is constructed.
+    inline std::pmr::memory_resource*& construction_resource()
+    {
+        thread_local std::pmr::memory_resource* resource = std::pmr::get_default_resource();
+        return resource;
+    }
+    class tag;
+    // Children of a compressed compound, compressed as one block
+    struct packed_block {
+        int raw_size = 0;
+        std::vector<uint8_t> bytes;
+    };
+    inline packed_block pack_block(const uint8_t* raw, int raw_size)
+    {
+        packed_block out;
+        out.raw_size = raw_size;
+        out.bytes.resize(lz_bound(raw_size));
+        out.bytes.resize(lz_compress(raw, raw_size, out.bytes.data()));
+        return out;
+    }
+    // Blocks packed ahead of one write, by the compressed compound they belong to, so each
+    // is compressed once however often the tree is measured and written. Made for the
+    // write and dropped after it, as it points at the tags.
+    typedef std::unordered_map<const tag*, packed_block> packed_blocks;
+    // FNV-1a, used to index compound children by name
+    inline uint32_t hash_name(std::string_view name)
+    {
+        uint32_t hash = 2166136261u;
+        for (char c : name) {
+            hash ^= (uint8_t) c;
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+    // Interned tag name, for lookups that compare ids instead of strings
+    struct name_key {
+        std::string_view text;
+        uint32_t id = 0;
+        uint32_t hash = 0;
+        // name_table::generation() of the table the id is from
+        uint32_t generation = 0;
+    };
+    // Gives each distinct name a small id, counting from 1
+    class name_table {
+    public:
+        name_key intern(std::string_view name)
+        {
+            auto found = ids.find(name);
+            if (found != ids.end())
+                return keys[found->second - 1];
+            names.emplace_back(name);
+            name_key key {names.back(), (uint32_t) names.size(), hash_name(name), generation_};
+            keys.push_back(key);
+            ids.emplace(key.text, key.id);
+            return key;
+        }
+        // Key of a name already in the table, or one with id 0 if it isn't
+        name_key find(std::string_view name) const
+        {
+            auto found = ids.find(name);
+            return found != ids.end() ? keys[found->second - 1] : name_key{name, 0, hash_name(name), generation_};
+        }
+        const name_key& key(uint32_t id) const { return keys[id - 1]; }
+        size_t size() const { return keys.size(); }
+        // Tells this table's ids from those of any other table, or of this one before clear()
+        uint32_t generation() const { return generation_; }
+        // Forgets every name; ids start from 1 again
+        void clear()
+        {
+            ids.clear();
+            keys.clear();
+            names.clear();
+            generation_ = next_generation();
+        }
+    private:
+        static uint32_t next_generation()
+        {
+            static std::atomic<uint32_t> last{0};
+            return ++last;
+        }
+
+        uint32_t generation_ = next_generation();
+        // Deque so the views held by keys and ids stay put as it grows
+        std::deque<std::string> names;
+        std::vector<name_key> keys;
+        std::unordered_map<std::string_view, uint32_t> ids;
+    };
+    class tag {
+    public:
+        std::pmr::string name{construction_resource()};
+        // Id of name in a name_table, 0 if it hasn't been interned
+        // Changing name leaves this stale; intern the tag again afterwards.
+        uint32_t name_id = 0;
+        // name_table::generation() of the table name_id is from
+        uint32_t name_generation = 0;
+        // Set for tags made by an arena, which frees them; compounds delete any other child
+        bool in_arena = false;
+
+        tag() {}
+        tag(std::string_view name) {
+            this->name = name;
+        }
+        virtual ~tag() = default;
+
+        virtual tag_type_t type() const { return tag_end; }
+        virtual int serialize(uint8_t* buf, int startidx)
+        {
+            return 0;
+        }
+        // Number of bytes serialize() writes for this tag, type byte and name included,
+        // or -1 if that is past max_serialized_size
+        virtual int serialized_size() const
+        {
+            return 0;
+        }
+        // The same two, taking compressed blocks from blocks where it has them;
+        // only compounds have any to take
+        virtual int serialize_with(uint8_t* buf, int startidx, const packed_blocks*)
+        {
+            return serialize(buf, startidx);
+        }
+        virtual int serialized_size_with(const packed_blocks*) const
+        {
+            return serialized_size();
+        }
+        // Packs the compressed blocks in the tree, measures it, then serializes it straight
+        // into the sink's storage
+        // Returns the number of bytes written, or -1 if the sink rejected them
+        int serialize_to(sink& out);
+
+        //static tag deserialize(byte* data);
+        // Encodes name length + utf8 string
+        int write_name(uint8_t* buf, int startidx)
+        {
+            return write_string(buf, startidx, this->name);
+        }
+        int name_size() const
+        {
+            return string_size(this->name);
+        }
+        // Number of bytes write_payload() writes, for anything but a compound
+        int payload_size() const
+        {
+            int size = serialized_size();
+            return size < 0 ? -1 : size - sizeof(uint8_t) - name_size();
+        }
+
+        static int write_type(uint8_t* buf, int startidx, tag_type_t tag_type)
+        {
+            int index = startidx;
+            buf[index] = tag_type;
+            index++;
+            return index-startidx;
+        }
+        virtual int write_payload(uint8_t* buf, int startidx) { return 0; }
+    private:
+
+    protected:
+    };
+    // Deletes a tag taken out of a tree, unless an arena holds it
+    inline void dispose(tag* t)
+    {
+        if (t != nullptr && !t->in_arena)
+            delete t;
+    }
+    class end_tag : public tag {
+    public:
+        int serialize(uint8_t *buf, int startidx) override { return 0; }
+    };
+    class uint8_tag : public tag {
+    private:
+        uint8_t payload;
+    public:
+        uint8_tag() {}
+        uint8_tag(std::string_view name) { this->name = name; }
+        uint8_tag(std::string_view name, uint8_t data)
+        {
+            this->name = name;
+            payload = data;
+        }
+        uint8_t value() const { return payload; }
+        tag_type_t type() const override { return metabinary::tag_uint8; }
+        int serialize(uint8_t *buf, int startidx) override {
+            int offset = startidx;
+            offset += write_type(buf, offset, metabinary::tag_uint8);
+            offset += write_name(buf, offset);
+            offset += write_payload(buf, offset);
+            return offset-startidx;
+        }
+        int write_payload(uint8_t *buf, int startidx) override
+        {
+            return write_uint8(buf, startidx, payload);
+        }
+        int serialized_size() const override {
+            return sizeof(uint8_t) + name_size() + sizeof(payload);
+        }
+    };
+    class uint16_tag : public tag {
+    private:
+        uint16_t payload;
+    public:
+        uint16_tag(std::string_view name, uint16_t data)
+        {
+            this->name = name;
+            payload = data;
+        }
+        uint16_t value() const { return payload; }
+        tag_type_t type() const override { return metabinary::tag_uint16; }
+        int serialize(uint8_t *buf, int startidx) override {
+            int offset = startidx;
+            offset += write_type(buf, offset, metabinary::tag_uint16);
+            offset += write_name(buf, offset);
+            offset += write_payload(buf, offset);
+            return offset-startidx;
+        }
+        int write_payload(uint8_t *buf, int startidx) override
+        {
+            return write_uint16(buf, startidx, payload);
+        }
+        int serialized_size() const override {
+            return sizeof(uint8_t) + name_size() + sizeof(payload);
+        }
+    };
+    class uint32_tag : public tag {
+    private:
+        uint32_t payload;
+    public:
+        uint32_tag() {}
+        uint32_tag(std::string_view name) { this->name = name; }
+        uint32_tag(std::string_view name, uint32_t data)
+        {
+            this->name = name;
+            payload = data;
+        }
+        uint32_t value() const { return payload; }
+        tag_type_t type() const override { return metabinary::tag_uint32; }
+        int serialize(uint8_t *buf, int startidx) override
+        {
+            int offset = startidx;
+            offset += write_type(buf, offset, metabinary::tag_uint32);
+            offset += write_name(buf, offset);
+            offset += write_payload(buf, offset);
+            return offset-startidx;
+        }
+        int write_payload(uint8_t *buf, int startidx) override
+        {
+            return write_uint32(buf, startidx, payload);
+        }
+        int serialized_size() const override {
+            return sizeof(uint8_t) + name_size() + sizeof(payload);
+        }
+    };
+    class uint64_tag : public tag {
+    public:
+        uint64_tag() {}
+        uint64_tag(std::string_view name) { this->name = name; }
+        uint64_tag(std::string_view name, uint64_t data)
+        {
+            this->name = name;
+            payload = data;
+        }
+        uint64_t value() const { return payload; }
+        tag_type_t type() const override { return metabinary::tag_uint64; }
+        int serialize(uint8_t *buf, int startidx) override
+        {
+            int offset = startidx;
+            offset += write_type(buf, offset, metabinary::tag_uint64);
+            offset += write_name(buf, offset);
+            offset += write_payload(buf, offset);
+            return offset-startidx;
+        }
+        int write_payload(uint8_t *buf, int startidx) override {
+            return write_uint64(buf, startidx, payload);
+        }
+        int serialized_size() const override {
+            return sizeof(uint8_t) + name_size() + sizeof(payload);
+        }
+    private:
+        uint64_t payload;
+    };
+    class sint8_tag : public tag {
+        int8_t payload;
+    public:
+        sint8_tag() {}
+        sint8_tag(std::string_view name) { this->name = name; }
+        sint8_tag(std::string_view name, int8_t data)
+        {
+            this->name = name;
+            this->payload = data;
+        }
+        int8_t value() const { return payload; }
+        tag_type_t type() const override { return metabinary::tag_sint8; }
+        int serialize(uint8_t *buf, int startidx) {
+            int offset = startidx;
+            offset += write_type(buf, offset, metabinary::tag_sint8);
+            offset += write_name(buf, offset);
+            offset += write_payload(buf, offset);
+            return offset - startidx;
+        }
+        int write_payload(uint8_t *buf, int startidx) override {
+            return write_int8(buf, startidx, payload);
+        }
+        int serialized_size() const override {
+            return sizeof(uint8_t) + name_size() + sizeof(payload);
+        }
+    };
+    class sint16_tag : public tag {
+        int16_t payload;
+    public:
+        sint16_tag() { }
+        sint16_tag(std::string_view name) { this->name = name; }
+        sint16_tag(std::string_view name, int16_t data) {
+            this->name = name;
+            payload = data;
+        }
+        int16_t value() const { return payload; }
+        tag_type_t type() const override { return metabinary::tag_sint16; }
+        int serialize(uint8_t *buf, int startidx)
+        {
+            int offset = startidx;
+            offset += write_type(buf, offset, metabinary::tag_sint16);
+            offset += write_name(buf, offset);
+            offset += write_payload(buf, offset);
+            return offset-startidx;
+        }
+        int write_payload(uint8_t *buf, int startidx) override {
+            return write_int16(buf, startidx, payload);
+        }
+        int serialized_size() const override {
+            return sizeof(uint8_t) + name_size() + sizeof(payload);
+        }
+    };
+    class sint32_tag : public tag {
+        int32_t payload;
+    public:
+        sint32_tag() {}
+        sint32_tag(std::string_view name) { this->name = name; }
+        sint32_tag(std::string_view name, int32_t data)
+        {
+            this->name = name;
+            payload = data;
+        }
+        int32_t value() const { return payload; }
+        tag_type_t type() const override { return metabinary::tag_sint32; }
+        int serialize(uint8_t *buf, int startidx)
+        {
+            int offset = startidx;
+            offset += write_type(buf, offset, metabinary::tag_sint32);
+            offset += write_name(buf, offset);
+            offset += write_payload(buf, offset);
+            return offset - startidx;
+        }
+        int write_payload(uint8_t *buf, int startidx) override {
+            return write_int32(buf, startidx, payload);
+        }
+        int serialized_size() const override {
+            return sizeof(uint8_t) + name_size() + sizeof(payload);
+        }
+    };
+    class sint64_tag : public tag {
+        int64_t payload;
+    public:
+        sint64_tag() {}
+        sint64_tag(std::string_view name) { this->name = name; }
+        sint64_tag(std::string_view name, int64_t data)
+        {
+            this->name = name;
+            payload = data;
+        }
+        int64_t value() const { return payload; }
+        tag_type_t type() const override { return metabinary::tag_sint64; }
+        int serialize(uint8_t *buf, int startidx) {
+            int offset = startidx;
+            offset += write_type(buf, offset, metabinary::tag_sint64);
+            offset += write_name(buf, offset);
+            offset += write_payload(buf, offset);
+            return offset - startidx;
+        }
+        int write_payload(uint8_t *buf, int index) override {
+            return write_int64(buf, index, payload);
+        }
+        int serialized_size() const override {
+            return sizeof(uint8_t) + name_size() + sizeof(payload);
+        }
+    };
+    class float_tag : public tag {
+        float payload;
+    public:
+        float_tag() {}
+        float_tag(std::string_view name) { this->name = name; }
+        float_tag(std::string_view name, float data)
+        {
+            this->name = name;
+            payload = data;
+        }
+        float value() const { return payload; }
+        tag_type_t type() const override { return metabinary::tag_float; }
+        int serialize(uint8_t *buf, int startidx) override {
+            int offset = startidx;
+            offset+=write_type(buf, offset, metabinary::tag_float);
+            offset+=write_name(buf, offset);
+            offset+=write_payload(buf, offset);
+            return offset-startidx;
+        }
+        int write_payload(uint8_t *buf, int startidx) override {
+            return write_float(buf, startidx, payload);
+        }
+        int serialized_size() const override {
+            return sizeof(uint8_t) + name_size() + sizeof(payload);
+        }
+    };
+    class double_tag : public tag {
+        double payload;
+    public:
+        double_tag() {}
+        double_tag(std::string_view name) { this->name = name; }
+        double_tag(std::string_view name, double data)
+        {
+            this->name = name;
+            payload = data;
+        }
+        double value() const { return payload; }
+        tag_type_t type() const override { return metabinary::tag_double; }
+        int serialize(uint8_t *buf, int startidx) override {
+            int offset = startidx;
+            offset += write_type(buf, offset, metabinary::tag_double);
+            offset += write_name(buf, offset);
+            offset += write_payload(buf, offset);
+            return offset-startidx;
+        }
+        int write_payload(uint8_t *buf, int startidx) override {
+            return write_double(buf, startidx, payload);
+        }
+        int serialized_size() const override {
+            return sizeof(uint8_t) + name_size() + sizeof(payload);
+        }
+    };
+    class string_tag : public tag {
+        std::pmr::string payload{construction_resource()};
+    public:
+        string_tag() {}
+        string_tag(std::string_view name) { this->name = name;}
+        string_tag(std::string_view name, std::string_view value)
+        {
+            this->name = name;
+            this->payload = value;
+        }
+        // Takes over value's buffer instead of copying it, if it has the same allocator
+        template<typename S, typename = std::enable_if_t<std::is_same<S, std::pmr::string>::value>>
+        string_tag(std::string_view name, S&& value)
+        {
+            this->name = name;
+            this->payload = std::move(value);
+        }
+        std::string_view value() const { return payload; }
+        tag_type_t type() const override { return metabinary::tag_string; }
+        int serialize(uint8_t *buf, int startidx) override
+        {
+            int offset = startidx;
+            offset += write_type(buf, offset, metabinary::tag_string);
+            offset += write_name(buf, offset);
+            offset += write_payload(buf, offset);
+            return offset-startidx;
+        }
+        int write_payload(uint8_t *buf, int startidx) override {
+            return write_string(buf, startidx, payload);
+        }
+        int serialized_size() const override {
+            return checked_size(sizeof(uint8_t) + name_size() + sizeof(uint32_t) + payload.size());
+        }
+
+    };
+    // Raw bytes, written as a 32-bit length followed by the data
+    class byte_array_tag : public tag {
+        std::pmr::vector<uint8_t> payload{construction_resource()};
+    public:
+        byte_array_tag() {}
+        byte_array_tag(std::string_view name) { this->name = name; }
+        byte_array_tag(std::string_view name, const uint8_t* data, size_t len)
+        {
+            this->name = name;
+            payload.assign(data, data + len);
+        }
+        // Takes over data's buffer instead of copying it, if it has the same allocator
+        byte_array_tag(std::string_view name, std::pmr::vector<uint8_t>&& data)
+        {
+            this->name = name;
+            payload = std::move(data);
+        }
+        const uint8_t* data() const { return payload.data(); }
+        size_t size() const { return payload.size(); }
+        tag_type_t type() const override { return metabinary::tag_byte_array; }
+        int serialize(uint8_t *buf, int startidx) override
+        {
+            int offset = startidx;
+            offset += write_type(buf, offset, metabinary::tag_byte_array);
+            offset += write_name(buf, offset);
+            offset += write_payload(buf, offset);
+            return offset-startidx;
+        }
+        int write_payload(uint8_t *buf, int startidx) override {
+            int offset = startidx;
+            offset += write_uint32(buf, offset, payload.size());
+            memcpy(buf+offset, payload.data(), payload.size());
+            offset += payload.size();
+            return offset-startidx;
+        }
+        int serialized_size() const override {
+            return checked_size(sizeof(uint8_t) + name_size() + sizeof(uint32_t) + payload.size());
+        }
+    };
+    // Element type independent part of list_tag<T>
+    class packed_list_tag : public tag {
+    public:
+        virtual tag_type_t element_type() const = 0;
+        virtual size_t count() const = 0;
+        // Writes the elements alone, without element type or count
+        virtual int write_elements(uint8_t* buf, int startidx) = 0;
+    };
+    // Packed list of one scalar type, without a tag or name per element
+    // Written as the element type byte, a 32-bit count, then the elements back to back.
+    template<typename T>
+    class list_tag : public packed_list_tag {
+        std::pmr::vector<T> payload{construction_resource()};
+    public:
+        list_tag() {}
+        list_tag(std::string_view name) { this->name = name; }
+        list_tag(std::string_view name, const T* data, size_t count)
+        {
+            this->name = name;
+            payload.assign(data, data + count);
+        }
+        list_tag(std::string_view name, std::initializer_list<T> data)
+        {
+            this->name = name;
+            payload.assign(data.begin(), data.end());
+        }
+        // Takes over data's buffer instead of copying it, if it has the same allocator
+        list_tag(std::string_view name, std::pmr::vector<T>&& data)
+        {
+            this->name = name;
+            payload = std::move(data);
+        }
+        std::pmr::vector<T>& values() { return payload; }
+        const std::pmr::vector<T>& values() const { return payload; }
+        tag_type_t element_type() const override { return tag_type_of<T>::value; }
+        size_t count() const override { return payload.size(); }
+        int write_elements(uint8_t* buf, int startidx) override {
+            return write_array(buf, startidx, payload.data(), payload.size());
+        }
+        tag_type_t type() const override { return metabinary::tag_list; }
+        int serialize(uint8_t *buf, int startidx) override
+        {
+            int offset = startidx;
+            offset += write_type(buf, offset, metabinary::tag_list);
+            offset += write_name(buf, offset);
+            offset += write_payload(buf, offset);
+            return offset-startidx;
+        }
+        int write_payload(uint8_t *buf, int startidx) override {
+            int offset = startidx;
+            offset += write_type(buf, offset, tag_type_of<T>::value);
+            offset += write_uint32(buf, offset, payload.size());
+            offset += write_elements(buf, offset);
+            return offset-startidx;
+        }
+        int serialized_size() const override {
+            return checked_size(sizeof(uint8_t) + name_size() + sizeof(uint8_t) + sizeof(uint32_t) + payload.size() * sizeof(T));
+        }
+    };
+    // Records sharing one shape, stored as one packed list per field instead of a
+    // compound per record. Each column holds one field of every record, in row order,
+    // and is named by the field's '/' separated path within a record (e.g. "pos/x").
+    // Written as a 32-bit row count, each row's name (32-bit length + bytes), then the
+    // columns as list tags and an END tag.
+    class table_tag : public tag {
+        std::pmr::vector<std::pmr::string> rows{construction_resource()};
+        std::pmr::vector<packed_list_tag*> payload{construction_resource()};
+    public:
+        table_tag() {}
+        table_tag(std::string_view name) { this->name = name; }
+        table_tag(const table_tag&) = delete;
+        table_tag& operator=(const table_tag&) = delete;
+        ~table_tag() override
+        {
+            for (auto column : payload)
+                dispose(column);
+        }
+
+        // Names of the records; every column holds this many values
+        std::pmr::vector<std::pmr::string>& row_names() { return rows; }
+        const std::pmr::vector<std::pmr::string>& row_names() const { return rows; }
+        const std::pmr::vector<packed_list_tag*>& columns() const { return payload; }
+        void add_column(packed_list_tag* column) { payload.push_back(column); }
+        // Column of the field at path, nullptr if there is none or it holds another type
+        template<typename T>
+        list_tag<T>* column(std::string_view path) const
+        {
+            for (auto column : payload)
+                if (column->name == path && column->element_type() == tag_type_of<T>::value)
+                    return static_cast<list_tag<T>*>(column);
+            return nullptr;
+        }
+        tag_type_t type() const override { return metabinary::tag_table; }
+        int serialize(uint8_t* buf, int startidx) override
+        {
+            int offset = startidx;
+            offset += write_type(buf, offset, metabinary::tag_table);
+            offset += write_name(buf, offset);
+            offset += write_payload(buf, offset);
+            return offset-startidx;
+        }
+        int write_payload(uint8_t* buf, int startidx) override
+        {
+            int offset = startidx;
+            offset += write_uint32(buf, offset, rows.size());
+            for (auto& row : rows)
+                offset += write_string(buf, offset, row);
+            profile_write(tag_table, name_size(), offset - startidx + sizeof(uint8_t));
+            for (auto column : payload) {
+                int written = column->serialize(buf, offset);
+                profile_write(tag_list, column->name_size(), written - sizeof(uint8_t) - column->name_size());
+                offset += written;
+            }
+            buf[offset] = tag_end;
+            offset++;
+            return offset-startidx;
+        }
+        int serialized_size() const override
+        {
+            uint64_t size = sizeof(uint8_t) + name_size() + sizeof(uint32_t);
+            for (auto& row : rows)
+                size += sizeof(uint32_t) + row.size();
+            for (auto column : payload) {
+                int column_size = column->serialized_size();
+                if (column_size < 0)
+                    return -1;
+                size += column_size;
+            }
+            return checked_size(size + sizeof(uint8_t));
+        }
+    };
+    class compound_tag : public tag {
+    private:
+        std::pmr::vector<tag*> payload{construction_resource()};
+
+        // Name index over payload, built on the first lookup in a large compound.
+        // Open addressing with linear probing; child is the payload index + 1, 0 marks an empty slot.
+        // Children must not be renamed once they've been looked up.
+        struct index_slot {
+            uint32_t hash;
+            uint32_t child;
+        };
+        mutable std::pmr::vector<index_slot> index{construction_resource()};
+        // Below this many children a linear scan beats hashing
+        static const size_t index_threshold = 8;
+
+        void build_index() const
+        {
+            size_t capacity = 16;
+            while (capacity < payload.size() * 2)
+                capacity *= 2;
+            index.assign(capacity, index_slot{0, 0});
+            for (size_t i = 0; i < payload.size(); i++)
+                index_insert(i);
+        }
+        void index_insert(size_t i) const
+        {
+            uint32_t hash = hash_name(payload[i]->name);
+            size_t mask = index.size() - 1;
+            for (size_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+                index_slot& entry = index[slot];
+                if (entry.child == 0) {
+                    entry = {hash, (uint32_t)(i + 1)};
+                    return;
+                }
+                // Keep the first of several children sharing a name, as a scan would
+                if (entry.hash == hash && payload[entry.child - 1]->name == payload[i]->name)
+                    return;
+            }
+        }
+        // Probes for a child by name hash, returning the first one accepted by matches
+        template<typename Match>
+        tag* lookup(uint32_t hash, Match matches) const
+        {
+            if (payload.size() < index_threshold) {
+                for (auto& child : payload)
+                    if (matches(child))
+                        return child;
+                return nullptr;
+            }
+            if (index.empty())
+                build_index();
+            size_t mask = index.size() - 1;
+            for (size_t slot = hash & mask; index[slot].child != 0; slot = (slot + 1) & mask) {
+                tag* child = payload[index[slot].child - 1];
+                if (index[slot].hash == hash && matches(child))
+                    return child;
+            }
+            return nullptr;
+        }
+    public:
+        compound_tag() {}
+        compound_tag(std::string_view name) { this->name = name; }
+        compound_tag(std::string_view name, std::vector<tag*> tags)
+        {
+            this->name = name;
+            payload.assign(tags.begin(), tags.end());
+        }
+        compound_tag(std::string_view name, std::initializer_list<tag*> tags)
+        {
+            this->name = name;
+            payload.assign(tags.begin(), tags.end());
+        }
+        // Children are owned, so a compound can be moved but not copied
+        compound_tag(compound_tag&& other)
+            : tag(other.name), payload(std::move(other.payload)), index(std::move(other.index))
+        {
+            other.payload.clear();
+            other.index.clear();
+        }
+        compound_tag(const compound_tag&) = delete;
+        compound_tag& operator=(const compound_tag&) = delete;
+        // Deletes the children not made by an arena; an arena's own compounds are
+        // never destroyed, so children added to those live as long as the arena
+        ~compound_tag() override
+        {
+            for (tag* child : payload)
+                dispose(child);
+        }
+        // First child with the given name, or nullptr if there is none
+        tag* find(std::string_view name) const
+        {
+            return lookup(hash_name(name), [&](const tag* child) { return child->name == name; });
+        }
+        // Same, comparing name ids for children interned from the key's name_table,
+        // and names for any others
+        tag* find(const name_key& key) const
+        {
+            return lookup(key.hash, [&](const tag* child) {
+                if (child->name_id != 0 && child->name_generation == key.generation)
+                    return child->name_id == key.id;
+                return child->name == key.text;
+            });
+        }
+        tag* get(std::string_view name) const {
+            return find(name);
+        }
+        const std::pmr::vector<tag*>& children() const { return payload; }
+        // Puts child in the place of the first child sharing its name, or appends it.
+        // Returns the child it replaced, nullptr if none, for the caller to dispose() of.
+        tag* replace(tag* child)
+        {
+            for (auto& existing : payload)
+                if (existing->name == child->name) {
+                    // Same name and position, so the index stays as it is
+                    std::swap(existing, child);
+                    return child;
+                }
+            add(child);
+            return nullptr;
+        }
+        // Takes out the first child with the given name, returning it (or nullptr) to dispose() of
+        tag* remove(std::string_view name)
+        {
+            auto found = std::find_if(payload.begin(), payload.end(), [&](tag* child) { return child->name == name; });
+            if (found == payload.end())
+                return nullptr;
+            tag* child = *found;
+            payload.erase(found);
+            index.clear();
+            return child;
+        }
+        // Appends a child, keeping serialization in insertion order
+        void add(tag* child)
+        {
+            payload.push_back(child);
+            if (index.empty())
+                return;
+            // Stay at most half full, otherwise rebuild on the next lookup
+            if (payload.size() * 2 > index.size())
+                index.clear();
+            else
+                index_insert(payload.size() - 1);
+        }
+        tag_type_t type() const override { return metabinary::tag_compound; }
+        int serialize(uint8_t* buffer, int startidx) override
+        {
+            return serialize_with(buffer, startidx, nullptr);
+        }
+        int serialize_with(uint8_t* buffer, int startidx, const packed_blocks* blocks) override
+        {
+            profile_scope scope("serialize", name);
+            profile_write(tag_compound, name_size(), sizeof(uint8_t));
+            int offset = startidx;
+
+            offset += write_type(buffer, offset, metabinary::tag_compound);
+            offset += write_name(buffer, offset);
+            offset += write_children(buffer, offset, blocks);
+
+            // Return used space
+            return offset-startidx;
+        }
+        int serialized_size() const override
+        {
+            return serialized_size_with(nullptr);
+        }
+        int serialized_size_with(const packed_blocks* blocks) const override
+        {
+            int children = children_size(blocks);
+            return children < 0 ? -1 : checked_size(sizeof(uint8_t) + name_size() + children);
+        }
+        // Serialized children followed by the END tag, as written after the name
+        int write_children(uint8_t* buffer, int startidx, const packed_blocks* blocks = nullptr) const
+        {
+            int offset = startidx;
+
+            // Add Serialized Child Tags
+            for (auto& tag : payload) {
+                int written = tag->serialize_with(buffer, offset, blocks);
+                // Compounds and tables count themselves
+                if (instrumented && tag->type() != tag_compound && tag->type() != tag_table)
+                    profile_write(tag->type(), tag->name_size(), written - sizeof(uint8_t) - tag->name_size());
+                offset += written;
+            }
+
+            // Add END Tag
+            buffer[offset] = tag_end;
+            offset++;
+            return offset-startidx;
+        }
+        // -1 if the children, or any one of them, are past max_serialized_size
+        int children_size(const packed_blocks* blocks = nullptr) const
+        {
+            uint64_t size = 0;
+            for (auto& tag : payload) {
+                int child = tag->serialized_size_with(blocks);
+                if (child < 0)
+                    return -1;
+                size += child;
+            }
+            // END Tag
+            size += sizeof(uint8_t);
+            return checked_size(size);
+        }
+        void add_byte() {}
+        void add_short() {}
+        void add_int() {}
+        void add_long() {}
+        void add_float() {}
+        void add_double() {}
+        void add_string(std::string_view name, std::string_view value)
+        {
+            add(new string_tag(name, value));
+        }
+    };
+    // Compound whose children are written as a single compressed block, after the raw
+    // and compressed sizes, so readers can skip it whole or decompress it on demand.
+    class compressed_compound_tag : public compound_tag {
+    public:
+        using compound_tag::compound_tag;
+
+        tag_type_t type() const override { return metabinary::tag_compressed; }
+        int serialize(uint8_t* buf, int startidx) override
+        {
+            return serialize_with(buf, startidx, nullptr);
+        }
+        int serialize_with(uint8_t* buf, int startidx, const packed_blocks* blocks) override
+        {
+            int offset = startidx;
+            offset += write_type(buf, offset, metabinary::tag_compressed);
+            offset += write_name(buf, offset);
+            offset += write_payload_with(buf, offset, blocks);
+            return offset-startidx;
+        }
+        int write_payload(uint8_t* buf, int startidx) override
+        {
+            return write_payload_with(buf, startidx, nullptr);
+        }
+        // Without the block in blocks, compresses the children to find their size, and
+        // again to write them: tag::serialize_to packs each block once up front instead
+        int serialized_size() const override
+        {
+            return serialized_size_with(nullptr);
+        }
+        int serialized_size_with(const packed_blocks* blocks) const override
+        {
+            packed_block own;
+            const packed_block& block = packed(blocks, own);
+            if (block.raw_size < 0)
+                return -1;
+            return checked_size(sizeof(uint8_t) + name_size() + 2 * sizeof(uint32_t) + block.bytes.size());
+        }
+        // Packs every compressed compound in the tree at t into blocks, innermost first, as
+        // an outer block holds the inner ones packed
+        static void pack_all(const tag& t, packed_blocks& blocks)
+        {
+            if (t.type() != tag_compound && t.type() != tag_compressed)
+                return;
+            auto& compound = static_cast<const compound_tag&>(t);
+            for (tag* child : compound.children())
+                pack_all(*child, blocks);
+            if (t.type() == tag_compressed)
+                blocks[&t] = static_cast<const compressed_compound_tag&>(t).pack(&blocks);
+        }
+    private:
+        int write_payload_with(uint8_t* buf, int startidx, const packed_blocks* blocks) const
+        {
+            packed_block own;
+            const packed_block& block = packed(blocks, own);
+            int offset = startidx;
+            offset += write_uint32(buf, offset, block.raw_size);
+            offset += write_uint32(buf, offset, block.bytes.size());
+            memcpy(buf+offset, block.bytes.data(), block.bytes.size());
+            offset += block.bytes.size();
+            return offset-startidx;
+        }
+        // This block from blocks, or packed into own with the blocks nested in it
+        const packed_block& packed(const packed_blocks* blocks, packed_block& own) const
+        {
+            if (blocks != nullptr) {
+                auto found = blocks->find(this);
+                if (found != blocks->end())
+                    return found->second;
+            }
+            packed_blocks nested;
+            for (tag* child : children())
+                pack_all(*child, nested);
+            own = pack(&nested);
+            return own;
+        }
+        // A raw_size of -1 marks children too large to pack
+        packed_block pack(const packed_blocks* blocks) const
+        {
+            int raw_size = children_size(blocks);
+            if (raw_size < 0)
+                return packed_block{-1, {}};
+            std::vector<uint8_t> raw(raw_size);
+            write_children(raw.data(), 0, blocks);
+            return pack_block(raw.data(), raw.size());
+        }
+    };
+    inline int tag::serialize_to(sink& out)
+    {
+        packed_blocks blocks;
+        compressed_compound_tag::pack_all(*this, blocks);
+        int len = serialized_size_with(&blocks);
+        uint8_t* buf = out.acquire(len);
+        if (buf == nullptr)
+            return -1;
+        int written = serialize_with(buf, 0, &blocks);
+        assert(written == len);
+        return out.commit(written) ? written : -1;
+    }
+    class custom_data_tag : public tag { };
+    class root_tag : public compound_tag {
+    public:
+        root_tag() : compound_tag() {};
+        root_tag(std::string_view name) : compound_tag(name) {}
+        root_tag(std::string_view name, std::vector<tag*> tags) : compound_tag(name,  tags) {}
+        root_tag(std::string_view name, std::initializer_list<tag*> tags) : compound_tag(name, tags) {}
+    };
+    struct file { root_tag tag; };
+#pragma region Arena Allocation
+    // Bump allocator holding every tag, name, string and child array of one document.
+    // Tags made from an arena are never freed (or deleted) one by one; the whole
+    // document goes at once with release() or when the arena is destroyed.
+    class arena {
+    public:
+        arena(size_t block_size = 64 * 1024) : resource(block_size) {}
+        arena(const arena&) = delete;
+        arena& operator=(const arena&) = delete;
+
+        template<typename T, typename... Args>
+        T* make(Args&&... args)
+        {
+            profile_alloc(sizeof(T));
+            void* mem = resource.allocate(sizeof(T), alignof(T));
+            scope in_arena(&resource);
+            return mark(new (mem) T(std::forward<Args>(args)...));
+        }
+        // Braced child lists can't be forwarded, so compounds get their own overload
+        template<typename T>
+        T* make(std::string_view name, std::initializer_list<tag*> children)
+        {
+            profile_alloc(sizeof(T));
+            void* mem = resource.allocate(sizeof(T), alignof(T));
+            scope in_arena(&resource);
+            return mark(new (mem) T(name, children));
+        }
+        // Drops every tag made from this arena, keeping nothing
+        void release() { resource.release(); }
+        std::pmr::memory_resource* memory() { return &resource; }
+    private:
+        template<typename T>
+        static T* mark(T* made)
+        {
+            if constexpr (std::is_base_of<tag, T>::value)
+                made->in_arena = true;
+            return made;
+        }
+        // Points construction_resource() at the arena for one constructor
+        struct scope {
+            std::pmr::memory_resource* previous;
+            scope(std::pmr::memory_resource* next) : previous(construction_resource()) { construction_resource() = next; }
+            ~scope() { construction_resource() = previous; }
+        };
+        std::pmr::monotonic_buffer_resource resource;
+    };
+#pragma endregion
+#pragma region Views
+    // Byte width of a fixed size payload, or -1 for variable length tags
+    inline int payload_width(tag_type_t type)
+    {
+        switch (type) {
+            case tag_uint8: case tag_sint8:
+                return 1;
+            case tag_uint16: case tag_sint16:
+                return 2;
+            case tag_uint32: case tag_sint32: case tag_float:
+                return 4;
+            case tag_uint64: case tag_sint64: case tag_double:
+                return 8;
+            default:
+                return -1;
+        }
+    }
+    // Optional encodings a document can be written with, recorded in its header
+    enum document_flags : uint8_t {
+        // Names are written once in a table after the header, tags refer to them by varint index
+        doc_interned_names = 1 << 0,
+        // Multi-byte integer tags are LEB128 varints (zigzag for signed ones), and
+        // lengths and counts are varints too. 8-bit tags, floats and list elements stay fixed.
+        doc_compact_ints = 1 << 1,
+        // Large string and byte array payloads are kept out of line, in a section after
+        // the root tag with each one page aligned; the tag holds their offset and length.
+        // Every string and byte array payload starts with a blob_inline / blob_stored byte.
+        doc_blob_section = 1 << 2,
+        // Compounds and compressed compounds carry a CRC32C of their contents right
+        // after the name, checked on demand by tag_view::verify
+        doc_checksums = 1 << 3,
+        // Compounds carry the byte length of everything after it (children and END),
+        // as a 32-bit length following the name and checksum, so readers step over a
+        // whole subtree in one jump instead of walking it
+        doc_sized_compounds = 1 << 4,
+        // Compounds carry a table of where each child starts, after the name, checksum
+        // and length: a 32-bit child count, then a 32-bit offset per child counted
+        // from the first child. tag_view::child finds the Nth child with it directly.
+        doc_child_offsets = 1 << 5,
+    };
+    enum blob_placement : uint8_t {
+        // Length and bytes follow, as in any other document
+        blob_inline = 0,
+        // u64 offset from the start of the document and u64 length follow
+        blob_stored = 1,
+    };
+    static const size_t blob_alignment = 4096;
+    // Pointer and length of raw bytes owned by someone else
+    struct byte_span {
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+    };
+    // How the tags of a document are encoded, parsed from its header
+    // Views of a plain tag stream (no document header) have no context.
+    struct format_context {
+        uint8_t flags = 0;
+        // Name table of a doc_interned_names document
+        std::vector<std::string_view> names;
+        // The whole document, which doc_blob_section offsets are relative to
+        const uint8_t* start = nullptr;
+        size_t size = 0;
+    };
+    // Bytes between a compound's name and its contents
+    inline int checksum_size(const format_context* ctx)
+    {
+        return ctx != nullptr && (ctx->flags & doc_checksums) ? sizeof(uint32_t) : 0;
+    }
+    // Bytes of a doc_sized_compounds length, after the checksum
+    inline int subtree_length_size(const format_context* ctx)
+    {
+        return ctx != nullptr && (ctx->flags & doc_sized_compounds) ? sizeof(uint32_t) : 0;
+    }
+    // Finds the first child of a compound, past its checksum, length and offset table
+    // Returns nullptr if they run past end.
+    inline const uint8_t* compound_children(const uint8_t* payload, const uint8_t* end, const format_context* ctx)
+    {
+        long header = checksum_size(ctx) + subtree_length_size(ctx);
+        if (end - payload < header)
+            return nullptr;
+        const uint8_t* pos = payload + header;
+        if (ctx != nullptr && (ctx->flags & doc_child_offsets)) {
+            if (end - pos < (long) sizeof(uint32_t))
+                return nullptr;
+            uint32_t count = read_uint32(pos, 0);
+            pos += sizeof(uint32_t);
+            if ((uint64_t)(end - pos) / sizeof(uint32_t) < count)
+                return nullptr;
+            pos += (size_t) count * sizeof(uint32_t);
+        }
+        return pos;
+    }
+    inline bool compact_ints(const format_context* ctx)
+    {
+        return ctx != nullptr && (ctx->flags & doc_compact_ints);
+    }
+    // Whether a tag's payload is a varint in this document
+    inline bool varint_payload(tag_type_t type, const format_context* ctx)
+    {
+        return compact_ints(ctx) && type != tag_float && type != tag_double && payload_width(type) > 1;
+    }
+    // Reads a length or count: 32-bit, or a varint in doc_compact_ints documents
+    // Returns the number of bytes used, 0 if it is truncated
+    inline int read_length(const uint8_t* pos, const uint8_t* end, const format_context* ctx, uint64_t& len)
+    {
+        if (compact_ints(ctx))
+            return read_varint(pos, end, len);
+        if (end - pos < (long) sizeof(uint32_t))
+            return 0;
+        len = read_uint32(pos, 0);
+        return sizeof(uint32_t);
+    }
+    // Finds the bytes of a string or byte array payload, inline or in the blob section
+    // Returns the first byte past the payload, or nullptr if it is malformed or runs past end
+    inline const uint8_t* read_sized(const uint8_t* pos, const uint8_t* end, const format_context* ctx, byte_span& data)
+    {
+        if (ctx != nullptr && (ctx->flags & doc_blob_section)) {
+            if (pos >= end || *pos > blob_stored)
+                return nullptr;
+            if (*pos++ == blob_stored) {
+                if (end - pos < (long)(2 * sizeof(uint64_t)))
+                    return nullptr;
+                uint64_t offset = read_uint64(pos, 0);
+                uint64_t len = read_uint64(pos, sizeof(uint64_t));
+                if (offset > ctx->size || len > ctx->size - offset)
+                    return nullptr;
+                data = {ctx->start + offset, (size_t) len};
+                return pos + 2 * sizeof(uint64_t);
+            }
+        }
+        uint64_t len;
+        int used = read_length(pos, end, ctx, len);
+        if (used == 0 || (uint64_t)(end - pos - used) < len)
+            return nullptr;
+        data = {pos + used, (size_t) len};
+        return pos + used + len;
+    }
+    // Walks over the payload of anything but a compound
+    // Returns the first byte past it, or nullptr if it is malformed or runs past end
+    inline const uint8_t* skip_payload(tag_type_t type, const uint8_t* pos, const uint8_t* end, const format_context* ctx)
+    {
+        uint64_t len;
+        if (varint_payload(type, ctx)) {
+            int used = read_varint(pos, end, len);
+            return used != 0 ? pos + used : nullptr;
+        }
+        int width = payload_width(type);
+        if (width > 0)
+            return end - pos >= width ? pos + width : nullptr;
+        if (type == tag_string || type == tag_byte_array) {
+            byte_span data;
+            return read_sized(pos, end, ctx, data);
+        }
+        if (type == tag_compressed) {
+            if (end - pos < checksum_size(ctx))
+                return nullptr;
+            pos += checksum_size(ctx);
+            uint64_t raw_len;
+            int used = read_length(pos, end, ctx, raw_len);
+            if (used == 0)
+                return nullptr;
+            pos += used;
+            used = read_length(pos, end, ctx, len);
+            if (used == 0 || (uint64_t)(end - pos - used) < len)
+                return nullptr;
+            return pos + used + len;
+        }
+        if (type == tag_list) {
+            if (pos >= end)
+                return nullptr;
+            int element_width = payload_width((tag_type_t) pos[0]);
+            int used = read_length(pos + 1, end, ctx, len);
+            if (element_width < 0 || used == 0)
+                return nullptr;
+            pos += 1 + used;
+            if ((uint64_t)(end - pos) / element_width < len)
+                return nullptr;
+            return pos + len * element_width;
+        }
+        return nullptr;
+    }
+    // Reads the name field of a tag, inline or by table index
+    // Returns the first byte past it, or nullptr if it is malformed or runs past end
+    inline const uint8_t* read_name(const uint8_t* pos, const uint8_t* end, const format_context* ctx, std::string_view& name)
+    {
+        if (ctx != nullptr && (ctx->flags & doc_interned_names)) {
+            uint64_t id;
+            int used = read_varint(pos, end, id);
+            if (used == 0 || id >= ctx->names.size())
+                return nullptr;
+            name = ctx->names[id];
+            return pos + used;
+        }
+        uint64_t name_len;
+        int used = read_length(pos, end, ctx, name_len);
+        if (used == 0 || (uint64_t)(end - pos - used) < name_len)
+            return nullptr;
+        pos += used;
+        name = {reinterpret_cast<const char*>(pos), (size_t) name_len};
+        return pos + name_len;
+    }
+    // Walks over the row count and row names of a table, to its first column
+    // Returns the first byte past them, or nullptr if they are malformed or run past end
+    inline const uint8_t* skip_rows(const uint8_t* pos, const uint8_t* end, const format_context* ctx)
+    {
+        uint64_t rows;
+        int used = read_length(pos, end, ctx, rows);
+        if (used == 0 || rows > (uint64_t)(end - pos))
+            return nullptr;
+        pos += used;
+        for (uint64_t i = 0; i < rows; i++) {
+            uint64_t len;
+            used = read_length(pos, end, ctx, len);
+            if (used == 0 || (uint64_t)(end - pos - used) < len)
+                return nullptr;
+            pos += used + len;
+        }
+        return pos;
+    }
+    // Walks over one serialized tag (and all of its children) without decoding it
+    // Returns the first byte past the tag, or nullptr if it is malformed or runs past end
+    inline const uint8_t* skip_tag(const uint8_t* pos, const uint8_t* end, const format_context* ctx = nullptr)
+    {
+        int depth = 0;
+        do {
+            if (pos >= end)
+                return nullptr;
+            auto type = (tag_type_t) *pos++;
+            if (type == tag_end) {
+                // A bare END is not a tag, only the close of a compound
+                if (depth == 0)
+                    return nullptr;
+                depth--;
+                continue;
+            }
+            std::string_view name;
+            pos = read_name(pos, end, ctx, name);
+            if (pos == nullptr)
+                return nullptr;
+            // Payload
+            if (type == tag_compound && subtree_length_size(ctx) != 0) {
+                // The whole subtree in one jump, trusting the length to end on an END
+                if (end - pos < checksum_size(ctx) + subtree_length_size(ctx))
+                    return nullptr;
+                pos += checksum_size(ctx);
+                uint32_t len = read_uint32(pos, 0);
+                pos += sizeof(uint32_t);
+                if (len == 0 || (uint64_t)(end - pos) < len || pos[len - 1] != tag_end)
+                    return nullptr;
+                pos += len;
+            } else if (type == tag_compound) {
+                if ((pos = compound_children(pos, end, ctx)) == nullptr)
+                    return nullptr;
+                depth++;
+            } else if (type == tag_table) {
+                // Columns are list tags, closed by an END like a compound's children
+                if ((pos = skip_rows(pos, end, ctx)) == nullptr)
+                    return nullptr;
+                depth++;
+            } else if ((pos = skip_payload(type, pos, end, ctx)) == nullptr)
+                return nullptr;
+        } while (depth > 0);
+        return pos;
+    }
+    // Non-owning view of one serialized tag, pointing into someone else's bytes
+    // (usually a mapped_file). Nothing is decoded or copied until it is asked for,
+    // and a view of malformed or truncated data is simply !valid().
+    class tag_view {
+    public:
+        class iterator {
+        public:
+            iterator() {}
+            iterator(const uint8_t* pos, const uint8_t* limit, const format_context* ctx)
+                : pos(pos), limit(limit), ctx(ctx) { settle(); }
+            tag_view operator*() const { return tag_view(pos, next, ctx); }
+            iterator& operator++() {
+                pos = next;
+                settle();
+                return *this;
+            }
+            bool operator==(const iterator& other) const { return pos == other.pos; }
+            bool operator!=(const iterator& other) const { return pos != other.pos; }
+        private:
+            // Stops at the compound's END tag, or at anything malformed
+            void settle() {
+                if (pos == nullptr || pos >= limit || *pos == tag_end) {
+                    pos = nullptr;
+                    return;
+                }
+                next = skip_tag(pos, limit, ctx);
+                if (next == nullptr)
+                    pos = nullptr;
+            }
+            const uint8_t* pos = nullptr;
+            const uint8_t* next = nullptr;
+            const uint8_t* limit = nullptr;
+            const format_context* ctx = nullptr;
+        };
+
+        tag_view() {}
+        // ctx describes the document the bytes belong to, and must outlive the view
+        tag_view(const uint8_t* buf, const uint8_t* limit, const format_context* ctx = nullptr)
+            : buf(buf), limit(limit), ctx(ctx)
+        {
+            // Validate the type byte and name up front, so accessors can trust them
+            if (buf == nullptr || buf >= limit || *buf == tag_end) {
+                this->buf = nullptr;
+                return;
+            }
+            payload = read_name(buf + 1, limit, ctx, name_);
+            if (payload == nullptr)
+                this->buf = nullptr;
+        }
+
+        bool valid() const { return buf != nullptr; }
+        // Flags of the document the view is in, 0 for a plain tag stream
+        uint8_t format() const { return ctx != nullptr ? ctx->flags : 0; }
+        tag_type_t type() const { return valid() ? (tag_type_t) buf[0] : tag_end; }
+        std::string_view name() const { return name_; }
+        // Encoded size of the whole tag; walks the subtree for compounds
+        size_t size() const
+        {
+            const uint8_t* next = valid() ? skip_tag(buf, limit, ctx) : nullptr;
+            return next == nullptr ? 0 : next - buf;
+        }
+
+        // Typed payload accessors, returning zero if the tag is of another type
+        uint8_t  as_uint8()  const { return integer<uint8_t>(tag_uint8, read_uint8); }
+        uint16_t as_uint16() const { return integer<uint16_t>(tag_uint16, read_uint16); }
+        uint32_t as_uint32() const { return integer<uint32_t>(tag_uint32, read_uint32); }
+        uint64_t as_uint64() const { return integer<uint64_t>(tag_uint64, read_uint64); }
+        int8_t   as_sint8()  const { return integer<int8_t>(tag_sint8, read_int8); }
+        int16_t  as_sint16() const { return integer<int16_t>(tag_sint16, read_int16); }
+        int32_t  as_sint32() const { return integer<int32_t>(tag_sint32, read_int32); }
+        int64_t  as_sint64() const { return integer<int64_t>(tag_sint64, read_int64); }
+        float    as_float()  const { return fits(tag_float)  ? read_float(payload, 0)  : 0; }
+        double   as_double() const { return fits(tag_double) ? read_double(payload, 0) : 0; }
+        std::string_view as_string() const
+        {
+            byte_span bytes = sized_payload(tag_string);
+            return {reinterpret_cast<const char*>(bytes.data), bytes.size};
+        }
+        byte_span as_bytes() const
+        {
+            return sized_payload(tag_byte_array);
+        }
+        // Compressed block of a tag_compressed, and the size it decompresses to
+        byte_span compressed_bytes() const
+        {
+            uint64_t raw_len;
+            const uint8_t* sizes = payload + checksum_size(ctx);
+            int used = type() == tag_compressed && sizes <= limit ? read_length(sizes, limit, ctx, raw_len) : 0;
+            if (used == 0)
+                return {};
+            uint64_t len;
+            int len_used = read_length(sizes + used, limit, ctx, len);
+            const uint8_t* data = sizes + used + len_used;
+            if (len_used == 0 || (uint64_t)(limit - data) < len)
+                return {};
+            return {data, (size_t) len};
+        }
+        size_t uncompressed_size() const
+        {
+            uint64_t raw_len = 0;
+            if (compressed_bytes().data != nullptr)
+                read_length(payload + checksum_size(ctx), limit, ctx, raw_len);
+            return raw_len;
+        }
+        // Checks the CRC32C a doc_checksums document keeps for a compound or compressed
+        // compound, over everything inside it, nested compounds included. Only the bytes
+        // of this subtree are read. False on a mismatch, or if there is no checksum.
+        bool verify() const
+        {
+            uint32_t current;
+            const uint8_t* stored = checksum_at(current);
+            return stored != nullptr && read_uint32(stored, 0) == current;
+        }
+        // Where that CRC32C is stored, with the value it should have for the bytes as they
+        // are now in current; nullptr if there is no checksum or the subtree is malformed.
+        // For code that changes a document in place.
+        const uint8_t* checksum_at(uint32_t& current) const
+        {
+            if (!is_compound(type()) || checksum_size(ctx) == 0)
+                return nullptr;
+            const uint8_t* next = skip_tag(buf, limit, ctx);
+            const uint8_t* contents = payload + checksum_size(ctx);
+            if (next == nullptr)
+                return nullptr;
+            current = crc32c(contents, next - contents);
+            return payload;
+        }
+        // View of a tag_compressed as the plain compound it holds, decompressed into storage
+        // Anything else is returned as is. storage must outlive the returned view.
+        tag_view expand(std::vector<uint8_t>& storage) const
+        {
+            if (type() != tag_compressed)
+                return *this;
+            byte_span block = compressed_bytes();
+            if (block.data == nullptr)
+                return tag_view();
+            // Same type byte and name, followed by the decompressed children (and the
+            // checksum, length and offset table the document gives plain compounds)
+            size_t name_end = payload - buf;
+            size_t length_at = name_end + checksum_size(ctx);
+            size_t header = length_at + subtree_length_size(ctx);
+            storage.resize(header + uncompressed_size());
+            memcpy(storage.data(), buf, name_end);
+            storage[0] = tag_compound;
+            if (!lz_decompress(block.data, block.size, storage.data() + header, storage.size() - header))
+                return tag_view();
+            if (ctx != nullptr && (ctx->flags & doc_child_offsets)) {
+                // Found by walking the children, then put in front of them
+                std::vector<uint32_t> offsets;
+                const uint8_t* children = storage.data() + header;
+                const uint8_t* end = storage.data() + storage.size();
+                for (const uint8_t* pos = children; pos < end && *pos != tag_end; pos = skip_tag(pos, end, ctx)) {
+                    if (pos == nullptr)
+                        return tag_view();
+                    offsets.push_back(pos - children);
+                }
+                storage.insert(storage.begin() + header, sizeof(uint32_t) * (offsets.size() + 1), 0);
+                write_uint32(storage.data(), header, offsets.size());
+                for (size_t i = 0; i < offsets.size(); i++)
+                    write_uint32(storage.data(), header + sizeof(uint32_t) * (i + 1), offsets[i]);
+            }
+            if (subtree_length_size(ctx) != 0)
+                write_uint32(storage.data(), length_at, storage.size() - header);
+            if (checksum_size(ctx) != 0)
+                write_uint32(storage.data(), name_end, crc32c(storage.data() + length_at, storage.size() - length_at));
+            return tag_view(storage.data(), storage.data() + storage.size(), ctx);
+        }
+        // Element type of a packed list, tag_end for anything else
+        tag_type_t list_type() const
+        {
+            return list_bytes().data != nullptr ? (tag_type_t) payload[0] : tag_end;
+        }
+        size_t list_size() const
+        {
+            tag_type_t element_type = list_type();
+            return element_type != tag_end ? list_bytes().size / payload_width(element_type) : 0;
+        }
+        // Elements of a packed list as they are encoded, without decoding or copying them
+        byte_span list_bytes() const
+        {
+            if (type() != tag_list || payload >= limit)
+                return {};
+            const uint8_t* end = skip_payload(tag_list, payload, limit, ctx);
+            if (end == nullptr)
+                return {};
+            uint64_t count;
+            const uint8_t* data = payload + 1 + read_length(payload + 1, limit, ctx, count);
+            return {data, (size_t)(end - data)};
+        }
+        // Decodes up to max elements of a packed list of T into out
+        // Returns the number of elements copied, 0 if this isn't a list of T.
+        template<typename T>
+        size_t copy_list(T* out, size_t max) const
+        {
+            if (list_type() != tag_type_of<T>::value)
+                return 0;
+            size_t count = std::min(list_size(), max);
+            read_array(list_bytes().data, 0, out, count);
+            return count;
+        }
+
+        // Children of a compound, or columns of a table, in serialized order
+        iterator begin() const
+        {
+            if (type() == tag_table)
+                return iterator(skip_rows(payload, limit, ctx), limit, ctx);
+            if (type() != tag_compound)
+                return iterator();
+            return iterator(compound_children(payload, limit, ctx), limit, ctx);
+        }
+        // Number of children of a compound; read from its offset table if it has one
+        size_t child_count() const
+        {
+            if (type() == tag_compound && ctx != nullptr && (ctx->flags & doc_child_offsets))
+                return compound_children(payload, limit, ctx) != nullptr ? read_uint32(offset_table(), 0) : 0;
+            size_t count = 0;
+            for (auto it = begin(); it != end(); ++it)
+                count++;
+            return count;
+        }
+        // Child at index in serialized order, or an invalid view if there are fewer
+        // Straight from the offset table if there is one, otherwise by stepping over
+        // the children before it.
+        tag_view child(size_t index) const
+        {
+            if (type() == tag_compound && ctx != nullptr && (ctx->flags & doc_child_offsets)) {
+                const uint8_t* children = compound_children(payload, limit, ctx);
+                if (children == nullptr || index >= read_uint32(offset_table(), 0))
+                    return tag_view();
+                uint32_t offset = read_uint32(offset_table(), sizeof(uint32_t) * (index + 1));
+                if (offset >= (uint64_t)(limit - children))
+                    return tag_view();
+                return tag_view(children + offset, limit, ctx);
+            }
+            for (auto child : *this)
+                if (index-- == 0)
+                    return child;
+            return tag_view();
+        }
+        iterator end() const { return iterator(); }
+        // First child with the given name, or an invalid view on a miss
+        tag_view find(std::string_view name) const
+        {
+            for (auto child : *this)
+                if (child.name() == name)
+                    return child;
+            return tag_view();
+        }
+        // Descendant at a '/' separated path of names below this tag, e.g. "ENTITIES/1/pos/x"
+        tag_view find_path(std::string_view path) const
+        {
+            tag_view at = *this;
+            while (at.valid() && !path.empty()) {
+                size_t slash = path.find('/');
+                at = at.find(path.substr(0, slash));
+                path = slash == std::string_view::npos ? std::string_view() : path.substr(slash + 1);
+            }
+            return at;
+        }
+        // Number of records in a table, 0 for anything else
+        size_t table_rows() const
+        {
+            uint64_t rows = 0;
+            if (type() != tag_table || read_length(payload, limit, ctx, rows) == 0)
+                return 0;
+            return rows;
+        }
+        // Names of the records in a table, in row order
+        std::vector<std::string_view> row_names() const
+        {
+            std::vector<std::string_view> names;
+            if (type() != tag_table || skip_rows(payload, limit, ctx) == nullptr)
+                return names;
+            uint64_t rows = 0, len = 0;
+            const uint8_t* pos = payload + read_length(payload, limit, ctx, rows);
+            names.reserve(rows);
+            for (uint64_t i = 0; i < rows; i++) {
+                pos += read_length(pos, limit, ctx, len);
+                names.emplace_back(reinterpret_cast<const char*>(pos), len);
+                pos += len;
+            }
+            return names;
+        }
+        // Where an out of line string or byte array sits, as an offset from the start of
+        // its document, to hand to mmap, sendfile or splice. False for inline payloads.
+        bool blob_range(uint64_t& offset, uint64_t& len) const
+        {
+            if (type() != tag_string && type() != tag_byte_array)
+                return false;
+            byte_span data = sized_payload(type());
+            if (data.data == nullptr || ctx == nullptr || !(ctx->flags & doc_blob_section) || payload[0] != blob_stored)
+                return false;
+            offset = data.data - ctx->start;
+            len = data.size;
+            return true;
+        }
+        // Payload of a fixed width scalar as stored, empty for anything else
+        // (including integers that a compact document stores as varints)
+        byte_span fixed_payload() const
+        {
+            int width = valid() ? payload_width(type()) : -1;
+            if (width <= 0 || varint_payload(type(), ctx) || limit - payload < width)
+                return {};
+            return {payload, (size_t) width};
+        }
+        // Encoded payload, running to the end of the viewed bytes
+        byte_span raw_payload() const
+        {
+            if (!valid())
+                return {};
+            return {payload, (size_t)(limit - payload)};
+        }
+    private:
+        const uint8_t* offset_table() const
+        {
+            return payload + checksum_size(ctx) + subtree_length_size(ctx);
+        }
+        bool fits(tag_type_t expected) const
+        {
+            return type() == expected && limit - payload >= payload_width(expected);
+        }
+        // Decodes a fixed width integer, or its varint / zigzag form in a compact document
+        template<typename T>
+        T integer(tag_type_t expected, T (*read)(const uint8_t*, int)) const
+        {
+            if (type() != expected)
+                return 0;
+            if (varint_payload(expected, ctx)) {
+                uint64_t val;
+                if (read_varint(payload, limit, val) == 0)
+                    return 0;
+                if (std::is_signed<T>::value)
+                    return (T) zigzag_decode(val);
+                return (T) val;
+            }
+            return fits(expected) ? read(payload, 0) : 0;
+        }
+        // Bytes of a string or byte array, wherever they are kept
+        byte_span sized_payload(tag_type_t expected) const
+        {
+            byte_span data;
+            if (type() != expected || read_sized(payload, limit, ctx, data) == nullptr)
+                return {};
+            return data;
+        }
+        const uint8_t* buf = nullptr;
+        const uint8_t* limit = nullptr;
+        const uint8_t* payload = nullptr;
+        const format_context* ctx = nullptr;
+        std::string_view name_;
+    };
+    // Memory mapping of a serialized file, read-only unless asked otherwise
+    // Pages are only faulted in for the tags that are actually visited.
+    class mapped_file {
+    public:
+        // A writable mapping is shared, so writes through it reach the file
+        mapped_file(const char* path, bool writable = false)
+        {
+            int fd = open(path, writable ? O_RDWR : O_RDONLY);
+            if (fd < 0)
+                return;
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                void* addr = writable ? mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                                      : mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr != MAP_FAILED) {
+                    data_ = static_cast<const uint8_t*>(addr);
+                    size_ = st.st_size;
+                    writable_ = writable;
+                }
+            }
+            close(fd);
+        }
+        ~mapped_file()
+        {
+            if (data_ != nullptr)
+                munmap(const_cast<uint8_t*>(data_), size_);
+        }
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        bool is_open() const { return data_ != nullptr; }
+        const uint8_t* data() const { return data_; }
+        // nullptr unless the file was opened writable
+        uint8_t* writable_data() { return writable_ ? const_cast<uint8_t*>(data_) : nullptr; }
+        size_t size() const { return size_; }
+        tag_view root() const { return tag_view(data_, data_ + size_); }
+        // Writes the pages holding [offset, offset + len) back to the file, waiting for the disk
+        bool sync(size_t offset = 0, size_t len = SIZE_MAX)
+        {
+            if (!writable_ || offset >= size_)
+                return false;
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t first = offset / page * page;
+            size_t last = std::min(size_, offset + std::min(len, size_ - offset));
+            return msync(const_cast<uint8_t*>(data_) + first, last - first, MS_SYNC) == 0;
+        }
+    private:
+        const uint8_t* data_ = nullptr;
+        size_t size_ = 0;
+        bool writable_ = false;
+    };
+#pragma endregion
+#pragma region Parallel Serialization
+    // Threads kept to run batches of jobs, up to workers at once (0 for one per core)
+    // counting the caller, which works alongside them. They are started on the first batch
+    // that needs them and stopped with the pool.
+    // Each thread owns an equal share of a batch's indices and works through it in small
+    // runs from the front. A thread whose share runs out steals the back half of what is
+    // left of another's, so one that draws slow jobs is made up for by the others.
+    class worker_pool {
+    public:
+        explicit worker_pool(size_t workers = 0)
+            : workers(workers != 0 ? workers : std::max(1u, std::thread::hardware_concurrency())), shares(this->workers) {}
+        ~worker_pool()
+        {
+            {
+                std::lock_guard<std::mutex> hold(lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& t : threads)
+                t.join();
+        }
+        worker_pool(const worker_pool&) = delete;
+        worker_pool& operator=(const worker_pool&) = delete;
+
+        size_t size() const { return workers; }
+        // Runs job(i) for every i below count, returning once all have run.
+        // One batch runs at a time; a job mustn't start another on the same pool.
+        template<typename Job>
+        void run(size_t count, Job job)
+        {
+            size_t active = std::min(workers, count);
+            if (active <= 1) {
+                for (size_t i = 0; i < count; i++)
+                    job(i);
+                return;
+            }
+            while (threads.size() + 1 < workers)
+                threads.emplace_back([this, w = threads.size() + 1] { serve(w); });
+            for (size_t w = 0; w < active; w++) {
+                shares[w].begin = count * w / active;
+                shares[w].end = count * (w + 1) / active;
+            }
+            run_length = std::max<size_t>(1, count / (active * 64));
+            {
+                std::lock_guard<std::mutex> hold(lock);
+                task = &job;
+                call = [](void* task, size_t i) { (*static_cast<Job*>(task))(i); };
+                participants = active;
+                busy = active - 1;
+                batch++;
+            }
+            wake.notify_all();
+            work(0);
+            std::unique_lock<std::mutex> hold(lock);
+            done.wait(hold, [&] { return busy == 0; });
+        }
+    private:
+        // Indices [begin, end) not yet claimed; the owner takes from begin, thieves from end
+        struct alignas(64) share {
+            std::mutex lock;
+            size_t begin = 0, end = 0;
+        };
+
+        // Body of pool thread w: waits for a batch it has a share in, works it, repeats
+        void serve(size_t w)
+        {
+            uint64_t seen = 0;
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> hold(lock);
+                    wake.wait(hold, [&] { return stopping || batch != seen; });
+                    if (stopping)
+                        return;
+                    seen = batch;
+                    if (w >= participants)
+                        continue;
+                }
+                work(w);
+                std::lock_guard<std::mutex> hold(lock);
+                if (--busy == 0)
+                    done.notify_one();
+            }
+        }
+        void work(size_t w)
+        {
+            share& own = shares[w];
+            for (;;) {
+                size_t first, last;
+                {
+                    std::lock_guard<std::mutex> hold(own.lock);
+                    first = own.begin;
+                    last = std::min(own.end, first + run_length);
+                    own.begin = last;
+                }
+                if (first == last) {
+                    if (!steal(w))
+                        return;
+                    continue;
+                }
+                for (size_t i = first; i < last; i++)
+                    call(task, i);
+            }
+        }
+        bool steal(size_t thief)
+        {
+            for (size_t v = 1; v < participants; v++) {
+                share& victim = shares[(thief + v) % participants];
+                size_t first, last;
+                {
+                    std::lock_guard<std::mutex> hold(victim.lock);
+                    size_t left = victim.end - victim.begin;
+                    if (left == 0)
+                        continue;
+                    first = victim.end - (left + 1) / 2;
+                    last = victim.end;
+                    victim.end = first;
+                }
+                std::lock_guard<std::mutex> hold(shares[thief].lock);
+                shares[thief].begin = first;
+                shares[thief].end = last;
+                return true;
+            }
+            return false;
+        }
+
+        size_t workers;
+        std::vector<share> shares;
+        std::vector<std::thread> threads;
+        std::mutex lock;
+        std::condition_variable wake, done;
+        bool stopping = false;
+        // The current batch, numbered so threads can tell a new one from the last
+        uint64_t batch = 0;
+        size_t participants = 0;
+        size_t busy = 0;
+        size_t run_length = 1;
+        void* task = nullptr;
+        void (*call)(void*, size_t) = nullptr;
+    };
+    // Runs job(i) for every i below count on a pool of its own, for one-off batches;
+    // repeated ones are cheaper on a worker_pool kept between them
+    template<typename Job>
+    inline void parallel_for(size_t count, Job job, size_t workers = 0)
+    {
+        worker_pool pool(workers);
+        pool.run(count, job);
+    }
+    inline void collect_blocks(const tag& t, size_t depth, std::vector<std::vector<const tag*>>& levels)
+    {
+        if (!is_compound(t.type()))
+            return;
+        if (t.type() == tag_compressed) {
+            if (levels.size() <= depth)
+                levels.resize(depth + 1);
+            levels[depth].push_back(&t);
+            depth++;
+        }
+        for (tag* child : static_cast<const compound_tag&>(t).children())
+            collect_blocks(*child, depth, levels);
+    }
+    // Packs every compressed compound in the tree into blocks, in parallel on pool.
+    // Blocks nested in other blocks are done first, a level at a time, as the outer
+    // block's children include the inner compressed bytes. raw(compound, blocks) returns
+    // a compound's children as its block holds them, in the caller's encoding, or nothing
+    // if they are past max_serialized_size; their block then has a raw_size of -1.
+    template<typename Raw>
+    inline void pack_blocks(const tag& root, packed_blocks& blocks, Raw raw, worker_pool& pool)
+    {
+        std::vector<std::vector<const tag*>> levels;
+        collect_blocks(root, 0, levels);
+        for (auto level = levels.rbegin(); level != levels.rend(); ++level) {
+            // Every entry is made up front, so the workers only fill them in
+            for (const tag* t : *level)
+                blocks[t];
+            pool.run(level->size(), [&](size_t i) {
+                auto& compound = static_cast<const compound_tag&>(*(*level)[i]);
+                std::vector<uint8_t> bytes = raw(compound, blocks);
+                blocks.find(&compound)->second = bytes.empty() ? packed_block{-1, {}} : pack_block(bytes.data(), bytes.size());
+            });
+        }
+    }
+    // Children of a compound as tag::serialize writes them
+    inline std::vector<uint8_t> raw_children(const compound_tag& compound, const packed_blocks& blocks)
+    {
+        int size = compound.children_size(&blocks);
+        if (size < 0)
+            return {};
+        std::vector<uint8_t> raw(size);
+        compound.write_children(raw.data(), 0, &blocks);
+        return raw;
+    }
+    // Serializes big trees on several threads, byte for byte as tag::serialize would.
+    // Compounds bigger than a share of the whole are split: their children are measured
+    // in parallel, placed by a prefix sum of the sizes, and their header and END tag are
+    // written up front. Every unsplit subtree is then written straight into its place
+    // by whichever thread is free. Trees under min_parallel bytes are written in place.
+    class parallel_serializer {
+    public:
+        // The workers are started on the first tree big enough to need them, and kept
+        parallel_serializer(size_t workers = 0, int min_parallel = 1 << 20)
+            : pool(workers), min_parallel(min_parallel) {}
+
+        // Number of bytes serialize() writes for this tree, -1 if it is past max_serialized_size
+        int serialized_size(tag& root)
+        {
+            int len = measure(root);
+            blocks.clear();
+            return len;
+        }
+        // Returns -1, writing nothing, if the tree is past max_serialized_size
+        int serialize(uint8_t* buf, int startidx, tag& root)
+        {
+            int len = measure(root);
+            if (len < 0) {
+                blocks.clear();
+                return -1;
+            }
+            write(buf, startidx, root);
+            return len;
+        }
+        // Like tag::serialize_to, returns the bytes written or -1 if the sink rejected them
+        int serialize_to(sink& out, tag& root)
+        {
+            int len = measure(root);
+            uint8_t* buf = out.acquire(len);
+            if (buf == nullptr) {
+                blocks.clear();
+                return -1;
+            }
+            write(buf, 0, root);
+            return out.commit(len) ? len : -1;
+        }
+    private:
+        // A subtree written by one thread, at its final offset
+        struct job {
+            tag* t;
+            int offset;
+        };
+
+        // Packs the compressed blocks, then sizes the tree, working out which compounds to split
+        int measure(tag& root)
+        {
+            splits.clear();
+            blocks.clear();
+            pack_blocks(root, blocks, raw_children, pool);
+            size_t threads = pool.size();
+            if (root.type() != tag_compound || threads <= 1)
+                return root.serialized_size_with(&blocks);
+            int total = split(root);
+            if (total < 0 || total < min_parallel) {
+                splits.clear();
+                return total;
+            }
+            // Enough pieces that threads finishing early find more to do
+            grain = std::max<int>(64 * 1024, total / (threads * 16));
+            std::vector<tag*> big {&root};
+            while (!big.empty()) {
+                std::vector<tag*> next;
+                for (tag* t : big) {
+                    auto& children = static_cast<compound_tag&>(*t).children();
+                    const std::vector<int>& sizes = splits.find(t)->second;
+                    for (size_t i = 0; i < children.size(); i++)
+                        if (sizes[i] > grain && children[i]->type() == tag_compound) {
+                            split(*children[i]);
+                            next.push_back(children[i]);
+                        }
+                }
+                big.swap(next);
+            }
+            return total;
+        }
+        // Measures the children of a compound in parallel, returns its size
+        int split(tag& t)
+        {
+            auto& children = static_cast<compound_tag&>(t).children();
+            std::vector<int>& sizes = splits[&t];
+            sizes.resize(children.size());
+            pool.run(children.size(), [&](size_t i) { sizes[i] = children[i]->serialized_size_with(&blocks); });
+            uint64_t size = sizeof(uint8_t) + t.name_size() + sizeof(uint8_t);
+            for (int child : sizes) {
+                if (child < 0)
+                    return -1;
+                size += child;
+            }
+            return checked_size(size);
+        }
+        void write(uint8_t* buf, int startidx, tag& root)
+        {
+            if (splits.empty()) {
+                root.serialize_with(buf, startidx, &blocks);
+            } else {
+                std::vector<job> jobs;
+                plan(buf, startidx, root, jobs);
+                pool.run(jobs.size(), [&](size_t i) { jobs[i].t->serialize_with(buf, jobs[i].offset, &blocks); });
+            }
+            blocks.clear();
+        }
+        // Writes the frame of every split compound, and lists the subtrees inside it
+        void plan(uint8_t* buf, int offset, tag& t, std::vector<job>& jobs)
+        {
+            auto found = splits.find(&t);
+            if (found == splits.end()) {
+                jobs.push_back({&t, offset});
+                return;
+            }
+            auto& children = static_cast<compound_tag&>(t).children();
+            profile_write(tag_compound, t.name_size(), sizeof(uint8_t));
+            offset += tag::write_type(buf, offset, tag_compound);
+            offset += t.write_name(buf, offset);
+            for (size_t i = 0; i < children.size(); i++) {
+                plan(buf, offset, *children[i], jobs);
+                offset += found->second[i];
+            }
+            buf[offset] = tag_end;
+        }
+
+        worker_pool pool;
+        int min_parallel;
+        int grain = 0;
+        // Child sizes of each split compound
+        std::unordered_map<const tag*, std::vector<int>> splits;
+        // Compressed blocks packed by measure(), for the write; only read by the workers
+        packed_blocks blocks;
+    };
+#pragma endregion
+#pragma region Documents
+    // A document is a small header followed by a root tag:
+    //     'M' 'B' 'I' 'N', version byte, flags byte (document_flags)
+    //     name table, with doc_interned_names: varint count, then varint length + bytes per name
+    //     root tag, naming tags by varint table index with doc_interned_names
+    // Plain root_tag::serialize output, with no header, reads back as a document without flags.
+    static const uint8_t document_magic[4] = {'M', 'B', 'I', 'N'};
+    static const uint8_t document_version = 1;
+    static const int document_header_size = sizeof(document_magic) + 2;
+    // Flags this build can read; documents using any other are refused
+    static const uint8_t document_known_flags = doc_interned_names | doc_compact_ints | doc_blob_section | doc_checksums
+        | doc_sized_compounds | doc_child_offsets;
+
+    // Gives every tag in the tree an id from the table
+    inline void intern_names(tag& root, name_table& names)
+    {
+        root.name_id = names.intern(root.name).id;
+        root.name_generation = names.generation();
+        if (is_compound(root.type()))
+            for (tag* child : static_cast<compound_tag&>(root).children())
+                intern_names(*child, names);
+        else if (root.type() == tag_table)
+            for (tag* column : static_cast<table_tag&>(root).columns())
+                intern_names(*column, names);
+    }
+    // Serializes tag trees as documents, in the encodings selected by flags
+    class document_writer {
+    public:
+        // Names are interned into the given table, which keeps them from one document to
+        // the next, or a table of the writer's own, which holds only the current tree's.
+        // With doc_blob_section, payloads of blob_threshold bytes or more go out of line.
+        document_writer(uint8_t flags = 0, name_table* names = nullptr, size_t blob_threshold = 64 * 1024)
+            : flags(flags), names(names != nullptr ? *names : own_names), blob_threshold(blob_threshold) {}
+
+        // Number of bytes serialize() writes for this tree, -1 if it is past max_serialized_size
+        int serialized_size(tag& root)
+        {
+            prepare(root);
+            return measure(root);
+        }
+        // Returns -1, writing nothing, if the document would end past max_serialized_size
+        int serialize(uint8_t* buf, int startidx, tag& root)
+        {
+            prepare(root);
+            if (!blob_order.empty() && checked_size(startidx + blob_end) < 0)
+                return -1;
+            return write(buf, startidx, root);
+        }
+        // Like tag::serialize_to, returns the bytes written or -1 if the sink rejected them
+        int serialize_to(sink& out, tag& root)
+        {
+            prepare(root);
+            int len = measure(root);
+            uint8_t* buf = out.acquire(len);
+            if (buf == nullptr)
+                return -1;
+            int written = write(buf, 0, root);
+            assert(written == len);
+            return out.commit(written) ? written : -1;
+        }
+    private:
+        void prepare(tag& root)
+        {
+            if (flags & doc_interned_names) {
+                if (&names == &own_names)
+                    own_names.clear();
+                intern_names(root, names);
+            }
+            // Compressed blocks keep their payloads inline, so no blobs yet
+            blobs.clear();
+            blob_order.clear();
+            compress_blocks(root);
+            if (flags & doc_blob_section)
+                layout_blobs(root);
+        }
+        // Places every large payload outside compressed blocks after the root tag, in order
+        void layout_blobs(tag& root)
+        {
+            collect_blobs(root);
+            if (blob_order.empty())
+                return;
+            size_t at = tree_size(root);
+            for (tag* t : blob_order) {
+                at = (at + blob_alignment - 1) / blob_alignment * blob_alignment;
+                blobs[t] = at;
+                at += sized_bytes(*t).size;
+            }
+            blob_end = at;
+        }
+        void collect_blobs(tag& t)
+        {
+            if (t.type() == tag_compound) {
+                for (tag* child : static_cast<compound_tag&>(t).children())
+                    collect_blobs(*child);
+            } else if ((t.type() == tag_string || t.type() == tag_byte_array) && sized_bytes(t).size >= blob_threshold) {
+                blobs[&t] = 0;
+                blob_order.push_back(&t);
+            }
+        }
+        static byte_span sized_bytes(tag& t)
+        {
+            if (t.type() == tag_string) {
+                std::string_view val = static_cast<string_tag&>(t).value();
+                return {reinterpret_cast<const uint8_t*>(val.data()), val.size()};
+            }
+            auto& bytes = static_cast<byte_array_tag&>(t);
+            return {bytes.data(), bytes.size()};
+        }
+        // Compresses every compressed compound ahead of measuring, in this encoding
+        void compress_blocks(tag& root)
+        {
+            blocks.clear();
+            pack_blocks(root, blocks, [&](const compound_tag& compound, const packed_blocks&) {
+                uint64_t raw_len = sizeof(uint8_t);
+                for (tag* child : compound.children())
+                    raw_len += tag_size(*child);
+                if (raw_len > max_serialized_size)
+                    return std::vector<uint8_t>();
+                std::vector<uint8_t> raw(raw_len);
+                int offset = 0;
+                for (tag* child : compound.children())
+                    offset += write_tag(raw.data(), offset, *child);
+                raw[offset] = tag_end;
+                return raw;
+            }, pool);
+        }
+        int measure(tag& root)
+        {
+            return checked_size(blob_order.empty() ? tree_size(root) : blob_end);
+        }
+        // Header, name table and root tag, without the blob section.
+        // Sizes are summed in 64 bits, so one past max_serialized_size stays past it
+        uint64_t tree_size(tag& root)
+        {
+            uint64_t size = document_header_size;
+            if (flags & doc_interned_names) {
+                size += varint_size(names.size());
+                for (uint32_t id = 1; id <= names.size(); id++)
+                    size += varint_size(names.key(id).text.size()) + names.key(id).text.size();
+            }
+            return size + tag_size(root);
+        }
+        int write(uint8_t* buf, int startidx, tag& root)
+        {
+            int offset = startidx;
+            memcpy(buf + offset, document_magic, sizeof(document_magic));
+            offset += sizeof(document_magic);
+            offset += write_uint8(buf, offset, document_version);
+            offset += write_uint8(buf, offset, flags);
+            if (flags & doc_interned_names) {
+                offset += write_varint(buf, offset, names.size());
+                for (uint32_t id = 1; id <= names.size(); id++) {
+                    std::string_view text = names.key(id).text;
+                    offset += write_varint(buf, offset, text.size());
+                    memcpy(buf + offset, text.data(), text.size());
+                    offset += text.size();
+                }
+            }
+            offset += write_tag(buf, offset, root);
+            // Blobs can take the document past what the tags inside address, so from here
+            // positions are size_t, and serialize() has checked the end fits an int
+            size_t end = offset;
+            for (tag* t : blob_order) {
+                size_t at = startidx + blobs[t];
+                memset(buf + end, 0, at - end);
+                byte_span data = sized_bytes(*t);
+                memcpy(buf + at, data.data, data.size);
+                end = at + data.size;
+            }
+            return end - startidx;
+        }
+        int name_size(const tag& t) const
+        {
+            if (flags & doc_interned_names)
+                return varint_size(t.name_id - 1);
+            if (flags & doc_compact_ints)
+                return varint_size(t.name.size()) + t.name.size();
+            return t.name_size();
+        }
+        int length_size(uint64_t len) const
+        {
+            return (flags & doc_compact_ints) ? varint_size(len) : sizeof(uint32_t);
+        }
+        int write_length(uint8_t* buf, int index, uint64_t len) const
+        {
+            return (flags & doc_compact_ints) ? write_varint(buf, index, len) : write_uint32(buf, index, len);
+        }
+        // Payload of anything but a compound, in this writer's encoding
+        uint64_t payload_size(tag& t) const
+        {
+            if (!(flags & doc_compact_ints)) {
+                int size = t.payload_size();
+                return size < 0 ? max_serialized_size + 1 : size;
+            }
+            switch (t.type()) {
+                case tag_uint16: return varint_size(static_cast<uint16_tag&>(t).value());
+                case tag_uint32: return varint_size(static_cast<uint32_tag&>(t).value());
+                case tag_uint64: return varint_size(static_cast<uint64_tag&>(t).value());
+                case tag_sint16: return varint_size(zigzag_encode(static_cast<sint16_tag&>(t).value()));
+                case tag_sint32: return varint_size(zigzag_encode(static_cast<sint32_tag&>(t).value()));
+                case tag_sint64: return varint_size(zigzag_encode(static_cast<sint64_tag&>(t).value()));
+                case tag_string: {
+                    size_t len = static_cast<string_tag&>(t).value().size();
+                    return length_size(len) + len;
+                }
+                case tag_byte_array: {
+                    size_t len = static_cast<byte_array_tag&>(t).size();
+                    return length_size(len) + len;
+                }
+                case tag_list: {
+                    auto& list = static_cast<packed_list_tag&>(t);
+                    return sizeof(uint8_t) + length_size(list.count()) + list.count() * payload_width(list.element_type());
+                }
+                default:
+                    return t.payload_size();
+            }
+        }
+        int write_payload(uint8_t* buf, int index, tag& t) const
+        {
+            if (!(flags & doc_compact_ints))
+                return t.write_payload(buf, index);
+            switch (t.type()) {
+                case tag_uint16: return write_varint(buf, index, static_cast<uint16_tag&>(t).value());
+                case tag_uint32: return write_varint(buf, index, static_cast<uint32_tag&>(t).value());
+                case tag_uint64: return write_varint(buf, index, static_cast<uint64_tag&>(t).value());
+                case tag_sint16: return write_varint(buf, index, zigzag_encode(static_cast<sint16_tag&>(t).value()));
+                case tag_sint32: return write_varint(buf, index, zigzag_encode(static_cast<sint32_tag&>(t).value()));
+                case tag_sint64: return write_varint(buf, index, zigzag_encode(static_cast<sint64_tag&>(t).value()));
+                case tag_string: {
+                    std::string_view val = static_cast<string_tag&>(t).value();
+                    int offset = index + write_varint(buf, index, val.size());
+                    memcpy(buf + offset, val.data(), val.size());
+                    return offset + val.size() - index;
+                }
+                case tag_byte_array: {
+                    auto& bytes = static_cast<byte_array_tag&>(t);
+                    int offset = index + write_varint(buf, index, bytes.size());
+                    memcpy(buf + offset, bytes.data(), bytes.size());
+                    return offset + bytes.size() - index;
+                }
+                case tag_list: {
+                    auto& list = static_cast<packed_list_tag&>(t);
+                    int offset = index;
+                    offset += tag::write_type(buf, offset, list.element_type());
+                    offset += write_varint(buf, offset, list.count());
+                    offset += list.write_elements(buf, offset);
+                    return offset - index;
+                }
+                default:
+                    return t.write_payload(buf, index);
+            }
+        }
+        uint64_t tag_size(tag& t)
+        {
+            uint64_t size = sizeof(uint8_t) + name_size(t);
+            if (is_compound(t.type()) && (flags & doc_checksums))
+                size += sizeof(uint32_t);
+            if (t.type() == tag_compressed) {
+                const packed_block& packed = blocks.find(&t)->second;
+                if (packed.raw_size < 0)
+                    return max_serialized_size + 1;
+                return size + length_size(packed.raw_size) + length_size(packed.bytes.size()) + packed.bytes.size();
+            }
+            if ((flags & doc_blob_section) && (t.type() == tag_string || t.type() == tag_byte_array))
+                return size + sizeof(uint8_t) + (blobs.count(&t) ? 2 * sizeof(uint64_t) : payload_size(t));
+            if (t.type() == tag_table) {
+                auto& table = static_cast<table_tag&>(t);
+                size += length_size(table.row_names().size());
+                for (auto& row : table.row_names())
+                    size += length_size(row.size()) + row.size();
+                for (tag* column : table.columns())
+                    size += tag_size(*column);
+                return size + sizeof(uint8_t);
+            }
+            if (t.type() != tag_compound)
+                return size + payload_size(t);
+            auto& children = static_cast<compound_tag&>(t).children();
+            if (flags & doc_sized_compounds)
+                size += sizeof(uint32_t);
+            if (flags & doc_child_offsets)
+                size += sizeof(uint32_t) * (children.size() + 1);
+            for (tag* child : children)
+                size += tag_size(*child);
+            return size + sizeof(uint8_t);
+        }
+        int write_tag(uint8_t* buf, int startidx, tag& t)
+        {
+            int offset = startidx;
+            offset += tag::write_type(buf, offset, t.type());
+            if (flags & doc_interned_names) {
+                offset += write_varint(buf, offset, t.name_id - 1);
+            } else if (flags & doc_compact_ints) {
+                offset += write_varint(buf, offset, t.name.size());
+                memcpy(buf + offset, t.name.data(), t.name.size());
+                offset += t.name.size();
+            } else {
+                offset += t.write_name(buf, offset);
+            }
+            // Checksum of the contents, filled in once they are written
+            int checksum_at = offset;
+            if (is_compound(t.type()) && (flags & doc_checksums))
+                offset += sizeof(uint32_t);
+            if (t.type() == tag_compressed) {
+                const packed_block& packed = blocks.find(&t)->second;
+                if (flags & doc_compact_ints) {
+                    offset += write_varint(buf, offset, packed.raw_size);
+                    offset += write_varint(buf, offset, packed.bytes.size());
+                } else {
+                    offset += write_uint32(buf, offset, packed.raw_size);
+                    offset += write_uint32(buf, offset, packed.bytes.size());
+                }
+                memcpy(buf + offset, packed.bytes.data(), packed.bytes.size());
+                offset += packed.bytes.size();
+                write_checksum(buf, checksum_at, offset);
+                profile_write(tag_compressed, checksum_at - startidx - sizeof(uint8_t), offset - checksum_at);
+                return offset - startidx;
+            }
+            if ((flags & doc_blob_section) && (t.type() == tag_string || t.type() == tag_byte_array)) {
+                auto blob = blobs.find(&t);
+                if (blob == blobs.end()) {
+                    offset += write_uint8(buf, offset, blob_inline);
+                    offset += write_payload(buf, offset, t);
+                } else {
+                    offset += write_uint8(buf, offset, blob_stored);
+                    offset += write_uint64(buf, offset, blob->second);
+                    offset += write_uint64(buf, offset, sized_bytes(t).size);
+                }
+                profile_write(t.type(), checksum_at - startidx - sizeof(uint8_t), offset - checksum_at);
+                return offset - startidx;
+            }
+            if (t.type() == tag_table) {
+                auto& table = static_cast<table_tag&>(t);
+                offset += write_length(buf, offset, table.row_names().size());
+                for (auto& row : table.row_names()) {
+                    offset += write_length(buf, offset, row.size());
+                    memcpy(buf + offset, row.data(), row.size());
+                    offset += row.size();
+                }
+                profile_write(tag_table, checksum_at - startidx - sizeof(uint8_t), offset - checksum_at + sizeof(uint8_t));
+                for (tag* column : table.columns())
+                    offset += write_tag(buf, offset, *column);
+                buf[offset] = tag_end;
+                offset++;
+                return offset - startidx;
+            }
+            if (t.type() != tag_compound) {
+                offset += write_payload(buf, offset, t);
+                profile_write(t.type(), checksum_at - startidx - sizeof(uint8_t), offset - checksum_at);
+                return offset - startidx;
+            }
+            profile_scope scope("write", t.name);
+            auto& children = static_cast<compound_tag&>(t).children();
+            // Length and offset table, filled in as the children are written
+            int length_at = offset;
+            if (flags & doc_sized_compounds)
+                offset += sizeof(uint32_t);
+            int table_at = offset;
+            if (flags & doc_child_offsets) {
+                offset += write_uint32(buf, offset, children.size());
+                offset += sizeof(uint32_t) * children.size();
+            }
+            int children_at = offset;
+            profile_write(tag_compound, checksum_at - startidx - sizeof(uint8_t), children_at - checksum_at + sizeof(uint8_t));
+            for (size_t i = 0; i < children.size(); i++) {
+                if (flags & doc_child_offsets)
+                    write_uint32(buf, table_at + sizeof(uint32_t) * (i + 1), offset - children_at);
+                offset += write_tag(buf, offset, *children[i]);
+            }
+            buf[offset] = tag_end;
+            offset++;
+            if (flags & doc_sized_compounds)
+                write_uint32(buf, length_at, offset - length_at - sizeof(uint32_t));
+            write_checksum(buf, checksum_at, offset);
+            return offset - startidx;
+        }
+        // Fills the checksum at checksum_at with the CRC32C of what follows it, up to end
+        void write_checksum(uint8_t* buf, int checksum_at, int end) const
+        {
+            if (!(flags & doc_checksums))
+                return;
+            int contents = checksum_at + sizeof(uint32_t);
+            write_uint32(buf, checksum_at, crc32c(buf + contents, end - contents));
+        }
+
+        uint8_t flags;
+        name_table own_names;
+        name_table& names;
+        size_t blob_threshold;
+        // Compressed children of each tag_compressed, made by prepare()
+        packed_blocks blocks;
+        // Packs the blocks of a level in parallel, started on the first level of several
+        worker_pool pool;
+        // Offsets of out of line payloads from the start of the document, and their order
+        std::unordered_map<const tag*, size_t> blobs;
+        std::vector<tag*> blob_order;
+        size_t blob_end = 0;
+    };
+    // Header of a serialized document; tag_views of its body decode through it.
+    // The bytes must outlive the document_view, and it must outlive its tag_views.
+    class document_view {
+    public:
+        document_view(const uint8_t* buf, size_t len) : end(buf + len)
+        {
+            ctx.start = buf;
+            ctx.size = len;
+            if (len < (size_t) document_header_size || memcmp(buf, document_magic, sizeof(document_magic)) != 0) {
+                // Plain tag stream, no header
+                body = buf;
+                return;
+            }
+            const uint8_t* pos = buf + sizeof(document_magic);
+            uint8_t version = read_uint8(pos, 0);
+            ctx.flags = read_uint8(pos, 1);
+            pos += 2;
+            if (version != document_version || (ctx.flags & ~document_known_flags))
+                return;
+            if (ctx.flags & doc_interned_names) {
+                uint64_t count;
+                int used = read_varint(pos, end, count);
+                if (used == 0 || count > (uint64_t)(end - pos))
+                    return;
+                pos += used;
+                ctx.names.reserve(count);
+                for (uint64_t i = 0; i < count; i++) {
+                    uint64_t name_len;
+                    used = read_varint(pos, end, name_len);
+                    if (used == 0 || name_len > (uint64_t)(end - pos - used))
+                        return;
+                    pos += used;
+                    ctx.names.emplace_back(reinterpret_cast<const char*>(pos), name_len);
+                    pos += name_len;
+                }
+            }
+            body = pos;
+        }
+        document_view(const document_view&) = delete;
+        document_view& operator=(const document_view&) = delete;
+
+        // False for an unknown version or flags, or a damaged header
+        bool valid() const { return body != nullptr; }
+        uint8_t flags() const { return ctx.flags; }
+        tag_view root() const { return valid() ? tag_view(body, end, &ctx) : tag_view(); }
+    private:
+        format_context ctx;
+        const uint8_t* body = nullptr;
+        const uint8_t* end;
+    };
+    // Copies an out of line payload from the document's file straight to out_fd (a
+    // socket, pipe or file) with sendfile, without reading it into memory.
+    // doc_offset is where the document starts in in_fd. False for inline payloads.
+    inline bool send_blob(int out_fd, int in_fd, const tag_view& view, off_t doc_offset = 0)
+    {
+        uint64_t offset, len;
+        if (!view.blob_range(offset, len))
+            return false;
+        off_t pos = doc_offset + offset;
+        while (len > 0) {
+            ssize_t n = sendfile(out_fd, in_fd, &pos, len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            len -= n;
+        }
+        return true;
+    }
+#pragma endregion
+    // Allocates a tag from the arena if there is one, otherwise from the heap
+    template<typename T, typename... Args>
+    inline T* make_tag(arena* mem, Args&&... args)
+    {
+        if (mem != nullptr)
+            return mem->make<T>(std::forward<Args>(args)...);
+        profile_alloc(sizeof(T));
+        return new T(std::forward<Args>(args)...);
+    }
+    template<typename T>
+    inline tag* materialize_list(const tag_view& view, arena* mem)
+    {
+        auto list = make_tag<list_tag<T>>(mem, view.name());
+        list->values().resize(view.list_size());
+        view.copy_list(list->values().data(), list->values().size());
+        return list;
+    }
+    // Copies a serialized tag into a tag tree, allocated from mem when given
+    // Returns nullptr for tags that have no in-memory representation
+    inline tag* materialize(const tag_view& view, arena* mem = nullptr)
+    {
+        profile_read(view.type());
+        std::string_view name = view.name();
+        switch (view.type()) {
+            case tag_uint8:  return make_tag<uint8_tag>(mem, name, view.as_uint8());
+            case tag_uint16: return make_tag<uint16_tag>(mem, name, view.as_uint16());
+            case tag_uint32: return make_tag<uint32_tag>(mem, name, view.as_uint32());
+            case tag_uint64: return make_tag<uint64_tag>(mem, name, view.as_uint64());
+            case tag_sint8:  return make_tag<sint8_tag>(mem, name, view.as_sint8());
+            case tag_sint16: return make_tag<sint16_tag>(mem, name, view.as_sint16());
+            case tag_sint32: return make_tag<sint32_tag>(mem, name, view.as_sint32());
+            case tag_sint64: return make_tag<sint64_tag>(mem, name, view.as_sint64());
+            case tag_float:  return make_tag<float_tag>(mem, name, view.as_float());
+            case tag_double: return make_tag<double_tag>(mem, name, view.as_double());
+            case tag_string: return make_tag<string_tag>(mem, name, view.as_string());
+            case tag_byte_array: {
+                byte_span bytes = view.as_bytes();
+                return make_tag<byte_array_tag>(mem, name, bytes.data, bytes.size);
+            }
+            case tag_list:
+                switch (view.list_type()) {
+                    case tag_uint8:  return materialize_list<uint8_t>(view, mem);
+                    case tag_uint16: return materialize_list<uint16_t>(view, mem);
+                    case tag_uint32: return materialize_list<uint32_t>(view, mem);
+                    case tag_uint64: return materialize_list<uint64_t>(view, mem);
+                    case tag_sint8:  return materialize_list<int8_t>(view, mem);
+                    case tag_sint16: return materialize_list<int16_t>(view, mem);
+                    case tag_sint32: return materialize_list<int32_t>(view, mem);
+                    case tag_sint64: return materialize_list<int64_t>(view, mem);
+                    case tag_float:  return materialize_list<float>(view, mem);
+                    case tag_double: return materialize_list<double>(view, mem);
+                    default:         return nullptr;
+                }
+            case tag_compound: {
+                profile_scope scope("materialize", name);
+                auto compound = make_tag<compound_tag>(mem, name);
+                for (auto child : view)
+                    if (tag* t = materialize(child, mem))
+                        compound->add(t);
+                return compound;
+            }
+            case tag_table: {
+                auto table = make_tag<table_tag>(mem, name);
+                for (auto row : view.row_names())
+                    table->row_names().emplace_back(row);
+                for (auto column : view)
+                    if (column.type() == tag_list)
+                        table->add_column(static_cast<packed_list_tag*>(materialize(column, mem)));
+                return table;
+            }
+            case tag_compressed: {
+                // Children are copied out, so the decompressed bytes can go straight away
+                std::vector<uint8_t> storage;
+                auto compound = make_tag<compressed_compound_tag>(mem, name);
+                for (auto child : view.expand(storage))
+                    if (tag* t = materialize(child, mem))
+                        compound->add(t);
+                return compound;
+            }
+            default:
+                return nullptr;
+        }
+    }
+    // Eagerly reads back a root_tag written by root_tag::serialize or a document_writer
+    // Prefer mapped_file / tag_view when only a few tags are needed.
+    inline root_tag deserialize(const uint8_t* buf, size_t len)
+    {
+        document_view doc(buf, len);
+        tag_view view = doc.root();
+        if (view.type() != tag_compound)
+            return root_tag();
+        profile_scope scope("deserialize", view.name());
+        profile_read(tag_compound);
+        std::vector<tag*> children;
+        for (auto child : view)
+            if (tag* t = materialize(child))
+                children.push_back(t);
+        return root_tag(view.name(), children);
+    }
+    // Reads back a root_tag with the whole tree allocated from an arena
+    // Returns nullptr if buf doesn't start with a compound.
+    inline root_tag* deserialize(const uint8_t* buf, size_t len, arena& mem)
+    {
+        document_view doc(buf, len);
+        tag_view view = doc.root();
+        if (view.type() != tag_compound)
+            return nullptr;
+        profile_scope scope("deserialize", view.name());
+        profile_read(tag_compound);
+        auto root = mem.make<root_tag>(view.name());
+        for (auto child : view)
+            if (tag* t = materialize(child, &mem))
+                root->add(t);
+        return root;
+    }
+    // Deep copy of a tree, through its serialized form
+    inline tag* clone(tag& t, arena* mem = nullptr)
+    {
+        std::vector<uint8_t> bytes;
+        vector_sink out(bytes);
+        t.serialize_to(out);
+        return materialize(tag_view(bytes.data(), bytes.data() + bytes.size()), mem);
+    }
+    // Compound at a '/' separated path of names below root ("" for root itself)
+    inline compound_tag* find_compound(compound_tag& root, std::string_view path)
+    {
+        tag* at = &root;
+        while (!path.empty()) {
+            size_t slash = path.find('/');
+            at = static_cast<compound_tag*>(at)->find(path.substr(0, slash));
+            if (at == nullptr || !is_compound(at->type()))
+                return nullptr;
+            path = slash == std::string_view::npos ? std::string_view() : path.substr(slash + 1);
+        }
+        return static_cast<compound_tag*>(at);
+    }
+#pragma region Tables
+    // In-memory tag class of a fixed width scalar type
+    template<typename T> struct scalar_tag_of;
+    template<> struct scalar_tag_of<uint8_t>  { typedef uint8_tag type; };
+    template<> struct scalar_tag_of<uint16_t> { typedef uint16_tag type; };
+    template<> struct scalar_tag_of<uint32_t> { typedef uint32_tag type; };
+    template<> struct scalar_tag_of<uint64_t> { typedef uint64_tag type; };
+    template<> struct scalar_tag_of<int8_t>   { typedef sint8_tag type; };
+    template<> struct scalar_tag_of<int16_t>  { typedef sint16_tag type; };
+    template<> struct scalar_tag_of<int32_t>  { typedef sint32_tag type; };
+    template<> struct scalar_tag_of<int64_t>  { typedef sint64_tag type; };
+    template<> struct scalar_tag_of<float>    { typedef float_tag type; };
+    template<> struct scalar_tag_of<double>   { typedef double_tag type; };
+    // Calls fn with a value of the C++ type of a fixed width tag type
+    template<typename Fn>
+    inline void with_scalar_type(tag_type_t type, Fn fn)
+    {
+        switch (type) {
+            case tag_uint8:  fn(uint8_t());  break;
+            case tag_uint16: fn(uint16_t()); break;
+            case tag_uint32: fn(uint32_t()); break;
+            case tag_uint64: fn(uint64_t()); break;
+            case tag_sint8:  fn(int8_t());   break;
+            case tag_sint16: fn(int16_t());  break;
+            case tag_sint32: fn(int32_t());  break;
+            case tag_sint64: fn(int64_t());  break;
+            case tag_float:  fn(float());    break;
+            case tag_double: fn(double());   break;
+            default: break;
+        }
+    }
+    // Adds a column for every scalar below record, depth first, named by its path
+    // False if record holds anything a table can't: other tag types, empty compounds,
+    // names with a '/' in them, or two children of one compound sharing a name.
+    inline bool add_table_columns(table_tag& table, const compound_tag& record, const std::string& prefix, arena* mem)
+    {
+        auto& children = record.children();
+        if (children.empty())
+            return false;
+        for (size_t i = 0; i < children.size(); i++) {
+            tag* child = children[i];
+            if (child->name.find('/') != std::string::npos)
+                return false;
+            for (size_t j = 0; j < i; j++)
+                if (children[j]->name == child->name)
+                    return false;
+            std::string path = prefix + std::string(child->name);
+            if (child->type() == tag_compound) {
+                if (!add_table_columns(table, static_cast<compound_tag&>(*child), path + "/", mem))
+                    return false;
+                continue;
+            }
+            if (payload_width(child->type()) < 0)
+                return false;
+            with_scalar_type(child->type(), [&](auto v) {
+                table.add_column(make_tag<list_tag<decltype(v)>>(mem, path));
+            });
+        }
+        return true;
+    }
+    // Whether record has the shape of model: the same names and types, in the same order
+    inline bool same_shape(const compound_tag& model, const compound_tag& record)
+    {
+        auto& expected = model.children();
+        auto& children = record.children();
+        if (expected.size() != children.size())
+            return false;
+        for (size_t i = 0; i < children.size(); i++) {
+            if (children[i]->type() != expected[i]->type() || children[i]->name != expected[i]->name)
+                return false;
+            if (children[i]->type() == tag_compound
+                && !same_shape(static_cast<compound_tag&>(*expected[i]), static_cast<compound_tag&>(*children[i])))
+                return false;
+        }
+        return true;
+    }
+    // Appends the scalars below record to the table's columns, from column onwards
+    inline void append_table_row(table_tag& table, const compound_tag& record, size_t& column)
+    {
+        for (tag* child : record.children()) {
+            if (child->type() == tag_compound) {
+                append_table_row(table, static_cast<compound_tag&>(*child), column);
+                continue;
+            }
+            with_scalar_type(child->type(), [&](auto v) {
+                typedef decltype(v) T;
+                auto values = static_cast<list_tag<T>*>(table.columns()[column]);
+                values->values().push_back(static_cast<typename scalar_tag_of<T>::type*>(child)->value());
+            });
+            column++;
+        }
+    }
+    // Table of the records in a compound whose children are all compounds of one shape:
+    // the same fields in the same order, each a fixed width scalar or a compound of them.
+    // Returns nullptr for anything else, including a compound without children.
+    inline table_tag* to_table(const compound_tag& records, arena* mem = nullptr)
+    {
+        auto& children = records.children();
+        if (children.empty() || children[0]->type() != tag_compound)
+            return nullptr;
+        auto& model = static_cast<compound_tag&>(*children[0]);
+        for (tag* record : children)
+            if (record->type() != tag_compound || !same_shape(model, static_cast<compound_tag&>(*record)))
+                return nullptr;
+        auto table = make_tag<table_tag>(mem, records.name);
+        if (!add_table_columns(*table, model, "", mem)) {
+            dispose(table);
+            return nullptr;
+        }
+        table->row_names().reserve(children.size());
+        for (auto column : table->columns())
+            with_scalar_type(column->element_type(), [&](auto v) {
+                static_cast<list_tag<decltype(v)>*>(column)->values().reserve(children.size());
+            });
+        for (tag* record : children) {
+            table->row_names().emplace_back(record->name);
+            size_t column = 0;
+            append_table_row(*table, static_cast<compound_tag&>(*record), column);
+        }
+        return table;
+    }
+    // Compound of records rebuilt from a table, one compound per row as to_table found them
+    // Returns nullptr if a column doesn't hold a value for every row.
+    inline compound_tag* from_table(const table_tag& table, arena* mem = nullptr)
+    {
+        size_t rows = table.row_names().size();
+        std::vector<std::vector<std::string_view>> paths;
+        for (auto column : table.columns()) {
+            if (column->count() != rows || column->name.empty())
+                return nullptr;
+            paths.emplace_back();
+            std::string_view path = column->name;
+            while (!path.empty()) {
+                size_t slash = path.find('/');
+                paths.back().push_back(path.substr(0, slash));
+                path = slash == std::string_view::npos ? std::string_view() : path.substr(slash + 1);
+            }
+        }
+        auto records = make_tag<compound_tag>(mem, table.name);
+        for (size_t row = 0; row < rows; row++) {
+            auto record = make_tag<compound_tag>(mem, table.row_names()[row]);
+            for (size_t i = 0; i < paths.size(); i++) {
+                // Columns are in depth first order, so an enclosing compound made for an
+                // earlier column of this row is always the last child of its parent
+                compound_tag* at = record;
+                for (size_t depth = 0; depth + 1 < paths[i].size(); depth++) {
+                    auto& children = at->children();
+                    if (children.empty() || children.back()->name != paths[i][depth] || children.back()->type() != tag_compound)
+                        at->add(make_tag<compound_tag>(mem, paths[i][depth]));
+                    at = static_cast<compound_tag*>(at->children().back());
+                }
+                packed_list_tag* column = table.columns()[i];
+                with_scalar_type(column->element_type(), [&](auto v) {
+                    typedef decltype(v) T;
+                    T value = static_cast<list_tag<T>*>(column)->values()[row];
+                    at->add(make_tag<typename scalar_tag_of<T>::type>(mem, paths[i].back(), value));
+                });
+            }
+            records->add(record);
+        }
+        return records;
+    }
+#pragma endregion
+#pragma region Patching
+    // Mutable payload of the fixed width T at path, nullptr if there isn't one.
+    // The compounds on the way there are added to enclosing, outermost first; they point
+    // into doc, which must outlive them.
+    template<typename T>
+    inline uint8_t* patch_target(uint8_t* buf, const document_view& doc, std::string_view path, std::vector<tag_view>& enclosing)
+    {
+        tag_view target = doc.root();
+        while (target.valid() && !path.empty()) {
+            enclosing.push_back(target);
+            size_t slash = path.find('/');
+            target = target.find(path.substr(0, slash));
+            path = slash == std::string_view::npos ? std::string_view() : path.substr(slash + 1);
+        }
+        byte_span payload = target.fixed_payload();
+        if (target.type() != tag_type_of<T>::value || payload.data == nullptr)
+            return nullptr;
+        return buf + (payload.data - buf);
+    }
+    // Brings the checksums of a doc_checksums document up to date after a patch, innermost
+    // compound first as each covers those inside it. Returns the offset of the first byte
+    // changed, or end if there were none.
+    inline size_t patch_checksums(uint8_t* buf, const std::vector<tag_view>& enclosing, size_t end)
+    {
+        for (auto compound = enclosing.rbegin(); compound != enclosing.rend(); ++compound) {
+            uint32_t current;
+            const uint8_t* stored = compound->checksum_at(current);
+            if (stored == nullptr)
+                return end;
+            end = stored - buf;
+            write_uint32(buf, end, current);
+        }
+        return end;
+    }
+    // Overwrites the value of a fixed width tag in a serialized tree or document,
+    // leaving every other byte as it was, bar the checksums of the compounds holding it:
+    //     patch(buf, len, "ENTITIES/1/pos/x", 0.5f);
+    // Fails if nothing of type T is at path, or if a compact document stores it as a varint.
+    template<typename T>
+    inline bool patch(uint8_t* buf, size_t len, std::string_view path, T value)
+    {
+        document_view doc(buf, len);
+        std::vector<tag_view> enclosing;
+        uint8_t* target = patch_target<T>(buf, doc, path, enclosing);
+        if (target == nullptr)
+            return false;
+        write_array(target, 0, &value, 1);
+        patch_checksums(buf, enclosing, target - buf);
+        return true;
+    }
+    // The same on a writable mapping; with sync, the pages changed are flushed to disk
+    template<typename T>
+    inline bool patch(mapped_file& file, std::string_view path, T value, bool sync = false)
+    {
+        uint8_t* buf = file.writable_data();
+        document_view doc(buf, buf != nullptr ? file.size() : 0);
+        std::vector<tag_view> enclosing;
+        uint8_t* target = buf != nullptr ? patch_target<T>(buf, doc, path, enclosing) : nullptr;
+        if (target == nullptr)
+            return false;
+        write_array(target, 0, &value, 1);
+        size_t first = patch_checksums(buf, enclosing, target - buf);
+        return !sync || file.sync(first, target + sizeof(T) - buf - first);
+    }
+#pragma endregion
+#pragma region Journal
+    // A file that grows by appending changes, rather than being rewritten:
+    //     'M' 'B' 'J' 'L', version byte, three zero bytes
+    //     u32 snapshot length, snapshot (a root tag as tag::serialize writes it)
+    //     records, each: u32 body length, body, u32 CRC32C of the body
+    //     body: op byte, parent path (as a name), then the tag (add, set) or child name (remove)
+    // A record cut short by a crash fails its check and is dropped on the next open.
+    static const uint8_t journal_magic[4] = {'M', 'B', 'J', 'L'};
+    static const uint8_t journal_version = 1;
+    static const int journal_header_size = sizeof(journal_magic) + sizeof(uint32_t);
+
+    enum journal_op : uint8_t {
+        journal_add = 1,
+        journal_set,
+        journal_remove,
+    };
+    // Keeps a tree in memory and every change to it on disk.
+    // Opening replays the records onto the snapshot; once the records outgrow the
+    // snapshot by compact_ratio, they are folded into a fresh one.
+    class journal {
+    public:
+        // Opens path, or creates it holding an empty root_name compound
+        journal(const char* path, std::string_view root_name = "", double compact_ratio = 1.0)
+            : path(path), compact_ratio(compact_ratio)
+        {
+            {
+                mapped_file file(path);
+                if (file.is_open() ? !load(file.data(), file.size()) : !create(root_name))
+                    return;
+            }
+            fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+            // Drop a torn record, so new ones follow the last good one
+            if (fd >= 0 && ftruncate(fd, snapshot_bytes + log_bytes) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        ~journal()
+        {
+            if (fd >= 0)
+                close(fd);
+        }
+        journal(const journal&) = delete;
+        journal& operator=(const journal&) = delete;
+
+        bool is_open() const { return fd >= 0; }
+        root_tag& root() { return *root_; }
+        // Tags handed to add() and set() are kept until the journal goes;
+        // allocating them here ties their lifetime to it.
+        arena& memory() { return mem; }
+
+        // Appends child to the compound at parent ("" for the root, "ENTITIES/1" below it)
+        bool add(std::string_view parent, tag* child) { return change(journal_add, parent, child, {}); }
+        // Replaces parent's child of the same name as value, or adds it if there is none
+        bool set(std::string_view parent, tag* value) { return change(journal_set, parent, value, {}); }
+        bool remove(std::string_view parent, std::string_view name) { return change(journal_remove, parent, nullptr, name); }
+
+        // Rewrites the file as a snapshot of root(), with no records.
+        // The new file is written aside and renamed over the old one, so a crash
+        // leaves one or the other. On failure the journal carries on with the old
+        // file, unless it was already replaced, in which case the journal closes.
+        bool compact()
+        {
+            if (fd < 0)
+                return false;
+            std::string temp = path + ".compact";
+            size_t written = create_file(temp.c_str(), *root_);
+            if (written == 0 || rename(temp.c_str(), path.c_str()) != 0) {
+                unlink(temp.c_str());
+                return compact_failed(false);
+            }
+            close(fd);
+            fd = sync_directory() ? open(path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC) : -1;
+            if (fd < 0)
+                return compact_failed(false);
+            snapshot_bytes = written;
+            log_bytes = 0;
+            records_ = 0;
+            return compact_failed(true);
+        }
+        // Waits for every record appended so far to reach the disk
+        bool sync() { return fd >= 0 && fdatasync(fd) == 0; }
+        size_t records() const { return records_; }
+        size_t log_size() const { return log_bytes; }
+        // Whether the last compaction, automatic or not, failed. A change that triggers
+        // one still succeeds, as its record is written either way.
+        bool compaction_failed() const { return compact_error; }
+    private:
+        bool compact_failed(bool ok)
+        {
+            compact_error = !ok;
+            return ok;
+        }
+        // Flushes the directory holding path, so a rename in it survives a crash
+        bool sync_directory()
+        {
+            size_t slash = path.rfind('/');
+            std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+            int d = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (d < 0)
+                return false;
+            bool ok = fsync(d) == 0;
+            close(d);
+            return ok;
+        }
+        // Whether the change would apply, leaving the tree as it is
+        bool applies(journal_op op, std::string_view parent, std::string_view name)
+        {
+            compound_tag* target = find_compound(*root_, parent);
+            return target != nullptr && (op != journal_remove || target->find(name) != nullptr);
+        }
+        bool apply(journal_op op, std::string_view parent, tag* child, std::string_view name)
+        {
+            compound_tag* target = find_compound(*root_, parent);
+            if (target == nullptr)
+                return false;
+            switch (op) {
+                case journal_add:
+                    target->add(child);
+                    return true;
+                case journal_set:
+                    dispose(target->replace(child));
+                    return true;
+                case journal_remove: {
+                    tag* removed = target->remove(name);
+                    dispose(removed);
+                    return removed != nullptr;
+                }
+            }
+            return false;
+        }
+        // Appends the record first and applies the change only once it is written, so a
+        // failed write leaves the tree matching the file. A compaction it sets off can fail
+        // without undoing the change; compaction_failed() tells.
+        bool change(journal_op op, std::string_view parent, tag* child, std::string_view name)
+        {
+            if (fd < 0 || (op != journal_remove && child == nullptr) || !applies(op, parent, name))
+                return false;
+            std::vector<uint8_t> record(sizeof(uint32_t) + sizeof(uint8_t) + string_size(parent)
+                                        + (child != nullptr ? 0 : string_size(name)));
+            int offset = sizeof(uint32_t);
+            offset += write_uint8(record.data(), offset, op);
+            offset += write_string(record.data(), offset, parent);
+            if (child != nullptr) {
+                vector_sink out(record);
+                child->serialize_to(out);
+            } else {
+                write_string(record.data(), offset, name);
+            }
+            int body = record.size() - sizeof(uint32_t);
+            write_uint32(record.data(), 0, body);
+            record.resize(record.size() + sizeof(uint32_t));
+            write_uint32(record.data(), sizeof(uint32_t) + body, crc32c(record.data() + sizeof(uint32_t), body));
+            if (!write_all(fd, record.data(), record.size())) {
+                // Drop whatever part of the record made it, so later ones follow the last good one
+                if (ftruncate(fd, snapshot_bytes + log_bytes) != 0) {
+                    close(fd);
+                    fd = -1;
+                }
+                return false;
+            }
+            log_bytes += record.size();
+            records_++;
+            apply(op, parent, child, name);
+            if (compact_ratio > 0 && log_bytes > std::max<size_t>(snapshot_bytes, 64 * 1024) * compact_ratio)
+                compact();
+            return true;
+        }
+        // Reads the snapshot, then every intact record after it
+        bool load(const uint8_t* data, size_t len)
+        {
+            if (len < (size_t) journal_header_size + sizeof(uint32_t) || memcmp(data, journal_magic, sizeof(journal_magic)) != 0
+                || data[sizeof(journal_magic)] != journal_version)
+                return false;
+            uint32_t snapshot = read_uint32(data, journal_header_size);
+            const uint8_t* pos = data + journal_header_size + sizeof(uint32_t);
+            const uint8_t* end = data + len;
+            if ((size_t)(end - pos) < snapshot || (root_ = deserialize(pos, snapshot, mem)) == nullptr)
+                return false;
+            pos += snapshot;
+            snapshot_bytes = pos - data;
+            while (end - pos >= (ptrdiff_t)(2 * sizeof(uint32_t))) {
+                uint32_t body = read_uint32(pos, 0);
+                const uint8_t* start = pos + sizeof(uint32_t);
+                if ((size_t)(end - start) < body + sizeof(uint32_t) || read_uint32(start, body) != crc32c(start, body)
+                    || !replay(start, start + body))
+                    break;
+                pos = start + body + sizeof(uint32_t);
+                log_bytes = pos - data - snapshot_bytes;
+                records_++;
+            }
+            return true;
+        }
+        bool replay(const uint8_t* pos, const uint8_t* end)
+        {
+            auto op = (journal_op) *pos++;
+            std::string_view parent, name;
+            pos = read_name(pos, end, nullptr, parent);
+            if (pos == nullptr)
+                return false;
+            if (op == journal_remove)
+                return read_name(pos, end, nullptr, name) == end && apply(op, parent, nullptr, name);
+            tag_view view(pos, end);
+            tag* child = view.size() == (size_t)(end - pos) ? materialize(view, &mem) : nullptr;
+            return child != nullptr && apply(op, parent, child, {});
+        }
+        bool create(std::string_view root_name)
+        {
+            root_ = mem.make<root_tag>(root_name);
+            snapshot_bytes = create_file(path.c_str(), *root_);
+            return snapshot_bytes != 0;
+        }
+        // Writes a journal holding just a snapshot of root, flushed to disk.
+        // Returns its size, 0 if it couldn't be written.
+        size_t create_file(const char* file, tag& root)
+        {
+            std::vector<uint8_t> bytes(journal_header_size + sizeof(uint32_t));
+            memcpy(bytes.data(), journal_magic, sizeof(journal_magic));
+            bytes[sizeof(journal_magic)] = journal_version;
+            vector_sink snapshot(bytes);
+            root.serialize_to(snapshot);
+            write_uint32(bytes.data(), journal_header_size, bytes.size() - journal_header_size - sizeof(uint32_t));
+            int out = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (out < 0)
+                return 0;
+            bool ok = write_all(out, bytes.data(), bytes.size()) && fsync(out) == 0;
+            close(out);
+            return ok ? bytes.size() : 0;
+        }
+        static bool write_all(int out, const uint8_t* data, size_t len)
+        {
+            while (len > 0) {
+                ssize_t n = ::write(out, data, len);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                data += n;
+                len -= n;
+            }
+            return true;
+        }
+
+        std::string path;
+        double compact_ratio;
+        int fd = -1;
+        arena mem;
+        root_tag* root_ = nullptr;
+        size_t snapshot_bytes = 0;
+        size_t log_bytes = 0;
+        size_t records_ = 0;
+        bool compact_error = false;
+    };
+#pragma endregion
+#pragma region Deltas
+    // Changes that turn one tree into another, as a tree of their own that can be
+    // serialized and sent like any other:
+    //     compound "set"    - tags to add or replace, each named by its full path
+    //                         ("ENTITIES/1/pos/x"); a whole new subtree is one entry
+    //     compound "remove" - a uint8 per child to drop, named by its path
+    // Either is left out when empty. Children are matched by name, and paths are
+    // '/' separated, so names holding a '/' can't be told apart.
+    static const char* const delta_set = "set";
+    static const char* const delta_remove = "remove";
+
+    // Whether two tags serialize to the same bytes
+    inline bool same_tag(tag& a, tag& b)
+    {
+        std::vector<uint8_t> first, second;
+        vector_sink a_out(first), b_out(second);
+        a.serialize_to(a_out);
+        b.serialize_to(b_out);
+        return first == second;
+    }
+    inline void diff_children(compound_tag& base, compound_tag& target, const std::string& path,
+                              compound_tag& sets, compound_tag& removes, arena* mem)
+    {
+        for (tag* child : target.children()) {
+            std::string child_path = path + std::string(child->name);
+            tag* old = base.find(child->name);
+            if (old != nullptr && old->type() == tag_compound && child->type() == tag_compound) {
+                diff_children(static_cast<compound_tag&>(*old), static_cast<compound_tag&>(*child),
+                              child_path + "/", sets, removes, mem);
+            } else if (old == nullptr || !same_tag(*old, *child)) {
+                tag* copy = clone(*child, mem);
+                copy->name = child_path;
+                sets.add(copy);
+            }
+        }
+        for (tag* child : base.children())
+            if (target.find(child->name) == nullptr)
+                removes.add(make_tag<uint8_tag>(mem, path + std::string(child->name), 0));
+    }
+    // Delta that turns base into target; both are left as they are.
+    // Keep a clone() of whatever the receiver last acknowledged as the base.
+    inline root_tag diff(compound_tag& base, compound_tag& target, arena* mem = nullptr)
+    {
+        auto sets = make_tag<compound_tag>(mem, delta_set);
+        auto removes = make_tag<compound_tag>(mem, delta_remove);
+        diff_children(base, target, "", *sets, *removes, mem);
+        root_tag delta("DELTA");
+        if (!sets->children().empty())
+            delta.add(sets);
+        else
+            dispose(sets);
+        if (!removes->children().empty())
+            delta.add(removes);
+        else
+            dispose(removes);
+        return delta;
+    }
+    // Applies a serialized delta to root, removals first, with new tags made in mem.
+    // Returns false if any change names a parent root doesn't have, the rest still applied.
+    // Tags removed or replaced are disposed of; those in an arena stay until it goes, so a
+    // receiver keeping root in one and applying deltas every tick should now and then
+    // clone it into a fresh one and release the old.
+    inline bool apply_delta(compound_tag& root, const tag_view& delta, arena& mem)
+    {
+        bool ok = true;
+        for (auto change : delta.find(delta_remove)) {
+            std::string_view path = change.name();
+            size_t slash = path.rfind('/');
+            compound_tag* parent = find_compound(root, slash == std::string_view::npos ? std::string_view() : path.substr(0, slash));
+            tag* removed = parent != nullptr ? parent->remove(path.substr(slash + 1)) : nullptr;
+            dispose(removed);
+            ok &= removed != nullptr;
+        }
+        for (auto change : delta.find(delta_set)) {
+            std::string_view path = change.name();
+            size_t slash = path.rfind('/');
+            compound_tag* parent = find_compound(root, slash == std::string_view::npos ? std::string_view() : path.substr(0, slash));
+            tag* value = parent != nullptr ? materialize(change, &mem) : nullptr;
+            if (value == nullptr) {
+                ok = false;
+                continue;
+            }
+            value->name = path.substr(slash + 1);
+            dispose(parent->replace(value));
+        }
+        return ok;
+    }
+    // The same for a delta still in memory
+    inline bool apply_delta(compound_tag& root, compound_tag& delta, arena& mem)
+    {
+        std::vector<uint8_t> bytes;
+        vector_sink out(bytes);
+        delta.serialize_to(out);
+        return apply_delta(root, tag_view(bytes.data(), bytes.data() + bytes.size()), mem);
+    }
+#pragma endregion
+#pragma region Compact Trees
+    // One tag of a compact_tree: 16 bytes, with no vtable, name string or allocation
+    struct compact_node {
+        uint8_t type = tag_end;
+        // Element type of a list
+        uint8_t element = tag_end;
+        // Id in the tree's name_table
+        uint32_t name = 0;
+        // Scalars: their bits, in the low bytes. Compounds: first child and child count.
+        // Strings, byte arrays and lists: offset and size (element count for lists) in
+        // the tree's pool.
+        uint64_t value = 0;
+
+        uint32_t first() const { return (uint32_t)(value >> 32); }
+        uint32_t count() const { return (uint32_t) value; }
+    };
+    // A tag tree held as an array of compact_nodes instead of tag objects, for large trees
+    // that are loaded, read and written again. Nodes are laid out breadth first so the
+    // children of a compound sit next to each other; names are interned, and string,
+    // byte array and list payloads are packed into one pool, lists in their encoded form.
+    // Serializes to exactly the bytes tag::serialize writes for the same tree.
+    // Tables aren't held, and fail a load.
+    class compact_tree {
+    public:
+        static const uint32_t npos = ~0u;
+
+        // Replaces the contents with a copy of a tag tree. False, leaving the tree empty,
+        // if it holds a table
+        bool load(tag& root)
+        {
+            clear();
+            std::vector<std::pair<tag*, uint32_t>> queue {{&root, 0}};
+            nodes.emplace_back();
+            for (size_t next = 0; next < queue.size(); next++) {
+                auto [t, at] = queue[next];
+                if (!set_node(at, *t)) {
+                    clear();
+                    return false;
+                }
+                if (!is_compound(t->type()))
+                    continue;
+                auto& children = static_cast<compound_tag&>(*t).children();
+                nodes[at].value = range(nodes.size(), children.size());
+                for (tag* child : children) {
+                    queue.push_back({child, (uint32_t) nodes.size()});
+                    nodes.emplace_back();
+                }
+            }
+            shrink();
+            return true;
+        }
+        // Same, from a serialized tree; compressed compounds are decompressed to load them
+        bool load(const tag_view& root)
+        {
+            clear();
+            if (!root.valid())
+                return false;
+            std::deque<std::vector<uint8_t>> expanded;
+            std::vector<std::pair<tag_view, uint32_t>> queue {{root, 0}};
+            nodes.emplace_back();
+            for (size_t next = 0; next < queue.size(); next++) {
+                auto [view, at] = queue[next];
+                if (!set_node(at, view)) {
+                    clear();
+                    return false;
+                }
+                if (!is_compound(view.type()))
+                    continue;
+                if (view.type() == tag_compressed) {
+                    expanded.emplace_back();
+                    view = view.expand(expanded.back());
+                }
+                uint32_t first = nodes.size();
+                for (auto child : view) {
+                    queue.push_back({child, (uint32_t) nodes.size()});
+                    nodes.emplace_back();
+                }
+                nodes[at].value = range(first, nodes.size() - first);
+            }
+            shrink();
+            return true;
+        }
+        void clear()
+        {
+            nodes.clear();
+            pool.clear();
+            names.clear();
+            packed.clear();
+        }
+
+        // Nodes in the tree, the root being node 0
+        size_t size() const { return nodes.size(); }
+        const compact_node& node(uint32_t i) const { return nodes[i]; }
+        tag_type_t type(uint32_t i) const { return (tag_type_t) nodes[i].type; }
+        std::string_view name(uint32_t i) const { return names.key(nodes[i].name).text; }
+        // First child of a compound with the given name, npos if there is none
+        uint32_t find(uint32_t parent, std::string_view name) const
+        {
+            if (!is_compound(type(parent)))
+                return npos;
+            // Compares ids, as every name in the tree is in the table
+            name_key key = names.find(name);
+            if (key.id == 0)
+                return npos;
+            const compact_node& p = nodes[parent];
+            for (uint32_t i = p.first(); i < p.first() + p.count(); i++)
+                if (nodes[i].name == key.id)
+                    return i;
+            return npos;
+        }
+        // Node at a '/' separated path of names below the root, npos if there is none
+        uint32_t find_path(std::string_view path) const
+        {
+            uint32_t at = nodes.empty() ? npos : 0;
+            while (at != npos && !path.empty()) {
+                size_t slash = path.find('/');
+                at = find(at, path.substr(0, slash));
+                path = slash == std::string_view::npos ? std::string_view() : path.substr(slash + 1);
+            }
+            return at;
+        }
+        // Scalar value of a node, zero if it holds another type
+        template<typename T>
+        T value(uint32_t i) const
+        {
+            T val = 0;
+            if (i < nodes.size() && nodes[i].type == tag_type_of<T>::value)
+                memcpy(&val, &nodes[i].value, sizeof(T));
+            return val;
+        }
+        // Changes a scalar in place, false if the node holds another type
+        template<typename T>
+        bool set(uint32_t i, T val)
+        {
+            if (i >= nodes.size() || nodes[i].type != tag_type_of<T>::value)
+                return false;
+            nodes[i].value = 0;
+            memcpy(&nodes[i].value, &val, sizeof(T));
+            packed.clear();
+            return true;
+        }
+        // Bytes of a string or byte array, or the encoded elements of a list
+        byte_span bytes(uint32_t i) const
+        {
+            tag_type_t t = type(i);
+            if (t != tag_string && t != tag_byte_array && t != tag_list)
+                return {};
+            size_t size = nodes[i].count() * (t == tag_list ? payload_width((tag_type_t) nodes[i].element) : 1);
+            return {pool.data() + nodes[i].first(), size};
+        }
+        std::string_view string(uint32_t i) const
+        {
+            if (type(i) != tag_string)
+                return {};
+            byte_span data = bytes(i);
+            return {reinterpret_cast<const char*>(data.data), data.size};
+        }
+        // Heap bytes held by the nodes, pool and names
+        size_t memory() const
+        {
+            size_t total = nodes.capacity() * sizeof(compact_node) + pool.capacity();
+            for (uint32_t id = 1; id <= names.size(); id++)
+                total += names.key(id).text.size();
+            return total;
+        }
+
+        int serialized_size() const
+        {
+            return nodes.empty() ? 0 : node_size(0);
+        }
+        int serialize(uint8_t* buf, int startidx) const
+        {
+            return nodes.empty() ? 0 : write_node(buf, startidx, 0);
+        }
+        // Like tag::serialize_to, returns the bytes written or -1 if the sink rejected them
+        int serialize_to(sink& out) const
+        {
+            int len = serialized_size();
+            uint8_t* buf = out.acquire(len);
+            if (buf == nullptr)
+                return -1;
+            int written = serialize(buf, 0);
+            assert(written == len);
+            return out.commit(written) ? written : -1;
+        }
+        // Copies the tree back into tag objects, allocated from mem when given
+        tag* to_tag(arena* mem = nullptr) const
+        {
+            return nodes.empty() ? nullptr : make_node_tag(0, mem);
+        }
+    private:
+        // Trees are loaded once, so the slack from growing is given back
+        void shrink()
+        {
+            nodes.shrink_to_fit();
+            pool.shrink_to_fit();
+        }
+        static uint64_t range(uint64_t first, uint64_t count) { return first << 32 | count; }
+        template<typename T>
+        static uint64_t bits(T val)
+        {
+            uint64_t out = 0;
+            memcpy(&out, &val, sizeof(T));
+            return out;
+        }
+        uint64_t add_bytes(const uint8_t* data, size_t size, size_t count)
+        {
+            uint64_t at = pool.size();
+            pool.insert(pool.end(), data, data + size);
+            return range(at, count);
+        }
+        bool set_node(uint32_t at, tag& t)
+        {
+            compact_node& n = nodes[at];
+            n.type = t.type();
+            n.name = names.intern(t.name).id;
+            switch (t.type()) {
+                case tag_string: {
+                    std::string_view val = static_cast<string_tag&>(t).value();
+                    n.value = add_bytes(reinterpret_cast<const uint8_t*>(val.data()), val.size(), val.size());
+                    return true;
+                }
+                case tag_byte_array: {
+                    auto& array = static_cast<byte_array_tag&>(t);
+                    n.value = add_bytes(array.data(), array.size(), array.size());
+                    return true;
+                }
+                case tag_list: {
+                    auto& list = static_cast<packed_list_tag&>(t);
+                    n.element = list.element_type();
+                    size_t at = pool.size();
+                    pool.resize(at + list.count() * payload_width(list.element_type()));
+                    list.write_elements(pool.data(), at);
+                    n.value = range(at, list.count());
+                    return true;
+                }
+                case tag_compound: case tag_compressed:
+                    return true;
+                default:
+                    if (payload_width(t.type()) < 0)
+                        return false;
+                    with_scalar_type(t.type(), [&](auto v) {
+                        typedef decltype(v) T;
+                        n.value = bits(static_cast<typename scalar_tag_of<T>::type&>(t).value());
+                    });
+                    return true;
+            }
+        }
+        bool set_node(uint32_t at, const tag_view& view)
+        {
+            compact_node& n = nodes[at];
+            n.type = view.type();
+            n.name = names.intern(view.name()).id;
+            switch (view.type()) {
+                case tag_uint8:  n.value = bits(view.as_uint8());  return true;
+                case tag_uint16: n.value = bits(view.as_uint16()); return true;
+                case tag_uint32: n.value = bits(view.as_uint32()); return true;
+                case tag_uint64: n.value = bits(view.as_uint64()); return true;
+                case tag_sint8:  n.value = bits(view.as_sint8());  return true;
+                case tag_sint16: n.value = bits(view.as_sint16()); return true;
+                case tag_sint32: n.value = bits(view.as_sint32()); return true;
+                case tag_sint64: n.value = bits(view.as_sint64()); return true;
+                case tag_float:  n.value = bits(view.as_float());  return true;
+                case tag_double: n.value = bits(view.as_double()); return true;
+                case tag_string: case tag_byte_array: {
+                    byte_span data = view.type() == tag_string
+                        ? byte_span{reinterpret_cast<const uint8_t*>(view.as_string().data()), view.as_string().size()}
+                        : view.as_bytes();
+                    n.value = add_bytes(data.data, data.size, data.size);
+                    return true;
+                }
+                case tag_list: {
+                    byte_span data = view.list_bytes();
+                    n.element = view.list_type();
+                    n.value = add_bytes(data.data, data.size, view.list_size());
+                    return true;
+                }
+                case tag_compound: case tag_compressed:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+        // Children of a compressed compound as one block, compressed once and kept
+        // until the tree changes
+        const packed_block& node_block(uint32_t i) const
+        {
+            auto found = packed.find(i);
+            if (found != packed.end())
+                return found->second;
+            const compact_node& n = nodes[i];
+            int raw_size = sizeof(uint8_t);
+            for (uint32_t child = n.first(); child < n.first() + n.count(); child++)
+                raw_size += node_size(child);
+            std::vector<uint8_t> raw(raw_size);
+            int offset = 0;
+            for (uint32_t child = n.first(); child < n.first() + n.count(); child++)
+                offset += write_node(raw.data(), offset, child);
+            raw[offset] = tag_end;
+            return packed[i] = pack_block(raw.data(), raw_size);
+        }
+        int node_size(uint32_t i) const
+        {
+            const compact_node& n = nodes[i];
+            int size = sizeof(uint8_t) + string_size(names.key(n.name).text);
+            switch (n.type) {
+                case tag_string: case tag_byte_array:
+                    return size + sizeof(uint32_t) + n.count();
+                case tag_list:
+                    return size + sizeof(uint8_t) + sizeof(uint32_t) + bytes(i).size;
+                case tag_compressed:
+                    return size + 2 * sizeof(uint32_t) + node_block(i).bytes.size();
+                case tag_compound:
+                    for (uint32_t child = n.first(); child < n.first() + n.count(); child++)
+                        size += node_size(child);
+                    return size + sizeof(uint8_t);
+                default:
+                    return size + payload_width((tag_type_t) n.type);
+            }
+        }
+        int write_node(uint8_t* buf, int startidx, uint32_t i) const
+        {
+            const compact_node& n = nodes[i];
+            int offset = startidx;
+            offset += tag::write_type(buf, offset, (tag_type_t) n.type);
+            offset += write_string(buf, offset, names.key(n.name).text);
+            switch (n.type) {
+                case tag_string: case tag_byte_array: {
+                    byte_span data = bytes(i);
+                    offset += write_string(buf, offset, {reinterpret_cast<const char*>(data.data), data.size});
+                    break;
+                }
+                case tag_list: {
+                    byte_span data = bytes(i);
+                    offset += write_uint8(buf, offset, n.element);
+                    offset += write_uint32(buf, offset, n.count());
+                    memcpy(buf + offset, data.data, data.size);
+                    offset += data.size;
+                    break;
+                }
+                case tag_compressed: {
+                    const packed_block& packed = node_block(i);
+                    offset += write_uint32(buf, offset, packed.raw_size);
+                    offset += write_uint32(buf, offset, packed.bytes.size());
+                    memcpy(buf + offset, packed.bytes.data(), packed.bytes.size());
+                    offset += packed.bytes.size();
+                    break;
+                }
+                case tag_compound:
+                    for (uint32_t child = n.first(); child < n.first() + n.count(); child++)
+                        offset += write_node(buf, offset, child);
+                    buf[offset] = tag_end;
+                    offset++;
+                    break;
+                default:
+                    // Each scalar encoded as its write_* would
+                    with_scalar_type((tag_type_t) n.type, [&](auto v) {
+                        memcpy(&v, &n.value, sizeof(v));
+                        offset += write_array(buf, offset, &v, 1);
+                    });
+                    break;
+            }
+            return offset - startidx;
+        }
+        tag* make_node_tag(uint32_t i, arena* mem) const
+        {
+            const compact_node& n = nodes[i];
+            std::string_view node_name = name(i);
+            switch (n.type) {
+                case tag_string:
+                    return make_tag<string_tag>(mem, node_name, string(i));
+                case tag_byte_array:
+                    return make_tag<byte_array_tag>(mem, node_name, bytes(i).data, bytes(i).size);
+                case tag_list: {
+                    tag* list = nullptr;
+                    with_scalar_type((tag_type_t) n.element, [&](auto v) {
+                        auto typed = make_tag<list_tag<decltype(v)>>(mem, node_name);
+                        typed->values().resize(n.count());
+                        read_array(bytes(i).data, 0, typed->values().data(), n.count());
+                        list = typed;
+                    });
+                    return list;
+                }
+                case tag_compound: case tag_compressed: {
+                    compound_tag* compound = n.type == tag_compound
+                        ? make_tag<compound_tag>(mem, node_name)
+                        : make_tag<compressed_compound_tag>(mem, node_name);
+                    for (uint32_t child = n.first(); child < n.first() + n.count(); child++)
+                        compound->add(make_node_tag(child, mem));
+                    return compound;
+                }
+                default: {
+                    tag* scalar = nullptr;
+                    with_scalar_type((tag_type_t) n.type, [&](auto v) {
+                        memcpy(&v, &n.value, sizeof(v));
+                        scalar = make_tag<typename scalar_tag_of<decltype(v)>::type>(mem, node_name, v);
+                    });
+                    return scalar;
+                }
+            }
+        }
+
+        std::vector<compact_node> nodes;
+        std::vector<uint8_t> pool;
+        name_table names;
+        mutable std::unordered_map<uint32_t, packed_block> packed;
+    };
+#pragma endregion
+#pragma region Streaming Reader
+    // Receives the events of a stream_reader, in document order
+    // Names and pieces are only valid for the duration of the call.
+    class stream_handler {
+    public:
+        virtual ~stream_handler() {}
+        virtual void begin_compound(std::string_view name) {}
+        virtual void end_compound() {}
+        // Any fixed width tag, decoded through the usual tag_view accessors
+        virtual void value(const tag_view& tag) {}
+        // Strings are handed over in pieces as they arrive, never buffered whole
+        virtual void begin_string(std::string_view name, uint32_t length) {}
+        virtual void string_data(std::string_view piece) {}
+        virtual void end_string() {}
+        // Byte arrays (element type tag_uint8) and packed lists, also handed over in pieces
+        // Pieces are the encoded bytes and may split an element; decode them with read_array.
+        virtual void begin_array(std::string_view name, tag_type_t element_type, uint32_t count) {}
+        virtual void array_data(const uint8_t* piece, size_t len) {}
+        virtual void end_array() {}
+        // Compressed compounds are passed through undecoded, as array_data pieces of the
+        // block followed by end_array; lz_decompress the gathered block to raw_size bytes.
+        virtual void begin_compressed(std::string_view name, uint32_t raw_size, uint32_t compressed_size) {}
+    };
+    // Incremental parser for a stream of serialized tags.
+    // Input may be fed in chunks of any size; a tag, name or integer split
+    // across chunks is resumed where it left off. Memory use is bounded by
+    // the longest tag name, whatever the size of the document. Tables are not
+    // understood, and fail the stream.
+    class stream_reader {
+    public:
+        stream_reader(stream_handler& handler, uint32_t max_name = 64 * 1024)
+            : handler(handler), max_name(max_name) {}
+
+        // Parses the next chunk of input, returns false once the stream is malformed
+        bool feed(const uint8_t* data, size_t len)
+        {
+            const uint8_t* pos = data;
+            const uint8_t* end = data + len;
+            while (pos < end && state != st_error) {
+                switch (state) {
+                    case st_type: {
+                        record.clear();
+                        auto type = (tag_type_t) *pos;
+                        if (type == tag_end) {
+                            pos++;
+                            if (depth == 0) {
+                                state = st_error;
+                                break;
+                            }
+                            depth--;
+                            handler.end_compound();
+                            break;
+                        }
+                        if (type != tag_compound && type != tag_string && type != tag_byte_array
+                            && type != tag_list && type != tag_compressed && payload_width(type) < 0) {
+                            state = st_error;
+                            break;
+                        }
+                        record.push_back(*pos++);
+                        state = st_name_len;
+                        break;
+                    }
+                    case st_name_len:
+                        if (!fill(pos, end, header_size))
+                            break;
+                        name_len = read_uint32(record.data(), 1);
+                        state = name_len > max_name ? st_error : st_name;
+                        break;
+                    case st_name:
+                        if (!fill(pos, end, header_size + name_len))
+                            break;
+                        begin_payload();
+                        break;
+                    case st_payload:
+                        if (!fill(pos, end, header_size + name_len + payload_width(type())))
+                            break;
+                        handler.value(tag_view(record.data(), record.data() + record.size()));
+                        state = st_type;
+                        break;
+                    case st_length:
+                        if (!fill(pos, end, header_size + name_len + length_size()))
+                            break;
+                        begin_data();
+                        break;
+                    case st_data: {
+                        // Passed through straight from the caller's chunk
+                        size_t piece = std::min<uint64_t>(remaining, end - pos);
+                        if (type() == tag_string)
+                            handler.string_data({reinterpret_cast<const char*>(pos), piece});
+                        else
+                            handler.array_data(pos, piece);
+                        pos += piece;
+                        remaining -= piece;
+                        if (remaining == 0)
+                            end_data();
+                        break;
+                    }
+                    case st_error:
+                        break;
+                }
+            }
+            return state != st_error;
+        }
+        // True if everything fed so far forms complete top level tags
+        bool finished() const { return state == st_type && depth == 0; }
+        bool failed() const { return state == st_error; }
+    private:
+        enum state_t { st_type, st_name_len, st_name, st_payload, st_length, st_data, st_error };
+        // Type byte plus name length
+        static const size_t header_size = sizeof(uint8_t) + sizeof(uint32_t);
+
+        // Gathers the current tag into record up to target bytes, returns true once it's there
+        bool fill(const uint8_t*& pos, const uint8_t* end, size_t target)
+        {
+            size_t got = std::min<size_t>(target - record.size(), end - pos);
+            record.insert(record.end(), pos, pos + got);
+            pos += got;
+            return record.size() == target;
+        }
+        void begin_payload()
+        {
+            if (type() == tag_compound) {
+                depth++;
+                handler.begin_compound(name());
+                state = st_type;
+            } else if (type() == tag_string || type() == tag_byte_array || type() == tag_list
+                || type() == tag_compressed) {
+                state = st_length;
+            } else {
+                state = st_payload;
+            }
+        }
+        // Length prefix of a variable size payload; lists also carry their element type
+        // and compressed compounds their raw size
+        size_t length_size() const
+        {
+            if (type() == tag_compressed)
+                return 2 * sizeof(uint32_t);
+            return type() == tag_list ? sizeof(uint8_t) + sizeof(uint32_t) : sizeof(uint32_t);
+        }
+        void begin_data()
+        {
+            const uint8_t* length = record.data() + header_size + name_len;
+            if (type() == tag_string) {
+                remaining = read_uint32(length, 0);
+                handler.begin_string(name(), remaining);
+            } else if (type() == tag_byte_array) {
+                remaining = read_uint32(length, 0);
+                handler.begin_array(name(), tag_uint8, remaining);
+            } else if (type() == tag_compressed) {
+                remaining = read_uint32(length, sizeof(uint32_t));
+                handler.begin_compressed(name(), read_uint32(length, 0), remaining);
+            } else {
+                auto element_type = (tag_type_t) length[0];
+                uint32_t count = read_uint32(length, 1);
+                if (payload_width(element_type) < 0) {
+                    state = st_error;
+                    return;
+                }
+                remaining = (uint64_t) count * payload_width(element_type);
+                handler.begin_array(name(), element_type, count);
+            }
+            state = st_data;
+            if (remaining == 0)
+                end_data();
+        }
+        void end_data()
+        {
+            if (type() == tag_string)
+                handler.end_string();
+            else
+                handler.end_array();
+            state = st_type;
+        }
+        tag_type_t type() const { return (tag_type_t) record[0]; }
+        std::string_view name() const
+        {
+            return {reinterpret_cast<const char*>(record.data() + header_size), name_len};
+        }
+
+        stream_handler& handler;
+        uint32_t max_name;
+        state_t state = st_type;
+        std::vector<uint8_t> record;
+        uint32_t name_len = 0;
+        uint64_t remaining = 0;
+        int depth = 0;
+    };
+    // Reads a descriptor (file, pipe or socket) to EOF in fixed size chunks, feeding a handler
+    // Returns true if the input ended on a tag boundary with no errors.
+    inline bool read_stream(int fd, stream_handler& handler, size_t chunk_size = 64 * 1024)
+    {
+        stream_reader reader(handler);
+        std::vector<uint8_t> chunk(chunk_size);
+        while (true) {
+            ssize_t n = ::read(fd, chunk.data(), chunk.size());
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return false;
+            if (n == 0)
+                return reader.finished();
+            if (!reader.feed(chunk.data(), n))
+                return false;
+        }
+    }
+#pragma endregion
+#pragma region Framing
+    // Every message on a connection is one frame:
+    //     u32 body length, version byte, flags byte, options byte, zero byte, body
+    // The body is a root tag as tag::serialize writes it. Flags are the sender's own;
+    // options (frame_options) say what else the frame carries.
+    static const uint8_t frame_version = 1;
+    static const int frame_header_size = 2 * sizeof(uint32_t);
+
+    enum frame_options : uint8_t {
+        // The body is followed by its CRC32C
+        frame_checksum = 1 << 0,
+    };
+
+    inline int write_frame_header(uint8_t* buf, int index, uint32_t body_len, uint8_t flags, uint8_t options = 0)
+    {
+        int offset = index;
+        offset += write_uint32(buf, offset, body_len);
+        offset += write_uint8(buf, offset, frame_version);
+        offset += write_uint8(buf, offset, flags);
+        offset += write_uint8(buf, offset, options);
+        offset += write_uint8(buf, offset, 0);
+        return offset - index;
+    }
+    // Size of the whole frame at the start of data, header and checksum included.
+    // 0 while more bytes are needed, -1 for a bad header or a body over max_body.
+    inline int64_t frame_size(const uint8_t* data, size_t avail, uint32_t max_body)
+    {
+        if (avail < (size_t) frame_header_size)
+            return 0;
+        uint32_t body_len = read_uint32(data, 0);
+        if (data[4] != frame_version || (data[6] & ~frame_checksum) || body_len > max_body)
+            return -1;
+        int64_t size = (int64_t) frame_header_size + body_len;
+        if (data[6] & frame_checksum)
+            size += sizeof(uint32_t);
+        return avail >= (size_t) size ? size : 0;
+    }
+    // Queues trees as frames and sends them with writev.
+    // Headers and small tags are packed into one staging buffer; the payloads of
+    // strings and byte arrays of inline_limit bytes or more are sent from where
+    // they live, so a queued tree must not change until flush() has sent it.
+    class frame_writer {
+    public:
+        // With checksums, every frame carries a CRC32C of its body for the reader to check
+        frame_writer(size_t inline_limit = 1024, bool checksums = false)
+            : inline_limit(inline_limit), checksums(checksums) {}
+
+        // Adds root as one frame; any number of frames can wait for the next flush()
+        void add(tag& root, uint8_t flags = 0)
+        {
+            size_t header = staging.size();
+            size_t first = pieces.size();
+            staging.resize(header + frame_header_size);
+            size_t before = queued;
+            queued += frame_header_size;
+            gather(root);
+            close_staged();
+            uint32_t body_len = queued - before - frame_header_size;
+            write_frame_header(staging.data(), header, body_len, flags, checksums ? frame_checksum : 0);
+            if (checksums) {
+                // Over the frame's pieces, less the header at the front of the first
+                uint32_t crc = 0;
+                size_t skip = frame_header_size;
+                for (size_t i = first; i < pieces.size(); i++) {
+                    crc = crc32c(data_of(pieces[i]) + skip, pieces[i].len - skip, crc);
+                    skip = 0;
+                }
+                write_uint32(stage(sizeof(uint32_t)), 0, crc);
+                close_staged();
+            }
+        }
+        // Sends everything queued, in as few writev calls as the iovec limit allows.
+        // On a non-blocking descriptor it stops early once the socket is full, keeping
+        // the rest for the next call. Returns false on a write error, dropping the queue.
+        bool flush(int fd)
+        {
+            while (next < pieces.size()) {
+                iovec iov[max_iov];
+                int count = 0;
+                for (size_t i = next; i < pieces.size() && count < max_iov; i++, count++) {
+                    size_t skip = i == next ? next_offset : 0;
+                    iov[count].iov_base = const_cast<uint8_t*>(data_of(pieces[i]) + skip);
+                    iov[count].iov_len = pieces[i].len - skip;
+                }
+                // Sockets go through sendmsg, so a peer that has gone away is a write
+                // error rather than a SIGPIPE
+                msghdr msg {};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = count;
+                ssize_t n = to_socket ? ::sendmsg(fd, &msg, MSG_NOSIGNAL) : ::writev(fd, iov, count);
+                if (n < 0 && errno == ENOTSOCK && to_socket) {
+                    to_socket = false;
+                    continue;
+                }
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    return true;
+                if (n < 0) {
+                    clear();
+                    return false;
+                }
+                advance(n);
+            }
+            clear();
+            return true;
+        }
+        // Queues and sends a single frame
+        bool send(int fd, tag& root, uint8_t flags = 0)
+        {
+            add(root, flags);
+            return flush(fd);
+        }
+        // Bytes added but not yet sent
+        size_t pending() const { return queued - sent; }
+    private:
+        // A run of the staging buffer (data == nullptr) or a payload sent in place
+        struct piece {
+            const uint8_t* data;
+            size_t offset;
+            size_t len;
+        };
+        static const int max_iov = 256;
+
+        void gather(tag& t)
+        {
+            size_t len;
+            const uint8_t* data = nullptr;
+            if (t.type() == tag_string) {
+                std::string_view value = static_cast<string_tag&>(t).value();
+                data = reinterpret_cast<const uint8_t*>(value.data());
+                len = value.size();
+            } else if (t.type() == tag_byte_array) {
+                data = static_cast<byte_array_tag&>(t).data();
+                len = static_cast<byte_array_tag&>(t).size();
+            }
+            if (t.type() == tag_compound) {
+                uint8_t* buf = stage(sizeof(uint8_t) + t.name_size());
+                buf += tag::write_type(buf, 0, tag_compound);
+                t.write_name(buf, 0);
+                for (tag* child : static_cast<compound_tag&>(t).children())
+                    gather(*child);
+                write_uint8(stage(sizeof(uint8_t)), 0, tag_end);
+            } else if (data != nullptr && len >= inline_limit) {
+                uint8_t* buf = stage(sizeof(uint8_t) + t.name_size() + sizeof(uint32_t));
+                buf += tag::write_type(buf, 0, t.type());
+                buf += t.write_name(buf, 0);
+                write_uint32(buf, 0, len);
+                close_staged();
+                pieces.push_back({data, 0, len});
+                queued += len;
+            } else {
+                packed_blocks blocks;
+                compressed_compound_tag::pack_all(t, blocks);
+                t.serialize_with(stage(t.serialized_size_with(&blocks)), 0, &blocks);
+            }
+        }
+        // Room for len more bytes at the end of the staging buffer
+        uint8_t* stage(size_t len)
+        {
+            size_t at = staging.size();
+            staging.resize(at + len);
+            queued += len;
+            return staging.data() + at;
+        }
+        // Ends the current run of staged bytes, before a payload sent in place
+        void close_staged()
+        {
+            if (staging.size() > staged)
+                pieces.push_back({nullptr, staged, staging.size() - staged});
+            staged = staging.size();
+        }
+        const uint8_t* data_of(const piece& p) const
+        {
+            return p.data != nullptr ? p.data : staging.data() + p.offset;
+        }
+        void advance(size_t n)
+        {
+            sent += n;
+            n += next_offset;
+            while (next < pieces.size() && n >= pieces[next].len)
+                n -= pieces[next++].len;
+            next_offset = n;
+        }
+        void clear()
+        {
+            staging.clear();
+            pieces.clear();
+            staged = next = next_offset = queued = sent = 0;
+        }
+
+        size_t inline_limit;
+        bool checksums;
+        bool to_socket = true;
+        std::vector<uint8_t> staging;
+        std::vector<piece> pieces;
+        size_t staged = 0;
+        size_t next = 0;
+        size_t next_offset = 0;
+        size_t queued = 0;
+        size_t sent = 0;
+    };
+    // Reads frames from a descriptor into one buffer that is reused from frame to frame.
+    // Each read asks for as much as the buffer has room for, so frames sent back to
+    // back usually arrive together and the following receive() needs no syscall.
+    class frame_reader {
+    public:
+        frame_reader(uint32_t max_body = 64 << 20, size_t read_size = 64 * 1024)
+            : max_body(max_body), read_size(read_size) {}
+
+        // Waits for the next frame. False at end of input, on a read error or a bad frame.
+        // The previous frame's body is invalidated.
+        bool receive(int fd)
+        {
+            while (!next()) {
+                if (bad)
+                    return false;
+                ssize_t n = fill(fd);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+            }
+            return true;
+        }
+        // Moves on to the next frame already read, if it is complete.
+        // For non-blocking descriptors, alternate with fill() as they become readable.
+        bool next()
+        {
+            start += current;
+            current = 0;
+            int64_t size = frame_size(buffer.data() + start, filled - start, max_body);
+            bad = size < 0;
+            current = size > 0 ? size : 0;
+            if (current != 0 && (buffer[start + 6] & frame_checksum)) {
+                byte_span bytes = body();
+                if (read_uint32(bytes.data + bytes.size, 0) != crc32c(bytes.data, bytes.size)) {
+                    bad = true;
+                    current = 0;
+                }
+            }
+            return current != 0;
+        }
+        // Reads once, after the frame in progress, growing the buffer to fit the whole of it
+        // Returns what read() returned.
+        ssize_t fill(int fd)
+        {
+            // Move the partial frame to the front
+            size_t avail = filled - start;
+            if (start > 0)
+                memmove(buffer.data(), buffer.data() + start, avail);
+            start = 0;
+            filled = avail;
+            size_t want = filled + read_size;
+            if (avail >= (size_t) frame_header_size)
+                want = std::max<size_t>(want, frame_header_size + read_uint32(buffer.data(), 0) + sizeof(uint32_t));
+            if (buffer.size() < want)
+                buffer.resize(want);
+            ssize_t n = ::read(fd, buffer.data() + filled, buffer.size() - filled);
+            if (n > 0)
+                filled += n;
+            return n;
+        }
+        // True once a frame with a bad header or checksum has been seen
+        bool failed() const { return bad; }
+        byte_span body() const
+        {
+            if (current == 0)
+                return {};
+            return {buffer.data() + start + frame_header_size, read_uint32(buffer.data(), start)};
+        }
+        uint8_t flags() const { return current != 0 ? buffer[start + 5] : 0; }
+        tag_view root() const
+        {
+            byte_span bytes = body();
+            return tag_view(bytes.data, bytes.data + bytes.size);
+        }
+    private:
+        uint32_t max_body;
+        size_t read_size;
+        std::vector<uint8_t> buffer;
+        size_t start = 0;
+        size_t filled = 0;
+        // Size of the frame last returned, header included
+        size_t current = 0;
+        bool bad = false;
+    };
+#pragma endregion
+#pragma region Endpoints
+    class endpoint;
+    // Callbacks of an endpoint. A connection is known by its descriptor until on_close.
+    class endpoint_handler {
+    public:
+        virtual ~endpoint_handler() {}
+        virtual void on_open(endpoint& ep, int conn) {}
+        // One received frame, valid for the duration of the call; replies can be sent from here
+        virtual void on_frame(endpoint& ep, int conn, const tag_view& root, uint8_t flags) {}
+        virtual void on_close(endpoint& ep, int conn) {}
+    };
+    // Single threaded epoll loop over any number of framed connections, accepted or opened.
+    // Frames are dispatched as soon as they are complete, however many arrive in one read,
+    // so peers can pipeline requests without waiting for replies. Frames sent are queued
+    // (copied, so the tree can go at once) and written at the end of each poll(), all of a
+    // connection's frames in one gather write, waiting for EPOLLOUT only when a socket is full.
+    class endpoint {
+    public:
+        endpoint(endpoint_handler& handler, uint32_t max_body = 64 << 20)
+            : handler(handler), max_body(max_body), epfd(epoll_create1(EPOLL_CLOEXEC)) {}
+        ~endpoint()
+        {
+            for (auto& conn : conns)
+                ::close(conn.first);
+            if (listener >= 0)
+                ::close(listener);
+            ::close(epfd);
+        }
+        endpoint(const endpoint&) = delete;
+        endpoint& operator=(const endpoint&) = delete;
+
+        // Accepts TCP connections on address:port, port 0 picking a free one
+        // Returns the port listened on, or -1
+        int listen(const char* address, uint16_t port)
+        {
+            sockaddr_in addr {};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            if (listener >= 0 || inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+                return -1;
+            int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int on = 1;
+            socklen_t len = sizeof(addr);
+            epoll_event ev {};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+                || ::bind(fd, (sockaddr*) &addr, sizeof(addr)) != 0 || ::listen(fd, SOMAXCONN) != 0
+                || getsockname(fd, (sockaddr*) &addr, &len) != 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+                if (fd >= 0)
+                    ::close(fd);
+                return -1;
+            }
+            listener = fd;
+            return ntohs(addr.sin_port);
+        }
+        // Connects to a TCP server, waiting for the connection to be made
+        // Returns the connection, or -1
+        int connect(const char* address, uint16_t port)
+        {
+            sockaddr_in addr {};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            if (inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+                return -1;
+            int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0)
+                return -1;
+            if (::connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+                ::close(fd);
+                return -1;
+            }
+            return adopt(fd);
+        }
+        // Takes over a connected stream socket (or socketpair end), making it non-blocking
+        // Returns the connection, or -1 with fd left open
+        int adopt(int fd)
+        {
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            epoll_event ev {};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            int fl = fcntl(fd, F_GETFL);
+            if (fl < 0 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) != 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+                return -1;
+            conns.emplace(fd, std::make_unique<connection>(max_body));
+            handler.on_open(*this, fd);
+            return fd;
+        }
+        // Queues root for conn, to be written by the current or next poll()
+        // False if the connection is closed or closing.
+        bool send(int conn, tag& root, uint8_t flags = 0)
+        {
+            connection* c = find(conn);
+            if (c == nullptr)
+                return false;
+            c->writer.add(root, flags);
+            mark_dirty(conn, *c);
+            return true;
+        }
+        // Drops the connection once the current or next poll() is done dispatching
+        void close(int conn)
+        {
+            connection* c = find(conn);
+            if (c == nullptr)
+                return;
+            c->closing = true;
+            dead.push_back(conn);
+        }
+        // Waits up to timeout_ms (-1 for ever) for activity, handles it and writes what
+        // has been queued. Returns the number of events handled, or -1 on error.
+        int poll(int timeout_ms)
+        {
+            epoll_event events[max_events];
+            int n = dirty.empty() && dead.empty() ? epoll_wait(epfd, events, max_events, timeout_ms)
+                                                  : epoll_wait(epfd, events, max_events, 0);
+            if (n < 0 && errno != EINTR)
+                return -1;
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == listener) {
+                    accept_all();
+                    continue;
+                }
+                connection* c = find(fd);
+                if (c == nullptr)
+                    continue;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    receive(fd, *c);
+                if ((events[i].events & EPOLLOUT) && !c->closing)
+                    mark_dirty(fd, *c);
+            }
+            flush_dirty();
+            reap();
+            return std::max(n, 0);
+        }
+        size_t connections() const { return conns.size(); }
+    private:
+        struct connection {
+            connection(uint32_t max_body) : reader(max_body, 16 * 1024), writer(SIZE_MAX) {}
+            frame_reader reader;
+            frame_writer writer;
+            // Registered for EPOLLOUT, waiting for a full socket to drain
+            bool waiting = false;
+            bool dirty = false;
+            bool closing = false;
+        };
+        static const int max_events = 256;
+
+        connection* find(int conn)
+        {
+            auto found = conns.find(conn);
+            return found != conns.end() && !found->second->closing ? found->second.get() : nullptr;
+        }
+        void mark_dirty(int conn, connection& c)
+        {
+            if (!c.dirty)
+                dirty.push_back(conn);
+            c.dirty = true;
+        }
+        void accept_all()
+        {
+            while (true) {
+                int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0 && errno == EINTR)
+                    continue;
+                if (fd < 0)
+                    return;
+                if (adopt(fd) < 0)
+                    ::close(fd);
+            }
+        }
+        // One read per readiness, so a busy peer can't starve the others
+        void receive(int fd, connection& c)
+        {
+            ssize_t n = c.reader.fill(fd);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                return;
+            if (n <= 0) {
+                close(fd);
+                return;
+            }
+            // Replies and closes from the handler land in dirty and dead, so c stays put
+            while (!c.closing && c.reader.next())
+                handler.on_frame(*this, fd, c.reader.root(), c.reader.flags());
+            if (c.reader.failed())
+                close(fd);
+        }
+        void flush_dirty()
+        {
+            for (int fd : dirty) {
+                auto found = conns.find(fd);
+                if (found == conns.end())
+                    continue;
+                connection& c = *found->second;
+                c.dirty = false;
+                if (c.closing)
+                    continue;
+                if (!c.writer.flush(fd)) {
+                    close(fd);
+                    continue;
+                }
+                bool wait = c.writer.pending() > 0;
+                if (wait != c.waiting) {
+                    epoll_event ev {};
+                    ev.events = wait ? EPOLLIN | EPOLLOUT : EPOLLIN;
+                    ev.data.fd = fd;
+                    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+                    c.waiting = wait;
+                }
+            }
+            dirty.clear();
+        }
+        void reap()
+        {
+            // on_close may close others in turn
+            for (size_t i = 0; i < dead.size(); i++) {
+                int fd = dead[i];
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+                ::close(fd);
+                conns.erase(fd);
+                handler.on_close(*this, fd);
+            }
+            dead.clear();
+        }
+
+        endpoint_handler& handler;
+        uint32_t max_body;
+        int epfd;
+        int listener = -1;
+        // Behind pointers so connections stay put while handlers open new ones
+        std::unordered_map<int, std::unique_ptr<connection>> conns;
+        std::vector<int> dirty;
+        std::vector<int> dead;
+    };
+#pragma endregion
+#pragma region Schemas
+    // Compile-time description of a plain struct, for hot messages whose shape is known.
+    // A described struct serializes byte for byte like the equivalent compound_tag tree,
+    // with no tags, allocation or virtual calls; each field's type byte and name are a
+    // constant copied with one memcpy.
+    //
+    //     struct pos { float x, y, angle; };
+    //     template<> struct metabinary::schema<pos> {
+    //         static constexpr auto fields = std::make_tuple(
+    //             metabinary::field("x", &pos::x),
+    //             metabinary::field("y", &pos::y),
+    //             metabinary::field("angle", &pos::angle));
+    //     };
+    //
+    // Fields may be scalars, std::string, or other described structs (nested compounds).
+    template<typename T> struct schema;
+
+    template<typename T, typename = void>
+    struct has_schema : std::false_type {};
+    template<typename T>
+    struct has_schema<T, std::void_t<decltype(schema<T>::fields)>> : std::true_type {};
+
+    template<typename T>
+    constexpr tag_type_t field_type()
+    {
+        if constexpr (has_schema<T>::value)
+            return tag_compound;
+        else if constexpr (std::is_same<T, std::string>::value)
+            return tag_string;
+        else
+            return tag_type_of<T>::value;
+    }
+    template<typename Class, typename T, size_t N>
+    struct field_t {
+        // Type byte, name length and name, as tag::serialize writes them
+        std::array<uint8_t, sizeof(uint8_t) + sizeof(uint32_t) + N> header;
+        T Class::* member;
+
+        std::string_view name() const
+        {
+            return {reinterpret_cast<const char*>(header.data()) + sizeof(uint8_t) + sizeof(uint32_t), N};
+        }
+    };
+    template<typename Class, typename T, size_t N>
+    constexpr field_t<Class, T, N - 1> field(const char (&name)[N], T Class::* member)
+    {
+        field_t<Class, T, N - 1> f {{}, member};
+        f.header[0] = field_type<T>();
+        // Name length in network order
+        f.header[1] = (uint8_t)((N - 1) >> 24);
+        f.header[2] = (uint8_t)((N - 1) >> 16);
+        f.header[3] = (uint8_t)((N - 1) >> 8);
+        f.header[4] = (uint8_t)(N - 1);
+        for (size_t i = 0; i + 1 < N; i++)
+            f.header[sizeof(uint8_t) + sizeof(uint32_t) + i] = (uint8_t) name[i];
+        return f;
+    }
+
+    template<typename T>
+    inline int record_fields_size(const T& value);
+    template<typename T>
+    inline int write_record_fields(uint8_t* buf, int index, const T& value);
+    template<typename T>
+    inline bool read_record(const tag_view& view, T& out);
+
+    template<typename T>
+    inline int field_payload_size(const T& val)
+    {
+        if constexpr (has_schema<T>::value)
+            return record_fields_size(val);
+        else if constexpr (std::is_same<T, std::string>::value)
+            return string_size(val);
+        else
+            return sizeof(T);
+    }
+    template<typename T>
+    inline int write_field_payload(uint8_t* buf, int index, const T& val)
+    {
+        if constexpr (has_schema<T>::value)
+            return write_record_fields(buf, index, val);
+        else if constexpr (std::is_same<T, std::string>::value)
+            return write_string(buf, index, val);
+        else if constexpr (std::is_same<T, uint8_t>::value)  return write_uint8(buf, index, val);
+        else if constexpr (std::is_same<T, uint16_t>::value) return write_uint16(buf, index, val);
+        else if constexpr (std::is_same<T, uint32_t>::value) return write_uint32(buf, index, val);
+        else if constexpr (std::is_same<T, uint64_t>::value) return write_uint64(buf, index, val);
+        else if constexpr (std::is_same<T, int8_t>::value)   return write_int8(buf, index, val);
+        else if constexpr (std::is_same<T, int16_t>::value)  return write_int16(buf, index, val);
+        else if constexpr (std::is_same<T, int32_t>::value)  return write_int32(buf, index, val);
+        else if constexpr (std::is_same<T, int64_t>::value)  return write_int64(buf, index, val);
+        else if constexpr (std::is_same<T, float>::value)    return write_float(buf, index, val);
+        else                                                 return write_double(buf, index, val);
+    }
+    // Reads a payload whose header has already been matched; false if it runs past end
+    template<typename T>
+    inline bool read_field_payload(const uint8_t*& pos, const uint8_t* end, T& out);
+    template<typename T>
+    inline bool read_record_fields(const uint8_t*& pos, const uint8_t* end, T& out)
+    {
+        bool ok = true;
+        std::apply([&](const auto&... f) {
+            // Stops at the first field that isn't where the schema expects it
+            ((ok = ok && (size_t)(end - pos) >= f.header.size()
+                      && memcmp(pos, f.header.data(), f.header.size()) == 0
+                      && read_field_payload(pos += f.header.size(), end, out.*(f.member))), ...);
+        }, schema<T>::fields);
+        if (!ok || pos >= end || *pos != tag_end)
+            return false;
+        pos++;
+        return true;
+    }
+    template<typename T>
+    inline bool read_field_payload(const uint8_t*& pos, const uint8_t* end, T& out)
+    {
+        if constexpr (has_schema<T>::value) {
+            return read_record_fields(pos, end, out);
+        } else if constexpr (std::is_same<T, std::string>::value) {
+            if (end - pos < (long) sizeof(uint32_t))
+                return false;
+            uint32_t len = read_uint32(pos, 0);
+            if ((size_t)(end - pos) - sizeof(uint32_t) < len)
+                return false;
+            out.assign(reinterpret_cast<const char*>(pos) + sizeof(uint32_t), len);
+            pos += sizeof(uint32_t) + len;
+            return true;
+        } else {
+            if (end - pos < (long) sizeof(T))
+                return false;
+            read_array(pos, 0, &out, 1);
+            pos += sizeof(T);
+            return true;
+        }
+    }
+    // Decodes one field from a tag found by name, leaving out untouched on a type mismatch
+    template<typename T>
+    inline void read_field_view(const tag_view& view, T& out)
+    {
+        if (view.type() != field_type<T>())
+            return;
+        if constexpr (has_schema<T>::value)
+            read_record(view, out);
+        else if constexpr (std::is_same<T, std::string>::value) out = view.as_string();
+        else if constexpr (std::is_same<T, uint8_t>::value)  out = view.as_uint8();
+        else if constexpr (std::is_same<T, uint16_t>::value) out = view.as_uint16();
+        else if constexpr (std::is_same<T, uint32_t>::value) out = view.as_uint32();
+        else if constexpr (std::is_same<T, uint64_t>::value) out = view.as_uint64();
+        else if constexpr (std::is_same<T, int8_t>::value)   out = view.as_sint8();
+        else if constexpr (std::is_same<T, int16_t>::value)  out = view.as_sint16();
+        else if constexpr (std::is_same<T, int32_t>::value)  out = view.as_sint32();
+        else if constexpr (std::is_same<T, int64_t>::value)  out = view.as_sint64();
+        else if constexpr (std::is_same<T, float>::value)    out = view.as_float();
+        else                                                 out = view.as_double();
+    }
+
+    // Size of a record's children and END tag; a constant for schemas without strings
+    template<typename T>
+    inline int record_fields_size(const T& value)
+    {
+        return std::apply([&](const auto&... f) {
+            return (0 + ... + (int)(f.header.size() + field_payload_size(value.*(f.member))));
+        }, schema<T>::fields) + sizeof(uint8_t);
+    }
+    template<typename T>
+    inline int write_record_fields(uint8_t* buf, int index, const T& value)
+    {
+        int offset = index;
+        std::apply([&](const auto&... f) {
+            ((memcpy(buf + offset, f.header.data(), f.header.size()),
+              offset += f.header.size(),
+              offset += write_field_payload(buf, offset, value.*(f.member))), ...);
+        }, schema<T>::fields);
+        buf[offset] = tag_end;
+        offset++;
+        return offset - index;
+    }
+    // Bytes write_record will use, the same as compound_tag::serialized_size
+    template<typename T>
+    inline int record_size(std::string_view name, const T& value)
+    {
+        return sizeof(uint8_t) + string_size(name) + record_fields_size(value);
+    }
+    // Writes value as a compound with the given name
+    template<typename T>
+    inline int write_record(uint8_t* buf, int index, std::string_view name, const T& value)
+    {
+        int offset = index;
+        offset += tag::write_type(buf, offset, tag_compound);
+        offset += write_string(buf, offset, name);
+        offset += write_record_fields(buf, offset, value);
+        return offset - index;
+    }
+    // Like tag::serialize_to, returns the bytes written or -1 if the sink rejected them
+    template<typename T>
+    inline int serialize_record(sink& out, std::string_view name, const T& value)
+    {
+        int len = record_size(name, value);
+        uint8_t* buf = out.acquire(len);
+        if (buf == nullptr)
+            return -1;
+        write_record(buf, 0, name, value);
+        return out.commit(len) ? len : -1;
+    }
+    // Reads a compound into a described struct.
+    // Data laid out exactly as write_record writes it is decoded in one pass of
+    // memcmp'd headers; anything else (reordered, extra or missing fields) falls back
+    // to looking fields up by name, leaving missing ones untouched.
+    // Returns false if view isn't a compound.
+    template<typename T>
+    inline bool read_record(const tag_view& view, T& out)
+    {
+        if (view.type() != tag_compound)
+            return false;
+        // The memcmp fast path only understands the plain encoding
+        byte_span body = view.raw_payload();
+        const uint8_t* pos = body.data;
+        if (view.format() == 0 && read_record_fields(pos, body.data + body.size, out))
+            return true;
+        std::apply([&](const auto&... f) {
+            (read_field_view(view.find(f.name()), out.*(f.member)), ...);
+        }, schema<T>::fields);
+        return true;
+    }
+#pragma endregion
+#pragma region Queries
+    // Decodes one field from an in-memory tag, leaving out untouched on a type mismatch
+    template<typename T>
+    inline void read_field_tag(const tag* t, T& out)
+    {
+        if (t == nullptr)
+            return;
+        if constexpr (has_schema<T>::value) {
+            if (!is_compound(t->type()))
+                return;
+            auto& compound = static_cast<const compound_tag&>(*t);
+            std::apply([&](const auto&... f) {
+                (read_field_tag(compound.find(f.name()), out.*(f.member)), ...);
+            }, schema<T>::fields);
+        }
+        else if (t->type() != field_type<T>())
+            return;
+        else if constexpr (std::is_same<T, std::string>::value) out = static_cast<const string_tag*>(t)->value();
+        else if constexpr (std::is_same<T, uint8_t>::value)  out = static_cast<const uint8_tag*>(t)->value();
+        else if constexpr (std::is_same<T, uint16_t>::value) out = static_cast<const uint16_tag*>(t)->value();
+        else if constexpr (std::is_same<T, uint32_t>::value) out = static_cast<const uint32_tag*>(t)->value();
+        else if constexpr (std::is_same<T, uint64_t>::value) out = static_cast<const uint64_tag*>(t)->value();
+        else if constexpr (std::is_same<T, int8_t>::value)   out = static_cast<const sint8_tag*>(t)->value();
+        else if constexpr (std::is_same<T, int16_t>::value)  out = static_cast<const sint16_tag*>(t)->value();
+        else if constexpr (std::is_same<T, int32_t>::value)  out = static_cast<const sint32_tag*>(t)->value();
+        else if constexpr (std::is_same<T, int64_t>::value)  out = static_cast<const sint64_tag*>(t)->value();
+        else if constexpr (std::is_same<T, float>::value)    out = static_cast<const float_tag*>(t)->value();
+        else                                                 out = static_cast<const double_tag*>(t)->value();
+    }
+    // Path pattern parsed once and run against any number of trees or serialized buffers.
+    // Segments are '/' separated names below the root, or * for every child of a compound:
+    //
+    //     metabinary::path_query xs("ENTITIES/*/pos/x");
+    //     std::vector<float> out;
+    //     xs.extract(doc.root(), out);
+    //
+    // Over a tag_view, only the compounds on the path are entered; every other subtree
+    // is stepped over without being decoded, and compressed compounds are only
+    // decompressed if the path goes through them.
+    class path_query {
+    public:
+        path_query(std::string_view pattern)
+        {
+            while (!pattern.empty()) {
+                size_t slash = pattern.find('/');
+                std::string_view name = pattern.substr(0, slash);
+                segments.push_back({std::string(name), name == "*"});
+                pattern = slash == std::string_view::npos ? std::string_view() : pattern.substr(slash + 1);
+            }
+        }
+
+        // Calls visit with a view of each match, in serialized order
+        template<typename Visit>
+        void for_each(const tag_view& root, Visit visit) const
+        {
+            if (root.valid())
+                walk(root, 0, visit);
+        }
+        // Calls visit with each matching tag of a tree, in child order
+        template<typename Visit>
+        void for_each(tag& root, Visit visit) const
+        {
+            walk(&root, 0, visit);
+        }
+        // Appends every match of type T to out, which may be a scalar, std::string or a
+        // described struct. Matches of another type are left out.
+        // Returns the number of values appended.
+        template<typename T>
+        size_t extract(const tag_view& root, std::vector<T>& out) const
+        {
+            size_t before = out.size();
+            for_each(root, [&](const tag_view& match) {
+                std::vector<uint8_t> storage;
+                tag_view view = has_schema<T>::value ? match.expand(storage) : match;
+                if (view.type() != field_type<T>())
+                    return;
+                out.emplace_back();
+                read_field_view(view, out.back());
+            });
+            return out.size() - before;
+        }
+        template<typename T>
+        size_t extract(tag& root, std::vector<T>& out) const
+        {
+            size_t before = out.size();
+            for_each(root, [&](tag* match) {
+                if (has_schema<T>::value ? !is_compound(match->type()) : match->type() != field_type<T>())
+                    return;
+                out.emplace_back();
+                read_field_tag(match, out.back());
+            });
+            return out.size() - before;
+        }
+    private:
+        struct segment {
+            std::string name;
+            bool any;
+        };
+        template<typename Visit>
+        void walk(const tag_view& at, size_t depth, Visit& visit) const
+        {
+            if (depth == segments.size()) {
+                visit(at);
+                return;
+            }
+            if (!is_compound(at.type()))
+                return;
+            std::vector<uint8_t> storage;
+            tag_view parent = at.expand(storage);
+            const segment& s = segments[depth];
+            if (s.any) {
+                for (auto child : parent)
+                    walk(child, depth + 1, visit);
+            }
+            else if (tag_view child = parent.find(s.name); child.valid())
+                walk(child, depth + 1, visit);
+        }
+        template<typename Visit>
+        void walk(tag* at, size_t depth, Visit& visit) const
+        {
+            if (depth == segments.size()) {
+                visit(at);
+                return;
+            }
+            if (!is_compound(at->type()))
+                return;
+            auto& parent = static_cast<compound_tag&>(*at);
+            const segment& s = segments[depth];
+            if (s.any) {
+                for (tag* child : parent.children())
+                    walk(child, depth + 1, visit);
+            }
+            else if (tag* child = parent.find(s.name))
+                walk(child, depth + 1, visit);
+        }
+        std::vector<segment> segments;
+    };
+#pragma endregion
+}